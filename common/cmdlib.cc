@@ -27,6 +27,9 @@
 #ifdef WIN32
 #include <direct.h>
 #include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
 #endif
 
 #ifdef LINUX
@@ -199,6 +202,33 @@ I_FloatTime(void)
 #endif
 }
 
+/*
+ * ================
+ * I_PeakMemory
+ * Peak resident memory of the process so far, in kilobytes
+ * ================
+ */
+long
+I_PeakMemory(void)
+{
+#ifdef WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    /* the kernel32 export, so nothing extra needs linking */
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;      /* bytes on macOS */
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
 void
 Q_getwd(char *out)
 {
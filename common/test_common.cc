@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+
+#include <common/threads.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+TEST(threads, ParallelFor) {
+    const int oldnumthreads = numthreads;
+    numthreads = 4;
+    
+    const int start = 10, end = 10000;
+    std::vector<std::atomic<int>> visits(end);
+    for (auto &v : visits) {
+        v = 0;
+    }
+    
+    ParallelFor(start, end, [&](int i) {
+        visits[i]++;
+    });
+    
+    for (int i = 0; i < end; i++) {
+        ASSERT_EQ((i >= start) ? 1 : 0, visits[i].load());
+    }
+    
+    // grain larger than the range, and an empty range
+    std::atomic<int> count { 0 };
+    ParallelFor(0, 3, [&](int) { count++; }, 100);
+    ParallelFor(5, 5, [&](int) { count++; });
+    EXPECT_EQ(3, count.load());
+    
+    // ordered variant runs exactly the listed items
+    std::vector<int> order { 7, 3, 9, 0, 5 };
+    std::vector<std::atomic<int>> orderedVisits(10);
+    for (auto &v : orderedVisits) {
+        v = 0;
+    }
+    std::vector<threadstats_t> stats;
+    ParallelForOrdered(order, [&](int i) {
+        orderedVisits[i]++;
+    }, &stats);
+    
+    int totalItems = 0;
+    for (const auto &ts : stats) {
+        totalItems += ts.items;
+    }
+    EXPECT_EQ(4u, stats.size());
+    EXPECT_EQ(5, totalItems);
+    for (int i = 0; i < 10; i++) {
+        const bool listed = std::find(order.begin(), order.end(), i) != order.end();
+        EXPECT_EQ(listed ? 1 : 0, orderedVisits[i].load());
+    }
+    
+    numthreads = oldnumthreads;
+}
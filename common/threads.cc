@@ -310,3 +310,299 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
 }
 
 #endif
+
+/*
+ * =======================================================================
+ *                                PARALLEL FOR
+ * =======================================================================
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#ifdef HAVE_THREADS
+#include <thread>
+#endif
+
+/*
+ * Workers of the outermost ParallelFor that have run out of work. A
+ * ParallelFor called from inside func borrows them instead of going
+ * through RunThreadsOn, which can't nest.
+ */
+static std::atomic<int> idlethreads;
+static thread_local bool inparallelfor = false;
+
+/*
+ * One per worker. Only the owner takes from the front (begin), thieves
+ * take from the back (end), so the per-slice lock is rarely contended.
+ * Padded to keep neighbouring slices off the same cache line.
+ */
+struct workslice_t {
+    std::mutex lock;
+    int begin;
+    int end;
+    char pad[64];
+};
+
+struct parallel_for_t {
+    const std::function<void(int)> *func;
+    const int *order;   /* if set, run func(order[i]) instead of func(start + i) */
+    int start;
+    int count;
+    int grain;
+    int numslices;
+    bool nested;        /* called from inside another ParallelFor */
+    std::unique_ptr<workslice_t[]> slices;
+    std::unique_ptr<threadstats_t[]> stats;
+    std::chrono::steady_clock::time_point starttime;
+    std::atomic<int> nextslice;
+    std::atomic<int> completed;
+    std::atomic<int> percent;
+};
+
+static double
+ParallelFor_Seconds(const parallel_for_t *work, std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(t - work->starttime).count();
+}
+
+static void
+ParallelFor_Progress(parallel_for_t *work, int done)
+{
+    if (work->nested)
+        return; /* the outer loop owns the progress line */
+
+    const int percent = static_cast<int>(50LL * done / work->count);
+    int last = work->percent.load();
+
+    if (percent <= last)
+        return;
+    if (!work->percent.compare_exchange_strong(last, percent))
+        return; /* someone else is printing */
+
+    ThreadLock();
+    while (oldpercent < percent) {
+        oldpercent++;
+        logprint_locked__("%c", (oldpercent % 5) ? '.' : '0' + (oldpercent / 5));
+    }
+    ThreadUnlock();
+}
+
+/*
+ * Take the next chunk from the front of our own slice.
+ */
+static bool
+ParallelFor_TakeLocal(parallel_for_t *work, workslice_t *own, int *begin, int *end)
+{
+    std::lock_guard<std::mutex> guard(own->lock);
+
+    if (own->begin >= own->end)
+        return false;
+
+    *begin = own->begin;
+    *end = own->begin + work->grain;
+    if (*end > own->end)
+        *end = own->end;
+    own->begin = *end;
+    return true;
+}
+
+/*
+ * Move the back half of another worker's slice into our own.
+ */
+static bool
+ParallelFor_Steal(parallel_for_t *work, int self)
+{
+    for (int i = 1; i < work->numslices; i++) {
+        workslice_t *victim = &work->slices[(self + i) % work->numslices];
+        int begin, end;
+        {
+            std::lock_guard<std::mutex> guard(victim->lock);
+            const int remaining = victim->end - victim->begin;
+            if (remaining <= 0)
+                continue;
+
+            begin = victim->end - (remaining + 1) / 2;
+            end = victim->end;
+            victim->end = begin;
+        }
+
+        workslice_t *own = &work->slices[self];
+        std::lock_guard<std::mutex> guard(own->lock);
+        own->begin = begin;
+        own->end = end;
+        return true;
+    }
+    return false;
+}
+
+static void *
+ParallelForThread(void *arg)
+{
+    parallel_for_t *work = static_cast<parallel_for_t *>(arg);
+    const int self = work->nextslice++;
+    workslice_t *own = &work->slices[self];
+    threadstats_t *stats = &work->stats[self];
+
+    inparallelfor = true;
+
+    while (1) {
+        int begin, end;
+        if (!ParallelFor_TakeLocal(work, own, &begin, &end)) {
+            if (!ParallelFor_Steal(work, self))
+                break;
+            stats->steals++;
+            continue;
+        }
+
+        const auto chunkstart = std::chrono::steady_clock::now();
+        for (int i = begin; i < end; i++)
+            (*work->func)(work->order ? work->order[i] : work->start + i);
+        const auto chunkend = std::chrono::steady_clock::now();
+
+        stats->items += end - begin;
+        stats->busy += std::chrono::duration<double>(chunkend - chunkstart).count();
+        stats->finished = ParallelFor_Seconds(work, chunkend);
+
+        ParallelFor_Progress(work, work->completed += (end - begin));
+    }
+
+    if (!work->nested)
+        idlethreads++;
+
+    return NULL;
+}
+
+static void
+ParallelFor_Run(parallel_for_t *work, std::vector<threadstats_t> *stats)
+{
+    work->nextslice = 0;
+    work->completed = 0;
+    work->percent = -1;
+    work->stats.reset(new threadstats_t[work->numslices]());
+    work->starttime = std::chrono::steady_clock::now();
+
+    if (work->nested) {
+#ifdef HAVE_THREADS
+        /* the calling thread takes one slice, borrowed workers the rest */
+        std::vector<std::thread> helpers;
+        for (int i = 1; i < work->numslices; i++)
+            helpers.emplace_back(ParallelForThread, work);
+        ParallelForThread(work);
+        for (std::thread &helper : helpers)
+            helper.join();
+        idlethreads += work->numslices - 1;
+#else
+        ParallelForThread(work);
+#endif
+    } else {
+        idlethreads = 0;
+        RunThreadsOn(0, 0, ParallelForThread, work);
+        idlethreads = 0;
+        inparallelfor = false;
+    }
+
+    if (stats)
+        stats->assign(&work->stats[0], &work->stats[0] + work->numslices);
+}
+
+/*
+ * Outside of a ParallelFor, one slice per thread. Nested, the calling
+ * thread plus whatever idle workers it can claim, possibly none.
+ */
+static int
+ParallelFor_NumSlices(void)
+{
+#ifdef HAVE_THREADS
+    if (!inparallelfor)
+        return numthreads;
+
+    int idle = idlethreads.load();
+    int claim;
+    do {
+        claim = (idle < numthreads - 1) ? idle : numthreads - 1;
+        if (claim <= 0)
+            return 1;
+    } while (!idlethreads.compare_exchange_weak(idle, idle - claim));
+    return 1 + claim;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * =============
+ * ParallelFor
+ * =============
+ */
+void
+ParallelFor(int start, int end, const std::function<void(int)> &func, int grain,
+            std::vector<threadstats_t> *stats)
+{
+    const int numslices = ParallelFor_NumSlices();
+
+    parallel_for_t work;
+    work.func = &func;
+    work.order = nullptr;
+    work.start = start;
+    work.count = (end > start) ? (end - start) : 0;
+    work.numslices = numslices;
+    work.nested = inparallelfor;
+
+    /* aim for ~64 chunks per thread so stealing has something to balance */
+    work.grain = grain;
+    if (work.grain <= 0) {
+        work.grain = work.count / (numslices * 64);
+        if (work.grain < 1)
+            work.grain = 1;
+    }
+
+    /* hand each thread a contiguous, equal share up front */
+    work.slices.reset(new workslice_t[numslices]);
+    for (int i = 0; i < numslices; i++) {
+        work.slices[i].begin = static_cast<int>(static_cast<int64_t>(work.count) * i / numslices);
+        work.slices[i].end = static_cast<int>(static_cast<int64_t>(work.count) * (i + 1) / numslices);
+    }
+
+    ParallelFor_Run(&work, stats);
+}
+
+/*
+ * =============
+ * ParallelForOrdered
+ *
+ * The items are dealt round-robin, so slice t holds order[t],
+ * order[t + numthreads], ... and every thread starts on one of the most
+ * expensive items. Thieves take from the back, i.e. the cheapest items.
+ * =============
+ */
+void
+ParallelForOrdered(const std::vector<int> &order, const std::function<void(int)> &func,
+                   std::vector<threadstats_t> *stats)
+{
+    const int numslices = ParallelFor_NumSlices();
+    const int count = static_cast<int>(order.size());
+
+    std::vector<int> dealt;
+    dealt.reserve(count);
+
+    parallel_for_t work;
+    work.func = &func;
+    work.start = 0;
+    work.count = count;
+    work.grain = 1;
+    work.numslices = numslices;
+    work.nested = inparallelfor;
+    work.slices.reset(new workslice_t[numslices]);
+
+    for (int i = 0; i < numslices; i++) {
+        work.slices[i].begin = static_cast<int>(dealt.size());
+        for (int j = i; j < count; j += numslices)
+            dealt.push_back(order[j]);
+        work.slices[i].end = static_cast<int>(dealt.size());
+    }
+    work.order = dealt.data();
+
+    ParallelFor_Run(&work, stats);
+}
@@ -76,6 +76,7 @@ char *ExpandPath(char *path);
 char *ExpandPathAndArchive(char *path);
 
 double I_FloatTime(void);
+long I_PeakMemory(void);
 
 void Error(const char *error, ...)
     __attribute__((format(printf,1,2),noreturn));
@@ -3,6 +3,9 @@
 #ifndef __COMMON_THREADS_H__
 #define __COMMON_THREADS_H__
 
+#include <functional>
+#include <vector>
+
 extern int numthreads;
 
 void LowerProcessPriority(void);
@@ -11,6 +14,37 @@ int GetMaxThreads(void); /* returns 0 if no limit specified */
 int GetThreadWork(void);
 int GetThreadWork_Locked__(void); /* caller must take care of locking */
 void RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg);
+
+/* per-thread accounting from ParallelFor, one entry per thread */
+struct threadstats_t {
+    int items;          /* work items run */
+    int steals;         /* times work was taken from another thread */
+    double busy;        /* seconds spent inside func */
+    double finished;    /* seconds from the start until the last item finished */
+};
+
+/*
+ * Calls func(i) for each i in [start, end) using numthreads threads.
+ * Each thread owns a slice of the range and works through it in chunks of
+ * `grain` items; a thread that runs dry steals half of another thread's
+ * remaining slice. grain <= 0 picks a chunk size from the range length.
+ * ThreadLock() is usable from inside func.
+ *
+ * func may itself call ParallelFor; the inner loop then runs on the
+ * calling thread plus any threads of the outer loop that have run out
+ * of work, and prints no progress.
+ */
+void ParallelFor(int start, int end, const std::function<void(int)> &func, int grain = 0,
+                 std::vector<threadstats_t> *stats = nullptr);
+
+/*
+ * Calls func(order[i]) for each entry of order, which should be sorted
+ * most expensive first. Used to keep a few expensive items from running
+ * last on an otherwise idle machine.
+ */
+void ParallelForOrdered(const std::vector<int> &order, const std::function<void(int)> &func,
+                        std::vector<threadstats_t> *stats = nullptr);
+
 void ThreadLock(void);
 void ThreadUnlock(void);
 
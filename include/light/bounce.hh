@@ -23,17 +23,21 @@
 
 #include <common/cmdlib.hh>
 #include <common/mathlib.hh>
+#include <light/light.hh>
 
 #include <vector>
 #include <map>
 
 #include <common/qvec.hh>
 
+/* Color per light style, sorted by style. Most lights have only one. */
+typedef std::vector<std::pair<int, qvec3f>> bouncestyles_t;
+
 typedef struct {
     std::vector<qvec3f> poly;
     std::vector<qvec4f> poly_edgeplanes;
     qvec3f pos;
-    std::map<int, qvec3f> colorByStyle;
+    bouncestyles_t colorByStyle;
     qvec3f componentwiseMaxColor; // cached maximum color in the colorByStyle, used for culling so we don't need to loop through colorByStyle
     qvec3f surfnormal;
     float area;
@@ -43,12 +47,63 @@ typedef struct {
     vec3_t maxs;
 } bouncelight_t;
 
+/*
+ * Node of the bounce light tree. Leaves are single bounce lights; the rest
+ * bound everything below them, so a face can skip or approximate a whole
+ * cluster at once.
+ */
+typedef struct {
+    qvec3f mins, maxs;          // bounds of the light positions
+    vec3_t vismins, vismaxs;    // union of the lights' estimated visible AABBs
+    qvec3f axis;                // cone containing all the surface normals
+    float cosangle;             // cos of its half angle, -1 if it's everything
+    qvec3f maxpower;            // componentwise max of area * componentwiseMaxColor of any one light
+    qvec3f power;               // sum of area * componentwiseMaxColor
+    bouncestyles_t powerByStyle; // sum of area * color, per style
+    int representative;         // brightest light below, index into BounceLights()
+    int children[2];            // -1 for a leaf
+} bouncenode_t;
+
+/* What choosing a cut needs to know about the face being lit */
+typedef struct {
+    qvec3f origin;              // bounding sphere, as for sphere culling
+    float radius;
+    vec3_t mins, maxs;          // AABB, for visible AABB culling
+    qvec3f pointmins, pointmaxs; // bounds of the sample points
+    qvec3f normalmins, normalmaxs; // and of their normals
+    qvec3f normal;              // face normal
+} bouncereceiver_t;
+
+// returns color in [0,255]
+static inline qvec3f
+BounceLight_ColorAtDist(const globalconfig_t &cfg, float area, const qvec3f &bounceLightColor, float dist)
+{
+    // clamp away hotspots
+    if (dist < 128.0f) {
+        dist = 128.0f;
+    }
+    
+    const float dist2 = (dist * dist);
+    const float scale = (1.0f/dist2) * cfg.bouncescale.floatValue();
+    
+    // get light contribution
+    const qvec3f result = bounceLightColor * area * (255.0f * scale);
+    return result;
+}
+
 // public functions
 
 const std::vector<bouncelight_t> &BounceLights();
 const std::vector<int> &BounceLightsForFaceNum(int facenum);
 void MakeTextureColors (const mbsp_t *bsp);
 void MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp);
+void BounceStyles_Add(bouncestyles_t &styles, int style, const qvec3f &color);
+const qvec3f *BounceStyles_Find(const bouncestyles_t &styles, int style);
+const std::vector<bouncenode_t> &BounceLightTree();
+std::vector<bouncenode_t> MakeBounceLightTree(const std::vector<bouncelight_t> &lights);
+std::vector<int> BounceLightCut(const globalconfig_t &cfg, const std::vector<bouncenode_t> &tree,
+                                const std::vector<bouncelight_t> &lights,
+                                const bouncereceiver_t &receiver, float maxerror);
 /** Returns color components in [0, 255] */
 qvec3f Palette_GetColor(int i);
 
@@ -129,15 +129,24 @@ public:
 		}
 	}
     
+    template <typename Setting, typename Self>
+    static std::vector<Setting *> SettingsList(Self *self) {
+        return {
+            &self->light, &self->atten, &self->formula, &self->spotangle, &self->spotangle2, &self->style, &self->bleed, &self->anglescale,
+            &self->dirtscale, &self->dirtgain, &self->dirt, &self->deviance, &self->samples, &self->projfov, &self->bouncescale,
+            &self->dirt_off_radius, &self->dirt_on_radius,
+            &self->sun, //mxd
+            &self->falloff, //mxd
+            &self->origin, &self->color, &self->mangle, &self->projangle, &self->project_texture
+        };
+    }
+    
     settingsdict_t settings() {
-        return {{
-            &light, &atten, &formula, &spotangle, &spotangle2, &style, &bleed, &anglescale,
-            &dirtscale, &dirtgain, &dirt, &deviance, &samples, &projfov, &bouncescale,
-            &dirt_off_radius, &dirt_on_radius,
-            &sun, //mxd
-            &falloff, //mxd
-            &origin, &color, &mangle, &projangle, &project_texture
-        }};
+        return SettingsList<lockable_setting_t>(this);
+    }
+    
+    std::vector<const lockable_setting_t *> settings() const {
+        return SettingsList<const lockable_setting_t>(this);
     }
     
     void initAABB() {
@@ -167,6 +176,7 @@ public:
 std::string TargetnameForLightStyle(int style);
 const std::vector<light_t>& GetLights();
 const std::vector<sun_t>& GetSuns();
+std::vector<const light_t *> LightsTouchingBBox(const vec3_t mins, const vec3_t maxs);
 
 const entdict_t *FindEntDictWithKeyPair(const std::string &key, const std::string &value);
 const char *ValueForKey(const light_t *ent, const char *key);
@@ -80,6 +80,7 @@ typedef struct {
 
 class modelinfo_t;
 class globalconfig_t;
+class light_t;
 
 class lightmap_t {
 public:
@@ -145,6 +146,9 @@ typedef struct {
     // ray batch stuff
     raystream_t *stream;
     
+    /* lights whose estimated AABB touches this surface, see LightsTouchingBBox */
+    std::vector<const light_t *> lights;
+    
     lightmapdict_t lightmapsByStyle;
 } lightsurf_t;
 
@@ -245,11 +249,21 @@ public:
 		VectorSet(offset, 0, 0, 0);
 	}
     
+    /* the settings of a (const) object, as (const) lockable_setting_t's */
+    template <typename Setting, typename Self>
+    static std::vector<Setting *> SettingsList(Self *self) {
+        return {
+            &self->minlight, &self->shadow, &self->shadowself, &self->shadowworldonly, &self->switchableshadow, &self->switchshadstyle, &self->dirt, &self->phong, &self->phong_angle, &self->alpha,
+            &self->minlight_exclude, &self->minlight_color, &self->lightignore
+        };
+    }
+    
     settingsdict_t settings() {
-        return {{
-            &minlight, &shadow, &shadowself, &shadowworldonly, &switchableshadow, &switchshadstyle, &dirt, &phong, &phong_angle, &alpha,
-            &minlight_exclude, &minlight_color, &lightignore
-        }};
+        return SettingsList<lockable_setting_t>(this);
+    }
+    
+    std::vector<const lockable_setting_t *> settings() const {
+        return SettingsList<const lockable_setting_t>(this);
     }
 };
 
@@ -280,6 +294,7 @@ public:
     lockable_bool_t bounce;
     lockable_bool_t bouncestyled;
     lockable_vec_t bouncescale, bouncecolorscale;
+    lockable_vec_t bounceerror;
     
     /* sunlight */
     
@@ -325,6 +340,7 @@ public:
         bouncestyled {"bouncestyled", false},
         bouncescale {"bouncescale", 1.0f, 0.0f, 100.0f},
         bouncecolorscale {"bouncecolorscale", 0.0f, 0.0f, 1.0f},
+        bounceerror {"bounceerror", 0.02f, 0.0f, 1.0f},
 
         /* sun */
         sunlight         { "sunlight", 0.0f },                   /* main sun */
@@ -342,32 +358,41 @@ public:
         sun_deviance     { "sunlight_penumbra", 0.0f, 0.0f, 180.0f }
     {}
     
+    template <typename Setting, typename Self>
+    static std::vector<Setting *> SettingsList(Self *self) {
+        return {
+            &self->scaledist, &self->rangescale, &self->global_anglescale, &self->lightmapgamma,
+            &self->addminlight,
+            &self->minlight,
+            &self->minlight_color,
+            &self->spotlightautofalloff, //mxd
+            &self->globalDirt,
+            &self->dirtMode, &self->dirtDepth, &self->dirtScale, &self->dirtGain, &self->dirtAngle,
+            &self->minlightDirt,
+            &self->phongallowed,
+            &self->bounce, &self->bouncestyled, &self->bouncescale, &self->bouncecolorscale, &self->bounceerror,
+            &self->sunlight,
+            &self->sunlight_color,
+            &self->sun2,
+            &self->sun2_color,
+            &self->sunlight2,
+            &self->sunlight2_color,
+            &self->sunlight3,
+            &self->sunlight3_color,
+            &self->sunlight_dirt,
+            &self->sunlight2_dirt,
+            &self->sunvec,
+            &self->sun2vec,
+            &self->sun_deviance
+        };
+    }
+    
     settingsdict_t settings() {
-        return {{
-            &scaledist, &rangescale, &global_anglescale, &lightmapgamma,
-            &addminlight,
-            &minlight,
-            &minlight_color,
-            &spotlightautofalloff, //mxd
-            &globalDirt,
-            &dirtMode, &dirtDepth, &dirtScale, &dirtGain, &dirtAngle,
-            &minlightDirt,
-            &phongallowed,
-            &bounce, &bouncestyled, &bouncescale, &bouncecolorscale,
-            &sunlight,
-            &sunlight_color,
-            &sun2,
-            &sun2_color,
-            &sunlight2,
-            &sunlight2_color,
-            &sunlight3,
-            &sunlight3_color,
-            &sunlight_dirt,
-            &sunlight2_dirt,
-            &sunvec,
-            &sun2vec,
-            &sun_deviance
-        }};
+        return SettingsList<lockable_setting_t>(this);
+    }
+    
+    std::vector<const lockable_setting_t *> settings() const {
+        return SettingsList<const lockable_setting_t>(this);
     }
 };
 
@@ -376,12 +401,15 @@ extern byte *lit_filebase;
 extern byte *lux_filebase;
 
 extern int oversample;
+extern qboolean adaptivesampling;
 extern int write_litfile;
 extern int write_luxfile;
 extern qboolean onlyents;
 extern qboolean scaledonly;
 extern uint64_t *extended_texinfo_flags;
 extern qboolean novisapprox;
+extern qboolean pvscull;
+extern qboolean lightcache;
 extern bool nolights;
 
 typedef enum {
@@ -392,13 +420,15 @@ typedef enum {
 extern backend_t rtbackend;
 extern qboolean surflight_dump;
 extern char mapfilename[1024];
+extern std::vector<modelinfo_t *> modelinfo;
 
 // public functions
 
 lockable_setting_t *FindSetting(std::string name);
 void SetGlobalSetting(std::string name, std::string value, bool cmdline);
 void FixupGlobalSettings(void);
-void GetFileSpace(byte **lightdata, byte **colordata, byte **deluxdata, int size);
+void GetFaceSpace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup,
+                  byte **lightdata, byte **colordata, byte **deluxdata, int size);
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum);
 bool Leaf_HasSky(const mbsp_t *bsp, const mleaf_t *leaf);
@@ -0,0 +1,49 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_LIGHTCACHE_H__
+#define __LIGHT_LIGHTCACHE_H__
+
+#include <common/bspfile.hh>
+#include <light/light.hh>
+#include <light/litfile.hh>
+
+#include <vector>
+
+/* A light or bounce light, as far as the cache can tell them apart */
+typedef struct {
+    uint64_t hash;              // of everything about it that affects lighting
+    int32_t bounce;             // 1 for a bounce light
+    vec3_t mins, maxs;          // faces outside these can't be lit by it
+} lightcacherecord_t;
+
+// public functions
+
+std::vector<lightcacherecord_t> LightCache_ChangedLights(const std::vector<lightcacherecord_t> &before,
+                                                         const std::vector<lightcacherecord_t> &after);
+void LightCache_AddBounceClusters(const std::vector<lightcacherecord_t> &before,
+                                  const std::vector<lightcacherecord_t> &after,
+                                  std::vector<lightcacherecord_t> *changed);
+bool LightCache_FaceAffected(const vec3_t facemins, const vec3_t facemaxs,
+                             const std::vector<lightcacherecord_t> &changed);
+void LightCache_Load(const char *filename, const mbsp_t *bsp, const globalconfig_t &cfg);
+bool LightCache_Restore(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup);
+void LightCache_Store(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                      const lightsurf_t *lightsurf, const byte *out, const byte *lit, const byte *lux, int size);
+void LightCache_Write(const char *filename);
+
+#endif /* __LIGHT_LIGHTCACHE_H__ */
@@ -42,7 +42,11 @@
 
 extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
+extern std::atomic<uint64_t> total_bounce_rays_shared;
+extern std::atomic<uint64_t> total_adaptive_luxels, total_adaptive_refined;
 extern std::atomic<uint32_t> fully_transparent_lightmaps;
+extern std::atomic<uint64_t> total_lights_considered, total_lights_culled;
+extern std::atomic<uint64_t> total_lights_pvs_culled, total_pvs_rays_saved;
 
 class faceextents_t {
 private:
@@ -79,6 +83,7 @@ vec_t GetLightValue(const globalconfig_t &cfg, const light_t *entity, vec_t dist
 std::map<int, qvec3f> GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, const vec3_t origin, const vec3_t normal);
 void SetupDirt(globalconfig_t &cfg);
 float DirtAtPoint(const globalconfig_t &cfg, raystream_t *rs, const vec3_t point, const vec3_t normal, const modelinfo_t *selfshadow);
+float EstimateFaceCost(const mbsp_t *bsp, const bsp2_dface_t *face, float lightmapscale, const globalconfig_t &cfg);
 void LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg);
 
 #endif /* __LIGHT_LTFACE_H__ */
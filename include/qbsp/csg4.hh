@@ -22,7 +22,23 @@
 #ifndef QBSP_CSG4_HH
 #define QBSP_CSG4_HH
 
-extern int csgmergefaces;
+extern thread_local int csgmergefaces;
+
+/*
+ * CSGFaces in steps. Clipping one brush only reads the brush list, so
+ * CSGFaces_ClipBrush may run for different brushes on different threads.
+ * CSGFaces_AddSkip must then run on one thread before CSGFaces_Finish.
+ */
+struct csgbrushes_t {
+    std::vector<const brush_t *> brushes;       /* entity->brushes, in list order */
+    std::vector<std::vector<int>> touching;     /* per brush, brushes with overlapping bounds */
+    std::vector<face_t *> outside;              /* per brush, faces left after clipping */
+};
+
+void CSGFaces_Prepare(const mapentity_t *entity, csgbrushes_t *csg);
+void CSGFaces_ClipBrush(csgbrushes_t *csg, int i);
+void CSGFaces_AddSkip(csgbrushes_t *csg);
+surface_t *CSGFaces_Finish(csgbrushes_t *csg);
 
 // build surfaces is also used by GatherNodeFaces
 surface_t *BuildSurfaces(const std::map<int, face_t *> &planefaces);
@@ -189,7 +189,9 @@ void Entity_SortBrushes(mapentity_t *dst);
 
 
 surface_t *CSGFaces(const mapentity_t *entity);
-void PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum);
+void PortalizeWorld(const mapentity_t *entity, node_t *headnode, node_t *outside_node,
+                    const int hullnum);
+void FindHeadnodePlanes(const mapentity_t *entity);
 void TJunc(const mapentity_t *entity, node_t *headnode);
 node_t *SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit);
 int MakeFaceEdges(mapentity_t *entity, node_t *headnode);
@@ -22,7 +22,16 @@
 #ifndef QBSP_OUTSIDE_HH
 #define QBSP_OUTSIDE_HH
 
+#include <array>
+#include <vector>
+
+/* leak trail from the leaking entity out to the void, empty if no leak */
+struct leakline_t {
+    std::vector<std::array<vec_t, 3>> points;
+};
+
 node_t *PointInLeaf(node_t *node, const vec3_t point);
-bool FillOutside(node_t *node, const int hullnum);
+bool FillOutside(node_t *node, const node_t *outside_node, const int hullnum, leakline_t *leak);
+void WriteLeakFile(const leakline_t &leak);
 
 #endif
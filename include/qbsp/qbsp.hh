@@ -359,6 +359,8 @@ public:
     int dxSubdivide;
     int dxLeakDist;
         int maxNodeSize;
+        int bspTaskSurfaces;
+        int splitSample;
     char szMapName[512];
     char szBSPName[512];
     char wadPath[512];
@@ -390,6 +392,8 @@ public:
         this->fixRotateObjTexture = true;
         this->fOldaxis = true;
         this->maxNodeSize = 1024;
+        this->bspTaskSurfaces = 512;
+        this->splitSample = 0;
         this->on_epsilon = 0.0001;
     }
 };
@@ -22,6 +22,10 @@
 #ifndef QBSP_UTIL_HH
 #define QBSP_UTIL_HH
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #define msgWarning      1
 #define msgStat         2
 #define msgProgress     3
@@ -41,7 +45,26 @@ void FreeMem(void *pMem, int Type, int cSize);
 void FreeAllMem(void);
 void PrintMem(void);
 
+/* Memory released all at once, see AllocArena */
+struct memarena_t;
+
+memarena_t *AllocArena(void);
+void ReportArena(memarena_t *arena, const char *phase);
+void FreeArena(memarena_t *arena);
+memarena_t *UseArena(memarena_t *arena);
+memarena_t *CurrentArena(void);
+
 void Message(int MsgType, ...);
+
+/* Messages held back from a worker thread, see Message_Capture */
+struct msgcapture_t {
+    bool verbose;       /* stands in for options.fVerbose */
+    std::vector<std::pair<int, std::string>> lines;
+};
+
+msgcapture_t *Message_Capture(msgcapture_t *capture);
+msgcapture_t *Message_CurrentCapture(void);
+void Message_Replay(const msgcapture_t *capture);
 void Error(const char *error, ...)
     __attribute__((format(printf,1,2),noreturn));
 
@@ -81,4 +81,22 @@ LeafbitsSize(int numleafs)
 	return sizeof(leafbits_t) + (sizeof(leafblock_t) * numblocks);
 }
 
+/*
+ * Whole-bitstring operations over numblocks blocks, dispatched at runtime
+ * to the widest SIMD implementation the CPU supports (see leafbits.cc).
+ */
+
+/* dst = a & b; returns true if dst has any bit not set in seen */
+bool Leafbits_AndNew(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+                     const leafblock_t *seen, int numblocks);
+/* returns true if a has any bit not set in b */
+bool Leafbits_AnyAndNot(const leafblock_t *a, const leafblock_t *b, int numblocks);
+/* dst |= src */
+void Leafbits_Or(leafblock_t *dst, const leafblock_t *src, int numblocks);
+/* number of bits set */
+int Leafbits_Count(const leafblock_t *bits, int numblocks);
+
+const char *Leafbits_Implementation(void);
+bool Leafbits_UseImplementation(const char *name);
+
 #endif /* VIS_LEAFBITS_H */
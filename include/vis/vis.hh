@@ -24,6 +24,9 @@
 #include <common/bspfile.hh>
 #include <vis/leafbits.hh>
 
+#include <mutex>
+#include <vector>
+
 #define  PORTALFILE  "PRT1"
 #define  PORTALFILE2 "PRT2"
 #define  PORTALFILEAM "PRT1-AM"
@@ -92,16 +95,30 @@ typedef struct pstack_s {
     leafbits_t *mightsee;       // bit string
     plane_t separators[2][MAX_SEPARATORS]; /* Separator cache */
     int numseparators[2];
+    int depth;                  // recursion depth, 0 for the head
 } pstack_t;
 
 winding_t *AllocStackWinding(pstack_t *stack);
 void FreeStackWinding(winding_t *w, pstack_t *stack);
 winding_t *ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split);
 
+/*
+ * The mightsee bits of each recursion level of RecursiveLeafFlow. Kept per
+ * thread and reused for every portal it flows, so the recursion itself
+ * never allocates. Grows a level at a time; existing levels never move.
+ */
+struct leafstack_t {
+    std::vector<leafbits_t *> levels;   // cache aligned
+    std::vector<void *> memory;         // as returned by malloc
+    int numleafs = 0;                   // the levels' size, in leafs
+    ~leafstack_t();
+};
+
 typedef struct {
     leafbits_t *leafvis;
     portal_t *base;
     pstack_t pstack_head;
+    leafstack_t *leafstack;
 } threaddata_t;
 
 extern int numportals;
@@ -116,10 +133,15 @@ extern int c_noclip;
 extern int c_portaltest, c_portalpass, c_portalcheck;
 extern int c_vistest, c_mighttest;
 extern unsigned long c_chains;
+extern int c_leafstackmallocs, c_leafstackdepth;
 
 extern qboolean showgetleaf;
 
 extern int testlevel;
+extern vec_t farplane;
+extern qboolean incremental;
+extern qboolean coarsevis;
+extern qboolean coarsepass;
 extern qboolean ambientsky;
 extern qboolean ambientwater;
 extern qboolean ambientslime;
@@ -134,8 +156,12 @@ extern char sourcefile[1024];
 extern char portalfile[1024];
 extern char statefile[1024];
 extern char statetmpfile[1024];
+extern char journalfile[1024];
 
 void BasePortalVis(void);
+bool PortalMightSee(const portal_t *srcportal, const portal_t *p);
+void CoarsePortalVis(void);
+void FlowPortals(int startcount);
 
 void PortalFlow(portal_t *p);
 
@@ -143,8 +169,17 @@ void CalcAmbientSounds(mbsp_t *bsp);
 
 extern double starttime, endtime, statetime;
 
+/* guards portal status and the mightsee of portals not yet flowed */
+extern std::mutex portal_lock;
+
 void SaveVisState(void);
 qboolean LoadVisState(void);
+int ReuseVisState(void);
+
+void StartVisCheckpoints(double stateinterval, double journalinterval);
+void StopVisCheckpoints(void);
+void JournalPortal(const portal_t *p);
+void JournalUnseen(const leaf_t *leaf, const std::vector<int> &unseen);
 
 /* Print winding/leaf info for debugging */
 void LogWinding(const winding_t *w);
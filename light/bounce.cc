@@ -37,6 +37,7 @@
 #include <set>
 #include <algorithm>
 #include <mutex>
+#include <queue>
 #include <string>
 
 #include <common/qvec.hh>
@@ -48,6 +49,7 @@ mutex radlights_lock;
 map<string, qvec3f> texturecolors;
 std::vector<bouncelight_t> radlights;
 std::map<int, std::vector<int>> radlightsByFacenum;
+std::vector<bouncenode_t> bouncetree;
 
 class patch_t {
 public:
@@ -80,11 +82,6 @@ MakePatch (const globalconfig_t &cfg, winding_t *w)
     return p;
 }
 
-struct make_bounce_lights_args_t {
-    const mbsp_t *bsp;
-    const globalconfig_t *cfg;
-};
-
 struct save_winding_args_t {
     vector<unique_ptr<patch_t>> *patches;
     const globalconfig_t *cfg;
@@ -133,89 +130,78 @@ Face_LookupTextureColor(const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t colo
 static void
 AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, const vec3_t surfnormal, vec_t area, const bsp2_dface_t *face, const mbsp_t *bsp);
 
-static void *
-MakeBounceLightsThread (void *arg)
+static void
+MakeBounceLightsForFace (const mbsp_t *bsp, const globalconfig_t &cfg, int i)
 {
-    const mbsp_t *bsp = static_cast<make_bounce_lights_args_t *>(arg)->bsp;
-    const globalconfig_t &cfg = *static_cast<make_bounce_lights_args_t *>(arg)->cfg;
+    const bsp2_dface_t *face = BSP_GetFace(bsp, i);
     
-    while (1) {
-        int i = GetThreadWork();
-        if (i == -1)
-            break;
+    if (!Face_ShouldBounce(bsp, face)) {
+        return;
+    }
+    
+    vector<unique_ptr<patch_t>> patches;
+    
+    winding_t *winding = WindingFromFace(bsp, face);
+    // grab some info about the face winding
+    const float facearea = WindingArea(winding);
+    
+    plane_t faceplane;
+    WindingPlane(winding, faceplane.normal, &faceplane.dist);
+    
+    vec3_t facemidpoint;
+    WindingCenter(winding, facemidpoint);
+    VectorMA(facemidpoint, 1, faceplane.normal, facemidpoint); // lift 1 unit
+    
+    save_winding_args_t args;
+    args.patches = &patches;
+    args.cfg = &cfg;
+    
+    DiceWinding(winding, 64.0f, SaveWindingFn, &args);
+    winding = nullptr; // DiceWinding frees winding
     
-        const bsp2_dface_t *face = BSP_GetFace(bsp, i);
+    // average them, area weighted
+    map<int, qvec3f> sum;
+    float totalarea = 0;
+    
+    for (const auto &patch : patches) {
+        const float patcharea = WindingArea(patch->w);
+        totalarea += patcharea;
         
-        if (!Face_ShouldBounce(bsp, face)) {
-            continue;
+        for (const auto &styleColor : patch->lightByStyle) {
+            sum[styleColor.first] = sum[styleColor.first] + (styleColor.second * patcharea);
         }
-        
-        vector<unique_ptr<patch_t>> patches;
-        
-        winding_t *winding = WindingFromFace(bsp, face);
-        // grab some info about the face winding
-        const float facearea = WindingArea(winding);
-        
-        plane_t faceplane;
-        WindingPlane(winding, faceplane.normal, &faceplane.dist);
-        
-        vec3_t facemidpoint;
-        WindingCenter(winding, facemidpoint);
-        VectorMA(facemidpoint, 1, faceplane.normal, facemidpoint); // lift 1 unit
-        
-        save_winding_args_t args;
-        args.patches = &patches;
-        args.cfg = &cfg;
-        
-        DiceWinding(winding, 64.0f, SaveWindingFn, &args);
-        winding = nullptr; // DiceWinding frees winding
-        
-        // average them, area weighted
-        map<int, qvec3f> sum;
-        float totalarea = 0;
-        
-        for (const auto &patch : patches) {
-            const float patcharea = WindingArea(patch->w);
-            totalarea += patcharea;
-            
-            for (const auto &styleColor : patch->lightByStyle) {
-                sum[styleColor.first] = sum[styleColor.first] + (styleColor.second * patcharea);
-            }
 //              printf("  %f %f %f\n", patch->directlight[0], patch->directlight[1], patch->directlight[2]);
-        }
-        
-        for (auto &styleColor : sum) {
-            styleColor.second *= (1.0/totalarea);
-        }
-        
-        // avoid small, or zero-area patches ("sum" would be nan)
-        if (totalarea < 1) {
-            continue;
-        }
+    }
     
-        vec3_t texturecolor;
-        Face_LookupTextureColor(bsp, face, texturecolor);
-        
-        // lerp between gray and the texture color according to `bouncecolorscale`
-        const vec3_t gray = {127, 127, 127};
-        vec3_t blendedcolor = {0, 0, 0};
-        VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
-        VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
-        
-        // final colors to emit
-        map<int, qvec3f> emitcolors;
-        for (const auto &styleColor : sum) {
-            qvec3f emitcolor(0);
-            for (int k=0; k<3; k++) {
-                emitcolor[k] = (styleColor.second[k] / 255.0f) * (blendedcolor[k] / 255.0f);
-            }
-            emitcolors[styleColor.first] = emitcolor;
-        }
-
-        AddBounceLight(facemidpoint, emitcolors, faceplane.normal, facearea, face, bsp);
+    for (auto &styleColor : sum) {
+        styleColor.second *= (1.0/totalarea);
     }
     
-    return NULL;
+    // avoid small, or zero-area patches ("sum" would be nan)
+    if (totalarea < 1) {
+        return;
+    }
+
+    vec3_t texturecolor;
+    Face_LookupTextureColor(bsp, face, texturecolor);
+    
+    // lerp between gray and the texture color according to `bouncecolorscale`
+    const vec3_t gray = {127, 127, 127};
+    vec3_t blendedcolor = {0, 0, 0};
+    VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
+    VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
+    
+    // final colors to emit
+    map<int, qvec3f> emitcolors;
+    for (const auto &styleColor : sum) {
+        qvec3f emitcolor(0);
+        for (int k=0; k<3; k++) {
+            emitcolor[k] = (styleColor.second[k] / 255.0f) * (blendedcolor[k] / 255.0f);
+        }
+        emitcolors[styleColor.first] = emitcolor;
+    }
+
+    AddBounceLight(facemidpoint, emitcolors, faceplane.normal, facearea, face, bsp);
 }
 
 static void
@@ -232,7 +218,7 @@ AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, cons
     l.poly = GLM_FacePoints(bsp, face);
     l.poly_edgeplanes = GLM_MakeInwardFacingEdgePlanes(l.poly);
     l.pos = vec3_t_to_glm(pos);
-    l.colorByStyle = colorByStyle;
+    l.colorByStyle.assign(colorByStyle.begin(), colorByStyle.end());
     
     qvec3f componentwiseMaxColor(0);
     for (const auto &styleColor : colorByStyle) {
@@ -264,6 +250,272 @@ const std::vector<bouncelight_t> &BounceLights()
     return radlights;
 }
 
+void BounceStyles_Add(bouncestyles_t &styles, int style, const qvec3f &color)
+{
+    auto it = std::lower_bound(styles.begin(), styles.end(), style,
+                               [](const std::pair<int, qvec3f> &styleColor, int s) { return styleColor.first < s; });
+    if (it != styles.end() && it->first == style)
+        it->second += color;
+    else
+        styles.insert(it, std::make_pair(style, color));
+}
+
+const qvec3f *BounceStyles_Find(const bouncestyles_t &styles, int style)
+{
+    for (const auto &styleColor : styles) {
+        if (styleColor.first == style)
+            return &styleColor.second;
+    }
+    return nullptr;
+}
+
+const std::vector<bouncenode_t> &BounceLightTree()
+{
+    return bouncetree;
+}
+
+static int
+BuildBounceNode(std::vector<bouncenode_t> &tree, const std::vector<bouncelight_t> &lights, int *indices, int count)
+{
+    const int nodenum = static_cast<int>(tree.size());
+    tree.push_back(bouncenode_t());
+    
+    if (count == 1) {
+        const bouncelight_t &l = lights[indices[0]];
+        bouncenode_t &node = tree[nodenum];
+        node.mins = node.maxs = l.pos;
+        VectorCopy(l.mins, node.vismins);
+        VectorCopy(l.maxs, node.vismaxs);
+        node.axis = l.surfnormal;
+        node.cosangle = 1.0f;
+        node.maxpower = node.power = l.componentwiseMaxColor * l.area;
+        for (const auto &styleColor : l.colorByStyle) {
+            node.powerByStyle.push_back(std::make_pair(styleColor.first, styleColor.second * l.area));
+        }
+        node.representative = indices[0];
+        node.children[0] = node.children[1] = -1;
+        return nodenum;
+    }
+    
+    // split at the median along the longest axis of the positions
+    qvec3f mins = lights[indices[0]].pos;
+    qvec3f maxs = mins;
+    for (int i = 1; i < count; i++) {
+        mins = qv::min(mins, lights[indices[i]].pos);
+        maxs = qv::max(maxs, lights[indices[i]].pos);
+    }
+    const qvec3f size = maxs - mins;
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (size[i] > size[axis])
+            axis = i;
+    }
+    
+    const int half = count / 2;
+    std::nth_element(indices, indices + half, indices + count, [&](int a, int b) {
+        return lights[a].pos[axis] < lights[b].pos[axis];
+    });
+    const int left = BuildBounceNode(tree, lights, indices, half);
+    const int right = BuildBounceNode(tree, lights, indices + half, count - half);
+    
+    // the recursion grew the vector, so only take references now
+    const bouncenode_t &a = tree[left];
+    const bouncenode_t &b = tree[right];
+    bouncenode_t &node = tree[nodenum];
+    
+    node.mins = qv::min(a.mins, b.mins);
+    node.maxs = qv::max(a.maxs, b.maxs);
+    for (int i = 0; i < 3; i++) {
+        node.vismins[i] = qmin(a.vismins[i], b.vismins[i]);
+        node.vismaxs[i] = qmax(a.vismaxs[i], b.vismaxs[i]);
+    }
+    
+    // a cone around both children's cones
+    const qvec3f axissum = a.axis + b.axis;
+    node.cosangle = -1.0f;
+    node.axis = a.axis;
+    if (qv::length(axissum) > 0.001f) {
+        node.axis = qv::normalize(axissum);
+        float angle = 0;
+        for (const bouncenode_t *child : {&a, &b}) {
+            const float between = acos(qclamp(qv::dot(node.axis, child->axis), -1.0f, 1.0f));
+            const float childangle = child->cosangle <= -1.0f ? Q_PI : acos(child->cosangle);
+            angle = qmax(angle, between + childangle);
+        }
+        if (angle < Q_PI)
+            node.cosangle = cos(angle);
+    }
+    
+    node.maxpower = qv::max(a.maxpower, b.maxpower);
+    node.power = a.power + b.power;
+    node.powerByStyle = a.powerByStyle;
+    for (const auto &stylePower : b.powerByStyle) {
+        BounceStyles_Add(node.powerByStyle, stylePower.first, stylePower.second);
+    }
+    
+    const float brightnessA = LightSample_Brightness(lights[a.representative].componentwiseMaxColor) * lights[a.representative].area;
+    const float brightnessB = LightSample_Brightness(lights[b.representative].componentwiseMaxColor) * lights[b.representative].area;
+    node.representative = brightnessA >= brightnessB ? a.representative : b.representative;
+    node.children[0] = left;
+    node.children[1] = right;
+    return nodenum;
+}
+
+/*
+ * Builds a binary tree over the bounce lights by splitting at the median of
+ * the longest axis. The root is node 0.
+ */
+std::vector<bouncenode_t>
+MakeBounceLightTree(const std::vector<bouncelight_t> &lights)
+{
+    std::vector<bouncenode_t> tree;
+    
+    if (lights.empty())
+        return tree;
+    
+    std::vector<int> indices(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        indices[i] = static_cast<int>(i);
+    }
+    tree.reserve(lights.size() * 2 - 1);
+    BuildBounceNode(tree, lights, indices.data(), static_cast<int>(indices.size()));
+    return tree;
+}
+
+/*
+ * Upper bound on the brightness everything in the node could add to any one
+ * sample point of the face, or 0 if none of it can reach the face at all.
+ * For a leaf, anything under 0.25 means LightFace_Bounce would have culled
+ * the light, or dropped it at every sample point.
+ */
+static float
+BounceNode_Bound(const globalconfig_t &cfg, const bouncenode_t &node, const bouncereceiver_t &receiver)
+{
+    if (!novisapprox && AABBsDisjoint(node.vismins, node.vismaxs, receiver.mins, receiver.maxs))
+        return 0;
+    
+    // sphere cull, measured from the nearest light position
+    const qvec3f nearest = qv::min(qv::max(receiver.origin, node.mins), node.maxs);
+    const float spheredist = qv::length(receiver.origin - nearest) + receiver.radius;
+    if (LightSample_Brightness(BounceLight_ColorAtDist(cfg, 1.0f, node.maxpower, spheredist)) < 0.25f)
+        return 0;
+    
+    const qvec3f lo = receiver.pointmins - node.maxs;  // bounds of light -> sample point vectors
+    const qvec3f hi = receiver.pointmaxs - node.mins;
+    float gap2 = 0, maxlength2 = 0;
+    float lightdot = 0, receiverdot = 0;
+    for (int i = 0; i < 3; i++) {
+        const float nearest = lo[i] > 0 ? lo[i] : (hi[i] < 0 ? hi[i] : 0);
+        gap2 += nearest * nearest;
+        maxlength2 += qmax(lo[i] * lo[i], hi[i] * hi[i]);
+        lightdot += node.axis[i] * (node.axis[i] > 0 ? hi[i] : lo[i]);
+        receiverdot += qmax(qmax(-receiver.normalmins[i] * lo[i], -receiver.normalmins[i] * hi[i]),
+                            qmax(-receiver.normalmaxs[i] * lo[i], -receiver.normalmaxs[i] * hi[i]));
+    }
+    const float gap = sqrt(gap2);
+    
+    // all the sample points are behind all the lights, or the other way round
+    if (receiverdot <= 0)
+        return 0;
+    const float sinangle = node.cosangle > -1.0f ? sqrt(1.0f - node.cosangle * node.cosangle) : 1.0f;
+    if (node.cosangle > 0 && lightdot < -sinangle * sqrt(maxlength2))
+        return 0;
+    
+    // bound the cosines at both ends, as GetIndirectLighting applies them
+    float lightcos = 1, receivercos = 1;
+    if (gap > 0) {
+        receivercos = qmin(1.0f, receiverdot / gap);
+        if (lightdot <= 0) {
+            lightcos = node.cosangle > 0 ? sinangle : 1.0f;
+        } else {
+            const float mincone = acos(qmin(1.0f, lightdot / gap));
+            const float angle = node.cosangle > -1.0f ? acos(node.cosangle) : Q_PI;
+            lightcos = mincone > angle ? cos(mincone - angle) : 1.0f;
+        }
+    }
+    
+    // all of it, at the nearest a sample point could be
+    return LightSample_Brightness(BounceLight_ColorAtDist(cfg, 1.0f, node.power, gap)) * lightcos * receivercos;
+}
+
+/* Unshadowed brightness of the node at the middle of the face, lit as its representative */
+static float
+BounceNode_Estimate(const globalconfig_t &cfg, const bouncenode_t &node, const bouncelight_t &representative,
+                    const bouncereceiver_t &receiver)
+{
+    qvec3f dir = receiver.origin - representative.pos;
+    const float dist = qv::length(dir);
+    if (dist == 0.0f)
+        return 0;
+    dir /= dist;
+    
+    const float dp1 = qv::dot(representative.surfnormal, dir);
+    const float dp2 = -qv::dot(dir, receiver.normal);
+    if (dp1 < 0.0f || dp2 < 0.0f)
+        return 0;
+    
+    return LightSample_Brightness(BounceLight_ColorAtDist(cfg, 1.0f, node.power, dist)) * dp1 * dp2;
+}
+
+/*
+ * Chooses which bounce lights and clusters of them to light the face with,
+ * lightcuts style: starting from the root, the cluster with the largest
+ * error bound is split until every bound is within maxerror times the
+ * estimated total. Leaves are exact, so with maxerror 0 this is every light
+ * that could add anything. Returns node numbers.
+ */
+std::vector<int>
+BounceLightCut(const globalconfig_t &cfg, const std::vector<bouncenode_t> &tree,
+               const std::vector<bouncelight_t> &lights,
+               const bouncereceiver_t &receiver, float maxerror)
+{
+    struct cluster_t {
+        float bound;
+        float estimate;
+        int nodenum;
+        bool operator<(const cluster_t &other) const { return bound < other.bound; }
+    };
+    
+    std::vector<int> cut;
+    std::priority_queue<cluster_t> clusters;
+    float total = 0;
+    
+    auto add = [&](int nodenum) {
+        const bouncenode_t &node = tree[nodenum];
+        const float bound = BounceNode_Bound(cfg, node, receiver);
+        
+        // nothing it could add would get past the per-sample 0.25 cutoff
+        if (bound < 0.25f)
+            return;
+        const float estimate = BounceNode_Estimate(cfg, node, lights[node.representative], receiver);
+        total += estimate;
+        if (node.children[0] == -1) {
+            cut.push_back(nodenum);
+            return;
+        }
+        clusters.push(cluster_t { bound, estimate, nodenum });
+    };
+    
+    if (tree.empty())
+        return cut;
+    
+    add(0);
+    while (!clusters.empty()) {
+        const cluster_t worst = clusters.top();
+        if (worst.bound <= maxerror * total)
+            break;
+        clusters.pop();
+        total -= worst.estimate;
+        add(tree[worst.nodenum].children[0]);
+        add(tree[worst.nodenum].children[1]);
+    }
+    
+    for (; !clusters.empty(); clusters.pop()) {
+        cut.push_back(clusters.top().nodenum);
+    }
+    return cut;
+}
+
 const std::vector<int> &BounceLightsForFaceNum(int facenum)
 {
     const auto &vec = radlightsByFacenum.find(facenum);
@@ -333,9 +585,11 @@ MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp)
     
     const dmodel_t *model = &bsp->dmodels[0];
     
-    make_bounce_lights_args_t args;
-    args.bsp = bsp;
-    args.cfg = &cfg;
+    ParallelFor(model->firstface, model->firstface + model->numfaces, [&](int i) {
+        MakeBounceLightsForFace(bsp, cfg, i);
+    });
     
-    RunThreadsOn(model->firstface, model->firstface + model->numfaces, MakeBounceLightsThread, (void *)&args);
+    bouncetree = MakeBounceLightTree(radlights);
+    logprint("%d bounce lights, %d bounce light tree nodes\n",
+             static_cast<int>(radlights.size()), static_cast<int>(bouncetree.size()));
 }
@@ -25,6 +25,7 @@
 #include <light/entities.hh>
 #include <light/ltface.hh>
 #include <common/bsputils.hh>
+#include <common/octree.hh>
 
 using strings = std::vector<std::string>;
 
@@ -41,6 +42,9 @@ const std::vector<sun_t>& GetSuns() {
     return all_suns;
 }
 
+/* spatial index over the estimated light AABBs, built by SetupLights */
+static octree_t<int> *light_octree = nullptr;
+
 /* surface lights */
 static void MakeSurfaceLights(const mbsp_t *bsp);
 
@@ -1245,6 +1249,49 @@ void EstimateLightVisibility(void)
     RunThreadsOn(0, static_cast<int>(all_lights.size()), EstimateLightAABBThread, nullptr);
 }
 
+static void
+BuildLightOctree(void)
+{
+    /* with -novisapprox there are no AABBs to index */
+    if (novisapprox)
+        return;
+    
+    std::vector<std::pair<aabb3f, int>> objects;
+    for (int i = 0; i < static_cast<int>(all_lights.size()); i++) {
+        const light_t &light = all_lights[i];
+        objects.push_back(std::make_pair(aabb3f(vec3_t_to_glm(light.mins), vec3_t_to_glm(light.maxs)), i));
+    }
+    
+    light_octree = new octree_t<int>(makeOctree(objects));
+}
+
+/*
+ * Returns the lights whose estimated visible AABB touches the given box,
+ * in the same order as GetLights(). Callers still need CullLight(), this
+ * only throws away lights that can't possibly reach the box.
+ */
+std::vector<const light_t *>
+LightsTouchingBBox(const vec3_t mins, const vec3_t maxs)
+{
+    std::vector<const light_t *> result;
+    
+    if (light_octree == nullptr) {
+        for (const light_t &light : all_lights) {
+            result.push_back(&light);
+        }
+        return result;
+    }
+    
+    /* grow the query slightly, AABBsDisjoint has an epsilon */
+    const aabb3f query = aabb3f(vec3_t_to_glm(mins), vec3_t_to_glm(maxs)).grow(qvec3f(1, 1, 1));
+    
+    /* the octree returns sorted indices, so the order of GetLights() is kept */
+    for (const int i : light_octree->queryTouchingBBox(query)) {
+        result.push_back(&all_lights[i]);
+    }
+    return result;
+}
+
 void
 SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
 {
@@ -1267,6 +1314,7 @@ SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
     SetupSkyDome(cfg);
     FixLightsOnFaces(bsp);
     EstimateLightVisibility();
+    BuildLightOctree();
     
     logprint("Final count: %d lights %d suns in use.\n",
              static_cast<int>(all_lights.size()),
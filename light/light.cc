@@ -27,6 +27,8 @@
 #include <light/bounce.hh>
 #include <light/entities.hh>
 #include <light/ltface.hh>
+#include <light/pvs.hh>
+#include <light/lightcache.hh>
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
@@ -66,17 +68,20 @@ qboolean surflight_dump = false;
 static facesup_t *faces_sup;    //lit2/bspx stuff
 
 byte *filebase;                 // start of lightmap data
-static byte *file_p;            // start of free space after data
-static byte *file_end;          // end of free space for lightmap data
-
 byte *lit_filebase;             // start of litfile data
-static byte *lit_file_p;        // start of free space after litfile data
-static byte *lit_file_end;      // end of space for litfile data
-
-byte *lux_buffer;               // luxfile allocation (misaligned)
 byte *lux_filebase;             // start of luxfile data
-static byte *lux_file_p;        // start of free space after luxfile data
-static byte *lux_file_end;      // end of space for luxfile data
+
+/*
+ * Each face's lightmaps as LightFace leaves them, two slots per face: the
+ * face itself, then its facesup. They're laid out into the lumps in face
+ * order once every face is lit.
+ */
+typedef struct {
+    bool used;
+    std::vector<byte> out, lit, lux;
+} facelightmaps_t;
+
+static std::vector<facelightmaps_t> facelightmaps;
 
 std::vector<modelinfo_t *> modelinfo;
 std::vector<const modelinfo_t *> tracelist;
@@ -85,10 +90,14 @@ std::vector<const modelinfo_t *> shadowworldonlylist;
 std::vector<const modelinfo_t *> switchableshadowlist;
 
 int oversample = 1;
+qboolean adaptivesampling = false;
 int write_litfile = 0;  /* 0 for none, 1 for .lit, 2 for bspx, 3 for both */
 int write_luxfile = 0;  /* 0 for none, 1 for .lux, 2 for bspx, 3 for both */
 qboolean onlyents = false;
 qboolean novisapprox = false;
+qboolean pvscull = false;
+qboolean lightcache = false;
+static char lightcachefile[1024];
 bool nolights = false;
 backend_t rtbackend = backend_embree;
 bool debug_highlightseams = false;
@@ -160,42 +169,86 @@ PrintOptionsSummary(void)
 }
 
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
+ * Return space for a face's lightmap, colourmap and deluxemap. Only the
+ * thread lighting the face touches its space, so no locking is needed. The
+ * face's lightofs is set to 0 until LayoutLightmaps gives it the real one.
  */
 void
-GetFileSpace(byte **lightdata, byte **colordata, byte **deluxdata, int size)
+GetFaceSpace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup,
+             byte **lightdata, byte **colordata, byte **deluxdata, int size)
 {
-    ThreadLock();
-
-    /* align to 4 byte boudaries */
-    file_p = (byte *)(((uintptr_t)file_p + 3) & ~3);
-    *lightdata = file_p;
-    file_p += size;
-
-    if (colordata) {
-        /* align to 12 byte boundaries to match offets with 3 * lightdata */
-        if ((uintptr_t)lit_file_p % 12)
-            lit_file_p += 12 - ((uintptr_t)lit_file_p % 12);
-        *colordata = lit_file_p;
-        lit_file_p += size * 3;
+    facelightmaps_t *lightmaps = &facelightmaps.at(Face_GetNum(bsp, face) * 2 + (facesup ? 1 : 0));
+
+    lightmaps->used = true;
+    lightmaps->out.assign(size, 0);
+    lightmaps->lit.assign(size * 3, 0);
+    lightmaps->lux.assign(size * 3, 0);
+    *lightdata = lightmaps->out.data();
+    *colordata = lightmaps->lit.data();
+    *deluxdata = lightmaps->lux.data();
+
+    if (facesup) {
+        facesup->lightofs = 0;
+    } else {
+        face->lightofs = 0;
     }
+}
 
-    if (deluxdata) {
-        /* align to 12 byte boundaries to match offets with 3 * lightdata */
-        if ((uintptr_t)lux_file_p % 12)
-            lux_file_p += 12 - ((uintptr_t)lux_file_p % 12);
-        *deluxdata = lux_file_p;
-        lux_file_p += size * 3;
-    }
+static int
+AddFaceLightmaps(const facelightmaps_t &lightmaps, int *lightdatasize)
+{
+    /* 4 byte aligned, the rgb and direction data are at 3 times the offset */
+    const int ofs = (*lightdatasize + 3) & ~3;
+    *lightdatasize = ofs + static_cast<int>(lightmaps.out.size());
+    return ofs;
+}
+
+/*
+ * Lays out the finished lightmaps in face order and copies them into
+ * dlightdata and the lit/lux buffers, so the result doesn't depend on which
+ * thread got to which face first.
+ */
+static void
+LayoutLightmaps(mbsp_t *bsp)
+{
+    int lightdatasize = 0;
+    int i;
 
-    ThreadUnlock();
+    for (i = 0; i < bsp->numfaces; i++) {
+        bsp2_dface_t *face = BSP_GetFace(bsp, i);
+        const facelightmaps_t &facemaps = facelightmaps[i * 2];
+        if (facemaps.used)
+            face->lightofs = AddFaceLightmaps(facemaps, &lightdatasize);
 
-    if (file_p > file_end)
-        Error("%s: overrun", __func__);
+        if (!faces_sup)
+            continue;
+        const facelightmaps_t &supmaps = facelightmaps[i * 2 + 1];
+        if (supmaps.used)
+            faces_sup[i].lightofs = AddFaceLightmaps(supmaps, &lightdatasize);
+        else if (faces_sup[i].lightofs != -1 && facemaps.used)
+            faces_sup[i].lightofs = face->lightofs; /* sharing the face's lightmaps */
+    }
 
-    if (lit_file_p > lit_file_end)
-        Error("%s: overrun", __func__);
+    bsp->lightdatasize = lightdatasize;
+    bsp->dlightdata = static_cast<byte *>(calloc(lightdatasize + 1, 1));
+    lit_filebase = static_cast<byte *>(calloc(lightdatasize * 3 + 1, 1));
+    lux_filebase = static_cast<byte *>(calloc(lightdatasize * 3 + 1, 1));
+    if (!bsp->dlightdata || !lit_filebase || !lux_filebase)
+        Error("%s: allocation of %i bytes failed.", __func__, lightdatasize * 7);
+    filebase = bsp->dlightdata;
+
+    for (i = 0; i < bsp->numfaces * 2; i++) {
+        const facelightmaps_t &lightmaps = facelightmaps[i];
+        if (!lightmaps.used)
+            continue;
+        const int ofs = (i & 1) ? faces_sup[i / 2].lightofs : BSP_GetFace(bsp, i / 2)->lightofs;
+        memcpy(filebase + ofs, lightmaps.out.data(), lightmaps.out.size());
+        memcpy(lit_filebase + ofs * 3, lightmaps.lit.data(), lightmaps.lit.size());
+        memcpy(lux_filebase + ofs * 3, lightmaps.lux.data(), lightmaps.lux.size());
+    }
+
+    facelightmaps.clear();
+    facelightmaps.shrink_to_fit();
 }
 
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum)
@@ -221,54 +274,44 @@ const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum)
     return modelinfo.at(i);
 }
 
-static void *
-LightThread(void *arg)
+static void
+LightThread(const mbsp_t *bsp, int facenum)
 {
-    const mbsp_t *bsp = (const mbsp_t *)arg;
-
 #ifdef HAVE_EMBREE
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 //    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 #endif
 
-    while (1) {
-        const int facenum = GetThreadWork();
-        if (facenum == -1)
-            break;
-
-        bsp2_dface_t *f = const_cast<bsp2_dface_t*>(BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum));
-        
-        /* Find the correct model offset */
-        const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
-        if (face_modelinfo == NULL) {
-            // ericw -- silenced this warning becasue is causes spam when "skip" faces are used
-            //logprint("warning: no model has face %d\n", facenum);
-            continue;
-        }
-        
-        if (!faces_sup)
-            LightFace(bsp, f, nullptr, cfg_static);
-        else if (scaledonly)
-        {
-            f->lightofs = -1;
-            f->styles[0] = 255;
-            LightFace(bsp, f, faces_sup + facenum, cfg_static);
-        }
-        else if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
-        {
-            LightFace(bsp, f, nullptr, cfg_static);
-            faces_sup[facenum].lightofs = f->lightofs;
-            for (int i = 0; i < MAXLIGHTMAPS; i++)
-                faces_sup[facenum].styles[i] = f->styles[i];
-        }
-        else
-        {
-            LightFace(bsp, f, nullptr, cfg_static);
-            LightFace(bsp, f, faces_sup + facenum, cfg_static);
-        }
+    bsp2_dface_t *f = const_cast<bsp2_dface_t*>(BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum));
+    
+    /* Find the correct model offset */
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
+    if (face_modelinfo == NULL) {
+        // ericw -- silenced this warning becasue is causes spam when "skip" faces are used
+        //logprint("warning: no model has face %d\n", facenum);
+        return;
+    }
+    
+    if (!faces_sup)
+        LightFace(bsp, f, nullptr, cfg_static);
+    else if (scaledonly)
+    {
+        f->lightofs = -1;
+        f->styles[0] = 255;
+        LightFace(bsp, f, faces_sup + facenum, cfg_static);
+    }
+    else if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
+    {
+        LightFace(bsp, f, nullptr, cfg_static);
+        faces_sup[facenum].lightofs = f->lightofs;
+        for (int i = 0; i < MAXLIGHTMAPS; i++)
+            faces_sup[facenum].styles[i] = f->styles[i];
+    }
+    else
+    {
+        LightFace(bsp, f, nullptr, cfg_static);
+        LightFace(bsp, f, faces_sup + facenum, cfg_static);
     }
-
-    return NULL;
 }
 
 static void
@@ -347,6 +390,70 @@ FindModelInfo(const mbsp_t *bsp, const char *lmscaleoverride)
     Q_assert(modelinfo.size() == bsp->nummodels);
 }
 
+/*
+ * =============
+ * LightFaceOrder
+ *
+ * Face numbers sorted by estimated lighting cost, most expensive first,
+ * so the big faces don't end up running alone at the end of LightWorld.
+ * =============
+ */
+static std::vector<int>
+LightFaceOrder(const mbsp_t *bsp)
+{
+    std::vector<float> cost(bsp->numfaces, 0.0f);
+    
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
+        if (face_modelinfo == NULL)
+            continue;
+        
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        
+        /* mirrors the LightFace calls made by LightThread */
+        if (!faces_sup || (!scaledonly && faces_sup[i].lmscale == face_modelinfo->lightmapscale)) {
+            cost[i] = EstimateFaceCost(bsp, f, face_modelinfo->lightmapscale, cfg_static);
+        } else if (scaledonly) {
+            cost[i] = EstimateFaceCost(bsp, f, faces_sup[i].lmscale, cfg_static);
+        } else {
+            cost[i] = EstimateFaceCost(bsp, f, face_modelinfo->lightmapscale, cfg_static)
+                    + EstimateFaceCost(bsp, f, faces_sup[i].lmscale, cfg_static);
+        }
+    }
+    
+    std::vector<int> order(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++)
+        order[i] = i;
+    
+    std::stable_sort(order.begin(), order.end(), [&cost](int a, int b) {
+        return cost[a] > cost[b];
+    });
+    return order;
+}
+
+static void
+PrintThreadStats(const std::vector<threadstats_t> &stats)
+{
+    double wall = 0, firstidle = -1, busy = 0;
+    for (const threadstats_t &ts : stats) {
+        wall = qmax(wall, ts.finished);
+        if (firstidle < 0 || ts.finished < firstidle)
+            firstidle = ts.finished;
+        busy += ts.busy;
+    }
+    if (wall <= 0)
+        return;
+    
+    logprint("thread utilisation:\n");
+    for (size_t i = 0; i < stats.size(); i++) {
+        const threadstats_t &ts = stats[i];
+        logprint("  thread %2d: %6d faces, %4d steals, busy %7.1fs (%3.0f%%), done at %7.1fs\n",
+                 static_cast<int>(i), ts.items, ts.steals, ts.busy, 100.0 * ts.busy / wall, ts.finished);
+    }
+    logprint("  %.0f%% overall, threads were idle for the last %.1fs\n",
+             100.0 * busy / (wall * stats.size()), wall - firstidle);
+}
+
 /*
  * =============
  *  LightWorld
@@ -362,33 +469,13 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     int i, j;
     if (bsp->dlightdata)
         free(bsp->dlightdata);
-    if (lux_buffer)
-        free(lux_buffer);
-
-    /* FIXME - remove this limit */
-    bsp->lightdatasize = MAX_MAP_LIGHTING;
-    bsp->dlightdata = (byte *)malloc(bsp->lightdatasize + 16); /* for alignment */
-    if (!bsp->dlightdata)
-        Error("%s: allocation of %i bytes failed.",
-              __func__, bsp->lightdatasize);
-    memset(bsp->dlightdata, 0, bsp->lightdatasize + 16);
-    bsp->lightdatasize /= 4;
-
-    /* align filebase to a 4 byte boundary */
-    filebase = file_p = (byte *)(((uintptr_t)bsp->dlightdata + 3) & ~3);
-    file_end = filebase + bsp->lightdatasize;
-
-    /* litfile data stored in dlightdata, after the white light */
-    lit_filebase = file_end + 12 - ((uintptr_t)file_end % 12);
-    lit_file_p = lit_filebase;
-    lit_file_end = lit_filebase + 3 * (MAX_MAP_LIGHTING / 4);
-
-    /* lux data stored in a separate buffer */
-    lux_buffer = (byte *)malloc(bsp->lightdatasize*3);
-    lux_filebase = lux_buffer + 12 - ((uintptr_t)lux_buffer % 12);
-    lux_file_p = lux_filebase;
-    lux_file_end = lux_filebase + 3 * (MAX_MAP_LIGHTING / 4);
-
+    if (lit_filebase)
+        free(lit_filebase);
+    if (lux_filebase)
+        free(lux_filebase);
+    bsp->dlightdata = NULL;
+    lit_filebase = lux_filebase = NULL;
+    facelightmaps.assign(bsp->numfaces * 2, facelightmaps_t());
 
     if (forcedscale)
         BSPX_AddLump(bspdata, "LMSHIFT", NULL, 0);
@@ -421,7 +508,11 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
         MakeTextureColors(bsp);
         MakeBounceLights(cfg_static, bsp);
     }
+
+    if (lightcache && debugmode == debugmode_none)
+        LightCache_Load(lightcachefile, bsp, cfg_static);
     
+    std::vector<threadstats_t> threadstats;
 #if 0
     lightbatchthread_info_t info;
     info.all_batches = MakeLightingBatches(bsp);
@@ -429,11 +520,13 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     info.bsp = bsp;
     RunThreadsOn(0, info.all_batches.size(), LightBatchThread, &info);
 #else
-    RunThreadsOn(0, bsp->numfaces, LightThread, bsp);
+    ParallelForOrdered(LightFaceOrder(bsp), [bsp](int facenum) { LightThread(bsp, facenum); }, &threadstats);
 #endif
 
     logprint("Lighting Completed.\n\n");
-    bsp->lightdatasize = file_p - filebase;
+    PrintThreadStats(threadstats);
+    LightCache_Write(lightcachefile);
+    LayoutLightmaps(bsp);
     logprint("lightdatasize: %i\n", bsp->lightdatasize);
 
 
@@ -732,6 +825,7 @@ static void PrintUsage()
 "  -threads n          set the number of threads\n"
 "  -extra              2x supersampling\n"
 "  -extra4             4x supersampling, slowest, use for final compile\n"
+"  -adaptive           with -extra/-extra4, only supersample where the light changes\n"
 "  -gate n             cutoff lights at this brightness level\n"
 "  -sunsamples n       set samples for _sunlight2, default 64\n"
 "  -surflight_subdivide  surface light subdivision size\n"
@@ -753,6 +847,8 @@ static void PrintUsage()
 "Experimental options:\n"
 "  -lit2               write .lit2 file\n"
 "  -lmscale n          change lightmap scale, vanilla engines only allow 16\n"
+"  -pvscull            skip lights outside the PVS of each face (needs vis data)\n"
+"  -cache              reuse unchanged faces' lighting from <bsp>.lightcache\n"
 "  -lux                write .lux file\n"
 "  -bspxlit            writes rgb data into the bsp itself\n"
 "  -bspx               writes both rgb and directions data into the bsp itself\n"
@@ -921,6 +1017,9 @@ light_main(int argc, const char **argv)
         } else if (!strcmp(argv[i], "-extra4")) {
             oversample = 4;
             logprint("extra 4x4 sampling enabled\n");
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            adaptivesampling = true;
+            logprint("adaptive supersampling enabled\n");
         } else if (!strcmp(argv[i], "-gate")) {
             fadegate = ParseVec(&i, argc, argv);
             if (fadegate > 1) {
@@ -993,6 +1092,12 @@ light_main(int argc, const char **argv)
         } else if ( !strcmp( argv[ i ], "-novisapprox" ) ) {
             novisapprox = true;
             logprint( "Skipping approximate light visibility\n" );
+        } else if ( !strcmp( argv[ i ], "-pvscull" ) ) {
+            pvscull = true;
+            logprint( "Culling lights using the compiled PVS\n" );
+        } else if ( !strcmp( argv[ i ], "-cache" ) ) {
+            lightcache = true;
+            logprint( "Reusing unchanged faces from the light cache\n" );
         } else if ( !strcmp( argv[ i ], "-nolights" ) ) {
             nolights = true;
             logprint( "Skipping all light entities (sunlight / minlight only)\n" );
@@ -1126,6 +1231,10 @@ light_main(int argc, const char **argv)
     DefaultExtension(source, ".bsp");
     LoadBSPFile(source, &bspdata);
 
+    strcpy(lightcachefile, source);
+    StripExtension(lightcachefile);
+    DefaultExtension(lightcachefile, ".lightcache");
+
     loadversion = bspdata.version;
     ConvertBSPFormat(GENERIC_BSP, &bspdata);
 
@@ -1160,6 +1269,7 @@ light_main(int argc, const char **argv)
     {
         CheckLitNeeded(cfg);
         SetupDirt(cfg);
+        SetupLightPVS(bsp);
         
         LightWorld(&bspdata, !!lmscaleoverride);
         
@@ -1208,7 +1318,22 @@ light_main(int argc, const char **argv)
     logprint("%f bounce lights tested, %f hits per sample point\n",
              static_cast<double>(total_bounce_rays) / static_cast<double>(total_samplepoints),
              static_cast<double>(total_bounce_ray_hits) / static_cast<double>(total_samplepoints));
+    logprint("%llu bounce rays saved by tracing each ray once for all styles\n",
+             static_cast<unsigned long long>(total_bounce_rays_shared));
+    if (adaptivesampling && oversample > 1) {
+        logprint("%llu of %llu luxels supersampled\n",
+                 static_cast<unsigned long long>(total_adaptive_refined),
+                 static_cast<unsigned long long>(total_adaptive_luxels));
+    }
     logprint("%d empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    logprint("%llu light/face pairs considered, %llu culled by light octree\n",
+             static_cast<unsigned long long>(total_lights_considered),
+             static_cast<unsigned long long>(total_lights_culled));
+    if (pvscull) {
+        logprint("%llu light/face pairs culled by PVS, saving up to %llu rays\n",
+                 static_cast<unsigned long long>(total_lights_pvs_culled),
+                 static_cast<unsigned long long>(total_pvs_rays_saved));
+    }
     close_log();
     
     return 0;
@@ -0,0 +1,506 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/bounce.hh>
+#include <light/lightcache.hh>
+
+#include <common/bsputils.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Light cache (-cache)
+ *
+ * <map>.lightcache keeps the finished lightmaps of every face from the last
+ * run, along with hashes of the geometry, of the settings, and of every
+ * light and bounce light with its estimated visible bounds. If the geometry
+ * and settings still match, a face is copied back from the cache unless a
+ * light that was added, removed or changed could reach it; that is, its
+ * bounds touch the face. Anything else (geometry, worldspawn or bmodel keys,
+ * suns, command line options) means lighting every face again.
+ */
+
+#define LIGHTCACHE_IDENT   (('C'<<24)+('L'<<16)+('W'<<8)+'E')
+#define LIGHTCACHE_VERSION 2
+
+typedef struct {
+    bool valid;
+    vec3_t mins, maxs;          // the face's bounds, as lightsurf_t has them
+    uint8_t styles[MAXLIGHTMAPS];
+    float lmscale;              // facesup only
+    unsigned short extent[2];   // facesup only
+    std::vector<byte> out, lit, lux;
+} lightcacheentry_t;
+
+static bool cache_active = false;
+static uint64_t cache_geometry, cache_settings;
+static std::vector<lightcacherecord_t> cache_lights;     // this run's lights
+static std::vector<lightcacherecord_t> cache_changed;    // ones that differ from the file
+static std::vector<lightcacheentry_t> cache_entries;     // two per face: face, then facesup
+static std::atomic<int> cache_restored;
+
+/* FNV-1a */
+static void
+Hash_Bytes(uint64_t *hash, const void *data, size_t size)
+{
+    const byte *bytes = static_cast<const byte *>(data);
+    for (size_t i = 0; i < size; i++) {
+        *hash ^= bytes[i];
+        *hash *= 1099511628211ULL;
+    }
+}
+
+template <typename T>
+static void
+Hash_Value(uint64_t *hash, const T &value)
+{
+    Hash_Bytes(hash, &value, sizeof(value));
+}
+
+static void
+Hash_String(uint64_t *hash, const std::string &str)
+{
+    Hash_Bytes(hash, str.c_str(), str.size() + 1);
+}
+
+static void
+Hash_Settings(uint64_t *hash, const std::vector<const lockable_setting_t *> &settings)
+{
+    for (const lockable_setting_t *setting : settings) {
+        Hash_String(hash, setting->primaryName());
+        Hash_String(hash, setting->stringValue());
+    }
+}
+
+static const uint64_t HASH_START = 14695981039346656037ULL;
+
+/* Everything rays can hit, and what faces and textures look like */
+static uint64_t
+GeometryHash(const mbsp_t *bsp)
+{
+    uint64_t hash = HASH_START;
+
+    Hash_Value(&hash, bsp->loadversion);
+    Hash_Bytes(&hash, bsp->dmodels, bsp->nummodels * sizeof(*bsp->dmodels));
+    Hash_Bytes(&hash, bsp->dplanes, bsp->numplanes * sizeof(*bsp->dplanes));
+    Hash_Bytes(&hash, bsp->dvertexes, bsp->numvertexes * sizeof(*bsp->dvertexes));
+    Hash_Bytes(&hash, bsp->dedges, bsp->numedges * sizeof(*bsp->dedges));
+    Hash_Bytes(&hash, bsp->dsurfedges, bsp->numsurfedges * sizeof(*bsp->dsurfedges));
+    Hash_Bytes(&hash, bsp->texinfo, bsp->numtexinfo * sizeof(*bsp->texinfo));
+    Hash_Bytes(&hash, bsp->dtexdata, bsp->texdatasize);
+    Hash_Bytes(&hash, extended_texinfo_flags, bsp->numtexinfo * sizeof(*extended_texinfo_flags));
+
+    /* not the lighting info, that's what we're making */
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        Hash_Value(&hash, face->planenum);
+        Hash_Value(&hash, face->side);
+        Hash_Value(&hash, face->firstedge);
+        Hash_Value(&hash, face->numedges);
+        Hash_Value(&hash, face->texinfo);
+    }
+
+    /* -pvscull depends on vis too */
+    if (pvscull) {
+        Hash_Bytes(&hash, bsp->dvisdata, bsp->visdatasize);
+        for (int i = 0; i < bsp->numleafs; i++) {
+            Hash_Value(&hash, bsp->dleafs[i].visofs);
+        }
+    }
+    return hash;
+}
+
+/* Everything that could change the lighting of any face */
+static uint64_t
+SettingsHash(const globalconfig_t &cfg)
+{
+    uint64_t hash = HASH_START;
+
+    Hash_Settings(&hash, cfg.settings());
+    for (const modelinfo_t *info : modelinfo) {
+        Hash_Settings(&hash, info->settings());
+        Hash_Value(&hash, info->lightmapscale);
+        Hash_Bytes(&hash, info->offset, sizeof(info->offset));
+    }
+    for (const sun_t &sun : GetSuns()) {
+        Hash_Bytes(&hash, sun.sunvec, sizeof(sun.sunvec));
+        Hash_Value(&hash, sun.sunlight);
+        Hash_Bytes(&hash, sun.sunlight_color, sizeof(sun.sunlight_color));
+        Hash_Value(&hash, sun.dirt);
+        Hash_Value(&hash, sun.anglescale);
+    }
+
+    Hash_Value(&hash, oversample);
+    Hash_Value(&hash, adaptivesampling);
+    Hash_Value(&hash, softsamples);
+    Hash_Value(&hash, write_litfile);
+    Hash_Value(&hash, write_luxfile);
+    Hash_Value(&hash, scaledonly);
+    Hash_Value(&hash, novisapprox);
+    Hash_Value(&hash, pvscull);
+    Hash_Value(&hash, dirt_in_use);
+    Hash_Value(&hash, fadegate);
+    Hash_Value(&hash, surflight_subdivide);
+    Hash_Value(&hash, sunsamples);
+    Hash_Value(&hash, debug_highlightseams);
+    return hash;
+}
+
+static void
+LightRecordBounds(lightcacherecord_t *record, const vec3_t mins, const vec3_t maxs)
+{
+    /* with -novisapprox there are no bounds, anything might be lit */
+    if (novisapprox) {
+        VectorSet(record->mins, -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+        VectorSet(record->maxs, std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    } else {
+        VectorCopy(mins, record->mins);
+        VectorCopy(maxs, record->maxs);
+    }
+}
+
+static std::vector<lightcacherecord_t>
+LightRecords(void)
+{
+    std::vector<lightcacherecord_t> records;
+
+    for (const light_t &light : GetLights()) {
+        lightcacherecord_t record;
+        record.hash = HASH_START;
+        Hash_Settings(&record.hash, light.settings());
+        Hash_Bytes(&record.hash, light.spotvec, sizeof(light.spotvec));
+        record.bounce = 0;
+        LightRecordBounds(&record, light.mins, light.maxs);
+        records.push_back(record);
+    }
+
+    for (const bouncelight_t &vpl : BounceLights()) {
+        lightcacherecord_t record;
+        record.hash = HASH_START;
+        Hash_Value(&record.hash, vpl.pos);
+        Hash_Value(&record.hash, vpl.surfnormal);
+        Hash_Value(&record.hash, vpl.area);
+        for (const auto &styleColor : vpl.colorByStyle) {
+            Hash_Value(&record.hash, styleColor.first);
+            Hash_Value(&record.hash, styleColor.second);
+        }
+        record.bounce = 1;
+        LightRecordBounds(&record, vpl.mins, vpl.maxs);
+        records.push_back(record);
+    }
+    return records;
+}
+
+/*
+ * Returns the records that are in one list but not the other. Identical
+ * lights are allowed; each one only matches once.
+ */
+std::vector<lightcacherecord_t>
+LightCache_ChangedLights(const std::vector<lightcacherecord_t> &before,
+                         const std::vector<lightcacherecord_t> &after)
+{
+    auto byHash = [](const lightcacherecord_t &a, const lightcacherecord_t &b) {
+        return a.hash < b.hash;
+    };
+
+    std::vector<lightcacherecord_t> a(before), b(after), changed;
+    std::sort(a.begin(), a.end(), byHash);
+    std::sort(b.begin(), b.end(), byHash);
+    std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(changed), byHash);
+    return changed;
+}
+
+/*
+ * With _bounceerror above 0 a face can be lit by a whole cluster of the
+ * bounce light tree at once, through a light and bounds that aren't any one
+ * bounce light's, and the tree is rebuilt around a changed light anyway. So
+ * one changed bounce light changes all of them: adds a record covering every
+ * bounce light, before and after.
+ */
+void
+LightCache_AddBounceClusters(const std::vector<lightcacherecord_t> &before,
+                             const std::vector<lightcacherecord_t> &after,
+                             std::vector<lightcacherecord_t> *changed)
+{
+    bool bouncechanged = false;
+    for (const lightcacherecord_t &record : *changed) {
+        if (record.bounce)
+            bouncechanged = true;
+    }
+    if (!bouncechanged)
+        return;
+
+    lightcacherecord_t all;
+    all.hash = 0;
+    all.bounce = 1;
+    ClearBounds(all.mins, all.maxs);
+    for (const std::vector<lightcacherecord_t> *records : { &before, &after }) {
+        for (const lightcacherecord_t &record : *records) {
+            if (!record.bounce)
+                continue;
+            AddPointToBounds(record.mins, all.mins, all.maxs);
+            AddPointToBounds(record.maxs, all.mins, all.maxs);
+        }
+    }
+    changed->push_back(all);
+}
+
+static bool
+ReadData(FILE *f, void *data, size_t size)
+{
+    return size == 0 || fread(data, size, 1, f) == 1;
+}
+
+template <typename T>
+static bool
+ReadValue(FILE *f, T *value)
+{
+    return ReadData(f, value, sizeof(*value));
+}
+
+/* Reads the file into cache_entries, returns the old light records */
+static bool
+ReadCacheFile(FILE *f, std::vector<lightcacherecord_t> *oldlights)
+{
+    int32_t numlights, numentries;
+
+    if (!ReadValue(f, &numlights) || numlights < 0)
+        return false;
+    oldlights->resize(numlights);
+    if (!ReadData(f, oldlights->data(), numlights * sizeof(lightcacherecord_t)))
+        return false;
+
+    if (!ReadValue(f, &numentries))
+        return false;
+    for (int i = 0; i < numentries; i++) {
+        int32_t slot, size;
+        if (!ReadValue(f, &slot) || slot < 0 || slot >= static_cast<int>(cache_entries.size()))
+            return false;
+
+        lightcacheentry_t *entry = &cache_entries[slot];
+        if (!ReadData(f, entry->mins, sizeof(entry->mins))
+            || !ReadData(f, entry->maxs, sizeof(entry->maxs))
+            || !ReadData(f, entry->styles, sizeof(entry->styles))
+            || !ReadValue(f, &entry->lmscale)
+            || !ReadData(f, entry->extent, sizeof(entry->extent))
+            || !ReadValue(f, &size) || size < 0)
+            return false;
+
+        entry->out.resize(size);
+        entry->lit.resize(size * 3);
+        entry->lux.resize(size * 3);
+        if (!ReadData(f, entry->out.data(), entry->out.size())
+            || !ReadData(f, entry->lit.data(), entry->lit.size())
+            || !ReadData(f, entry->lux.data(), entry->lux.size()))
+            return false;
+        entry->valid = true;
+    }
+    return true;
+}
+
+/*
+ * Whether any of the changed lights could reach a face with these bounds,
+ * so it has to be lit again.
+ */
+bool
+LightCache_FaceAffected(const vec3_t facemins, const vec3_t facemaxs,
+                        const std::vector<lightcacherecord_t> &changed)
+{
+    /* grown like the query in LightsTouchingBBox */
+    vec3_t mins, maxs;
+    for (int i = 0; i < 3; i++) {
+        mins[i] = facemins[i] - 1;
+        maxs[i] = facemaxs[i] + 1;
+    }
+    for (const lightcacherecord_t &light : changed) {
+        if (!AABBsDisjoint(light.mins, light.maxs, mins, maxs))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Call once the lights and bounce lights are set up, before any faces are
+ * lit. If the file isn't there or doesn't match, every face gets lit.
+ */
+void
+LightCache_Load(const char *filename, const mbsp_t *bsp, const globalconfig_t &cfg)
+{
+    cache_active = true;
+    cache_geometry = GeometryHash(bsp);
+    cache_settings = SettingsHash(cfg);
+    cache_lights = LightRecords();
+    cache_changed.clear();
+    cache_entries.assign(bsp->numfaces * 2, lightcacheentry_t());
+    cache_restored = 0;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        logprint("Light cache: no %s yet, lighting every face\n", filename);
+        return;
+    }
+
+    int32_t ident, version;
+    uint64_t geometry, settings;
+    if (!ReadValue(f, &ident) || !ReadValue(f, &version) || ident != LIGHTCACHE_IDENT || version != LIGHTCACHE_VERSION) {
+        logprint("WARNING: %s is not a light cache (or an old one), ignoring it\n", filename);
+        fclose(f);
+        return;
+    }
+    if (!ReadValue(f, &geometry) || !ReadValue(f, &settings)) {
+        logprint("WARNING: %s is truncated, ignoring it\n", filename);
+        fclose(f);
+        return;
+    }
+    if (geometry != cache_geometry) {
+        logprint("Light cache: geometry changed, lighting every face\n");
+        fclose(f);
+        return;
+    }
+    if (settings != cache_settings) {
+        logprint("Light cache: settings changed, lighting every face\n");
+        fclose(f);
+        return;
+    }
+
+    std::vector<lightcacherecord_t> oldlights;
+    if (!ReadCacheFile(f, &oldlights)) {
+        logprint("WARNING: %s is truncated, ignoring it\n", filename);
+        cache_entries.assign(bsp->numfaces * 2, lightcacheentry_t());
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    cache_changed = LightCache_ChangedLights(oldlights, cache_lights);
+    logprint("Light cache: %d of %d lights and bounce lights added, removed or changed\n",
+             static_cast<int>(cache_changed.size()), static_cast<int>(cache_lights.size()));
+    if (cfg.bounceerror.floatValue() > 0)
+        LightCache_AddBounceClusters(oldlights, cache_lights, &cache_changed);
+}
+
+/*
+ * Copies the face's lightmaps back from the cache and returns true, or
+ * returns false if it needs lighting.
+ */
+bool
+LightCache_Restore(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup)
+{
+    if (!cache_active)
+        return false;
+
+    lightcacheentry_t *entry = &cache_entries[Face_GetNum(bsp, face) * 2 + (facesup ? 1 : 0)];
+    if (!entry->valid)
+        return false;
+
+    if (LightCache_FaceAffected(entry->mins, entry->maxs, cache_changed)) {
+        entry->valid = false;
+        return false;
+    }
+
+    uint8_t *styles = facesup ? facesup->styles : face->styles;
+    memcpy(styles, entry->styles, sizeof(entry->styles));
+    if (facesup) {
+        facesup->lmscale = entry->lmscale;
+        facesup->extent[0] = entry->extent[0];
+        facesup->extent[1] = entry->extent[1];
+    }
+
+    if (!entry->out.empty()) {
+        byte *out, *lit, *lux;
+        GetFaceSpace(bsp, face, facesup, &out, &lit, &lux, static_cast<int>(entry->out.size()));
+        memcpy(out, entry->out.data(), entry->out.size());
+        memcpy(lit, entry->lit.data(), entry->lit.size());
+        memcpy(lux, entry->lux.data(), entry->lux.size());
+    }
+
+    cache_restored++;
+    return true;
+}
+
+/* Called by WriteLightmaps with what it wrote; size is 0 for no lightmaps */
+void
+LightCache_Store(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                 const lightsurf_t *lightsurf, const byte *out, const byte *lit, const byte *lux, int size)
+{
+    if (!cache_active)
+        return;
+
+    lightcacheentry_t *entry = &cache_entries[Face_GetNum(bsp, face) * 2 + (facesup ? 1 : 0)];
+    entry->valid = true;
+    VectorCopy(lightsurf->mins, entry->mins);
+    VectorCopy(lightsurf->maxs, entry->maxs);
+    memcpy(entry->styles, facesup ? facesup->styles : face->styles, sizeof(entry->styles));
+    entry->lmscale = facesup ? facesup->lmscale : 0;
+    entry->extent[0] = facesup ? facesup->extent[0] : 0;
+    entry->extent[1] = facesup ? facesup->extent[1] : 0;
+    entry->out.assign(out, out + size);
+    entry->lit.assign(lit, lit + size * 3);
+    entry->lux.assign(lux, lux + size * 3);
+}
+
+void
+LightCache_Write(const char *filename)
+{
+    if (!cache_active)
+        return;
+
+    int numentries = 0;
+    for (const lightcacheentry_t &entry : cache_entries) {
+        if (entry.valid)
+            numentries++;
+    }
+    logprint("Light cache: %d of %d lightmaps restored, writing %s\n",
+             cache_restored.load(), numentries, filename);
+
+    FILE *f = SafeOpenWrite(filename);
+    const int32_t ident = LIGHTCACHE_IDENT, version = LIGHTCACHE_VERSION;
+    const int32_t numlights = static_cast<int32_t>(cache_lights.size());
+    SafeWrite(f, &ident, sizeof(ident));
+    SafeWrite(f, &version, sizeof(version));
+    SafeWrite(f, &cache_geometry, sizeof(cache_geometry));
+    SafeWrite(f, &cache_settings, sizeof(cache_settings));
+    SafeWrite(f, &numlights, sizeof(numlights));
+    SafeWrite(f, cache_lights.data(), cache_lights.size() * sizeof(lightcacherecord_t));
+    SafeWrite(f, &numentries, sizeof(numentries));
+
+    for (int32_t slot = 0; slot < static_cast<int32_t>(cache_entries.size()); slot++) {
+        const lightcacheentry_t &entry = cache_entries[slot];
+        if (!entry.valid)
+            continue;
+        const int32_t size = static_cast<int32_t>(entry.out.size());
+        SafeWrite(f, &slot, sizeof(slot));
+        SafeWrite(f, entry.mins, sizeof(entry.mins));
+        SafeWrite(f, entry.maxs, sizeof(entry.maxs));
+        SafeWrite(f, entry.styles, sizeof(entry.styles));
+        SafeWrite(f, &entry.lmscale, sizeof(entry.lmscale));
+        SafeWrite(f, entry.extent, sizeof(entry.extent));
+        SafeWrite(f, &size, sizeof(size));
+        SafeWrite(f, entry.out.data(), entry.out.size());
+        SafeWrite(f, entry.lit.data(), entry.lit.size());
+        SafeWrite(f, entry.lux.data(), entry.lux.size());
+    }
+    fclose(f);
+}
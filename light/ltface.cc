@@ -23,6 +23,8 @@
 #include <light/entities.hh>
 #include <light/trace.hh>
 #include <light/ltface.hh>
+#include <light/pvs.hh>
+#include <light/lightcache.hh>
 
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
@@ -35,7 +37,10 @@ using namespace std;
 
 std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
+std::atomic<uint64_t> total_bounce_rays_shared;
 std::atomic<uint32_t> fully_transparent_lightmaps;
+std::atomic<uint64_t> total_lights_considered, total_lights_culled;
+std::atomic<uint64_t> total_lights_pvs_culled, total_pvs_rays_saved;
 
 /* ======================================================================== */
 
@@ -1393,16 +1398,14 @@ GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, const vec3_t origi
 
 /*
  * ================
- * LightFace_Entity
+ * LightFace_EntityCulled
+ *
+ * Cheap tests that reject a light before any rays are cast
  * ================
  */
-static void
-LightFace_Entity(const mbsp_t *bsp,
-                 const light_t *entity,
-                lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static bool
+LightFace_EntityCulled(const light_t *entity, const lightsurf_t *lightsurf)
 {
-    const globalconfig_t &cfg = *lightsurf->cfg;
-    const modelinfo_t *modelinfo = lightsurf->modelinfo;
     const plane_t *plane = &lightsurf->plane;
 
     const float planedist = DotProduct(*entity->origin.vec3Value(), plane->normal) - plane->dist;
@@ -1415,11 +1418,27 @@ LightFace_Entity(const mbsp_t *bsp,
        test in the curved case.
     */
     if (planedist < 0 && !entity->bleed.boolValue() && !lightsurf->curved && !lightsurf->twosided) {
-        return;
+        return true;
     }
 
     /* sphere cull surface and light */
-    if (CullLight(entity, lightsurf)) {
+    return CullLight(entity, lightsurf);
+}
+
+/*
+ * ================
+ * LightFace_Entity
+ * ================
+ */
+static void
+LightFace_Entity(const mbsp_t *bsp,
+                 const light_t *entity,
+                lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+
+    if (LightFace_EntityCulled(entity, lightsurf)) {
         return;
     }
 
@@ -1642,7 +1661,8 @@ LightFace_Min(const mbsp_t *bsp, const bsp2_dface_t *face,
         return;
     
     /* Cast rays for local minlight entities */
-    for (const auto &entity : GetLights()) {
+    for (const light_t *light : lightsurf->lights) {
+        const light_t &entity = *light;
         if (entity.getFormula() != LF_LOCALMIN) {
             continue;
         }
@@ -1786,23 +1806,6 @@ LightFace_BounceLightsDebug(const lightsurf_t *lightsurf, lightmapdict_t *lightm
     }
 }
 
-// returns color in [0,255]
-static inline qvec3f
-BounceLight_ColorAtDist(const globalconfig_t &cfg, float area, const qvec3f &bounceLightColor, float dist)
-{
-    // clamp away hotspots
-    if (dist < 128.0f) {
-        dist = 128.0f;
-    }
-    
-    const float dist2 = (dist * dist);
-    const float scale = (1.0f/dist2) * cfg.bouncescale.floatValue();
-    
-    // get light contribution
-    const qvec3f result = bounceLightColor * area * (255.0f * scale);
-    return result;
-}
-
 // dir: vpl -> sample point direction
 // returns color in [0,255]
 static inline qvec3f
@@ -1834,24 +1837,115 @@ GetIndirectLighting (const globalconfig_t &cfg, const bouncelight_t *vpl, const
     return resultscaled;
 }
 
-static inline bool
-BounceLight_SphereCull(const mbsp_t *bsp, const bouncelight_t *vpl, const lightsurf_t *lightsurf)
+/*
+ * Traces one bounce light to the face with the given color per style. A
+ * cluster of the bounce light tree is lit as its representative light
+ * carrying the whole cluster's power.
+ *
+ * Each ray is traced once, for every style that's bright enough at its
+ * sample point. The ray carries white, so whatever glass tints it can be
+ * applied to each style afterwards.
+ */
+static void
+LightFace_BounceLight(const bouncelight_t &vpl, const bouncestyles_t &colorByStyle,
+                      const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
+    const int numstyles = static_cast<int>(colorByStyle.size());
     
-    if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
-        return true;
+    // numstyles entries per pushed ray, 0 where that style is too dim
+    std::vector<qvec3f> indirectByStyle;
     
-    const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vpl->pos; // vpl -> sample point
-    const float dist = qv::length(dir) + lightsurf->radius;
+    raystream_t *rs = lightsurf->stream;
+    rs->clearPushedRays();
     
-    // get light contribution
-    const qvec3f color = BounceLight_ColorAtDist(cfg, vpl->area, vpl->componentwiseMaxColor, dist);
+    int styleRays = 0;
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        
+        qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
+        const float dist = qv::length(dir);
+        if (dist == 0.0f)
+            continue; // FIXME: nudge or something
+        dir /= dist;
+        
+        int lit = 0;
+        for (const auto &styleColor : colorByStyle) {
+            const qvec3f indirect = GetIndirectLighting(cfg, &vpl, styleColor.second, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
+            
+            if (LightSample_Brightness(indirect) < 0.25) {
+                indirectByStyle.push_back(qvec3f(0));
+            } else {
+                indirectByStyle.push_back(indirect);
+                lit++;
+            }
+        }
+        if (!lit) {
+            indirectByStyle.resize(indirectByStyle.size() - numstyles);
+            continue;
+        }
+        styleRays += lit;
+        
+        vec3_t vplPos, vplDir, vplColor = {1, 1, 1};
+        glm_to_vec3_t(vpl.pos, vplPos);
+        glm_to_vec3_t(dir, vplDir);
+        
+        rs->pushRay(i, vplPos, vplDir, dist, lightsurf->modelinfo, vplColor);
+    }
     
-    if (LightSample_Brightness(color) < 0.25f)
-        return true;
+    if (!rs->numPushedRays())
+        return;
     
-    return false;
+    const int N = rs->numPushedRays();
+    total_bounce_rays += N;
+    total_bounce_rays_shared += styleRays - N;
+    rs->tracePushedRaysOcclusion();
+    
+    for (int s = 0; s < numstyles; s++) {
+        bool hit = false;
+        const int style = colorByStyle[s].first;
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+        
+        for (int j = 0; j < N; j++) {
+            if (rs->getPushedRayOccluded(j))
+                continue;
+            
+            const qvec3f &color = indirectByStyle[j * numstyles + s];
+            if (color == qvec3f(0))
+                continue;
+            
+            const int i = rs->getPushedRayPointIndex(j);
+            vec3_t indirect;
+            glm_to_vec3_t(color, indirect);
+            
+            /* tint and dim by any glass the ray went through */
+            vec3_t tint;
+            rs->getPushedRayColor(j, tint);
+            for (int k = 0; k < 3; k++)
+                indirect[k] *= tint[k];
+            
+            Q_assert(!std::isnan(indirect[0]));
+            
+            /* Use dirt scaling on the indirect lighting.
+             * Except, not in bouncedebug mode.
+             */
+            if (debugmode != debugmode_bounce) {
+                const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+                VectorScale(indirect, dirtscale, indirect);
+            }
+            
+            lightsample_t *sample = &lightmap->samples[i];
+            VectorAdd(sample->color, indirect, sample->color);
+            
+            hit = true;
+            total_bounce_ray_hits++;
+        }
+        
+        // If this style of this bounce light contributed anything, save.
+        if (hit)
+            Lightmap_Save(lightmaps, lightsurf, lightmap, style);
+    }
 }
 
 static void
@@ -1868,81 +1962,38 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
         return;
     
 #if 1
-    for (const bouncelight_t &vpl : BounceLights()) {
-        if (BounceLight_SphereCull(bsp, &vpl, lightsurf))
+    const std::vector<bouncelight_t> &vpls = BounceLights();
+    const std::vector<bouncenode_t> &tree = BounceLightTree();
+    
+    bouncereceiver_t receiver;
+    receiver.origin = vec3_t_to_glm(lightsurf->origin);
+    receiver.radius = lightsurf->radius;
+    VectorCopy(lightsurf->mins, receiver.mins);
+    VectorCopy(lightsurf->maxs, receiver.maxs);
+    receiver.normal = vec3_t_to_glm(lightsurf->plane.normal);
+    receiver.pointmins = receiver.normalmins = qvec3f(std::numeric_limits<float>::max());
+    receiver.pointmaxs = receiver.normalmaxs = qvec3f(-std::numeric_limits<float>::max());
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        receiver.pointmins = qv::min(receiver.pointmins, vec3_t_to_glm(lightsurf->points[i]));
+        receiver.pointmaxs = qv::max(receiver.pointmaxs, vec3_t_to_glm(lightsurf->points[i]));
+        receiver.normalmins = qv::min(receiver.normalmins, vec3_t_to_glm(lightsurf->normals[i]));
+        receiver.normalmaxs = qv::max(receiver.normalmaxs, vec3_t_to_glm(lightsurf->normals[i]));
+    }
+    
+    for (const int nodenum : BounceLightCut(cfg, tree, vpls, receiver, cfg.bounceerror.floatValue())) {
+        const bouncenode_t &node = tree[nodenum];
+        const bouncelight_t &vpl = vpls[node.representative];
+        
+        if (node.children[0] == -1) {
+            LightFace_BounceLight(vpl, vpl.colorByStyle, lightsurf, lightmaps);
             continue;
-            
-        // FIXME: This will trace the same ray multiple times, once per style,
-        // if the bouncelight is hitting a face with multiple styles.
-        for (const auto &styleColor : vpl.colorByStyle) {
-            bool hit = false;
-            const int style = styleColor.first;
-            const qvec3f &color = styleColor.second;
-            
-            raystream_t *rs = lightsurf->stream;
-            rs->clearPushedRays();
-            
-            for (int i = 0; i < lightsurf->numpoints; i++) {
-                if (lightsurf->occluded[i])
-                    continue;
-                
-                qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
-                const float dist = qv::length(dir);
-                if (dist == 0.0f)
-                    continue; // FIXME: nudge or something
-                dir /= dist;
-                
-                const qvec3f indirect = GetIndirectLighting(cfg, &vpl, color, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
-                
-                if (LightSample_Brightness(indirect) < 0.25)
-                    continue;
-                
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(vpl.pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
-                
-                rs->pushRay(i, vplPos, vplDir, dist, lightsurf->modelinfo, vplColor);
-            }
-            
-            if (!rs->numPushedRays())
-                continue;
-            
-            total_bounce_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion();
-            
-            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
-            
-            const int N = rs->numPushedRays();
-            for (int j = 0; j < N; j++) {
-                if (rs->getPushedRayOccluded(j))
-                    continue;
-                
-                const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = {0};
-                rs->getPushedRayColor(j, indirect);
-                
-                Q_assert(!std::isnan(indirect[0]));
-                
-                /* Use dirt scaling on the indirect lighting.
-                 * Except, not in bouncedebug mode.
-                 */
-                if (debugmode != debugmode_bounce) {
-                    const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
-                    VectorScale(indirect, dirtscale, indirect);
-                }
-                
-                lightsample_t *sample = &lightmap->samples[i];
-                VectorAdd(sample->color, indirect, sample->color);
-                
-                hit = true;
-                total_bounce_ray_hits++;
-            }
-            
-            // If this style of this bounce light contributed anything, save.
-            if (hit)
-                Lightmap_Save(lightmaps, lightsurf, lightmap, style);
         }
+        
+        bouncestyles_t colorByStyle;
+        for (const auto &stylePower : node.powerByStyle) {
+            colorByStyle.push_back(std::make_pair(stylePower.first, stylePower.second / vpl.area));
+        }
+        LightFace_BounceLight(vpl, colorByStyle, lightsurf, lightmaps);
     }
 
 #else
@@ -1996,10 +2047,10 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
             Q_assert(lights.size() == 1);
             const bouncelight_t &vpl = lights[0];
             
-            const auto it = vpl.colorByStyle.find(0);
-            if (it == vpl.colorByStyle.end())
+            const qvec3f *style0 = BounceStyles_Find(vpl.colorByStyle, 0);
+            if (style0 == nullptr)
                 continue;
-            const qvec3f color = it->second;
+            const qvec3f color = *style0;
             
             const qvec3f raydir = rs->getPushedRayDir(j);
             if (!(qv::dot(raydir, surfnormal) > -0.01)) {
@@ -2854,8 +2905,10 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
         }
     }
 
-    if (!numstyles)
+    if (!numstyles) {
+        LightCache_Store(bsp, face, facesup, lightsurf, nullptr, nullptr, nullptr, 0);
         return;
+    }
 
     int size = (lightsurf->texsize[0] + 1) * (lightsurf->texsize[1] + 1);
     
@@ -2864,12 +2917,8 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
         size *= 3;
     
     byte *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
-    if (facesup) {
-        facesup->lightofs = out - filebase;
-    } else {
-        face->lightofs = out - filebase;
-    }
+    GetFaceSpace(bsp, face, facesup, &out, &lit, &lux, size * numstyles);
+    byte *const outstart = out, *const litstart = lit, *const luxstart = lux;
 
     // sanity check that we don't save a lightmap for a non-lightmapped face
     {
@@ -2956,6 +3005,8 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
             }
         }
     }
+
+    LightCache_Store(bsp, face, facesup, lightsurf, outstart, litstart, luxstart, size * numstyles);
 }
 
 static void LightFaceShutdown(lightsurf_t *lightsurf)
@@ -2975,6 +3026,282 @@ static void LightFaceShutdown(lightsurf_t *lightsurf)
     delete lightsurf;
 }
 
+/*
+ * ============
+ * Face_NeedsLighting
+ *
+ * Whether LightFace() goes on to light the face, or gives it no lightmap.
+ * ============
+ */
+static bool
+Face_NeedsLighting(const mbsp_t *bsp, const bsp2_dface_t *face)
+{
+    if (!Face_IsLightmapped(bsp, face))
+        return false;
+    
+    const char *texname = Face_TextureName(bsp, face);
+    
+    /* don't save lightmaps for "trigger" texture */
+    if (!Q_strcasecmp(texname, "trigger"))
+        return false;
+    
+    /* don't save lightmaps for "skip" texture */
+    if (!Q_strcasecmp(texname, "skip"))
+        return false;
+    
+    /* don't bother with degenerate faces */
+    if (face->numedges < 3)
+        return false;
+    
+    return true;
+}
+
+/*
+ * ============
+ * EstimateFaceCost
+ *
+ * Rough relative cost of LightFace(), used to schedule the most expensive
+ * faces first: sample points times the lights, suns and bounce lights
+ * that could reach the face. Returns 0 for faces that get no lightmap.
+ * ============
+ */
+float
+EstimateFaceCost(const mbsp_t *bsp, const bsp2_dface_t *face, float lightmapscale, const globalconfig_t &cfg)
+{
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr)
+        return 0;
+    if (!Face_NeedsLighting(bsp, face))
+        return 0;
+    
+    /* Lightsurf_Init gives up on these before calculating extents */
+    if (std::isnan(TexSpaceToWorld(bsp, face).at(0,0)))
+        return 0;
+    
+    lightsurf_t surf {};
+    surf.lightmapscale = lightmapscale;
+    CalcFaceExtents(face, bsp, &surf);
+    
+    const float numpoints = static_cast<float>((surf.texsize[0] + 1) * (surf.texsize[1] + 1) * oversample * oversample);
+    
+    vec3_t mins, maxs;
+    VectorAdd(surf.mins, modelinfo->offset, mins);
+    VectorAdd(surf.maxs, modelinfo->offset, maxs);
+    
+    size_t numlights = LightsTouchingBBox(mins, maxs).size() + GetSuns().size();
+    if (cfg.bounce.boolValue())
+        numlights += BounceLights().size();
+    
+    return numpoints * static_cast<float>(numlights + 1);
+}
+
+/*
+ * Casts the positive lights, fixes minlight levels, then casts the negative
+ * lights, for the sample points that aren't occluded.
+ */
+static void
+LightFace_Lights(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    
+    /* positive lights */
+    if (!modelinfo->lightignore.boolValue()) {
+        for (const light_t *entity : lightsurf->lights)
+        {
+            if (entity->getFormula() == LF_LOCALMIN)
+                continue;
+            if (entity->light.floatValue() > 0)
+                LightFace_Entity(bsp, entity, lightsurf, lightmaps);
+        }
+        for ( const sun_t &sun : GetSuns() )
+            if (sun.sunlight > 0)
+                LightFace_Sky (&sun, lightsurf, lightmaps);
+
+        /* add indirect lighting */
+        LightFace_Bounce(bsp, face, lightsurf, lightmaps);
+    }
+    
+    /* minlight - Use the greater of global or model minlight. */
+    if (lightsurf->minlight > cfg.minlight.floatValue())
+        LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
+    else {
+        const float light = cfg.minlight.floatValue();
+        vec3_t color;
+        VectorCopy(*cfg.minlight_color.vec3Value(), color);
+        
+        LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
+    }
+
+    /* negative lights */
+    if (!modelinfo->lightignore.boolValue()) {
+        for (const light_t *entity : lightsurf->lights)
+        {
+            if (entity->getFormula() == LF_LOCALMIN)
+                continue;
+            if (entity->light.floatValue() < 0)
+                LightFace_Entity(bsp, entity, lightsurf, lightmaps);
+        }
+        for (const sun_t &sun : GetSuns())
+            if (sun.sunlight < 0)
+                LightFace_Sky (&sun, lightsurf, lightmaps);
+    }
+}
+
+static bool
+LightFace_IsAdaptive(void)
+{
+    return adaptivesampling && oversample > 1 && debugmode == debugmode_none;
+}
+
+/*
+ * -adaptive: with -extra/-extra4, first light one sample per luxel, then
+ * supersample only the luxels where the light changes. Those are luxels
+ * partly inside solid, and luxels whose sample differs from a neighbour's
+ * by more than ADAPTIVE_THRESHOLD in any style. Every sample of the other
+ * luxels takes the value of the one that was lit.
+ */
+#define ADAPTIVE_THRESHOLD 2.0f
+
+std::atomic<uint64_t> total_adaptive_luxels, total_adaptive_refined;
+
+static void
+LightFace_Adaptive(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const int width = lightsurf->width / oversample;
+    const int height = lightsurf->height / oversample;
+    const std::vector<bool> solid(lightsurf->occluded, lightsurf->occluded + lightsurf->numpoints);
+    
+    auto sampleIndex = [&](int luxel, int sx, int sy) {
+        return ((luxel / width) * oversample + sy) * lightsurf->width + (luxel % width) * oversample + sx;
+    };
+    
+    /* the sample nearest the middle of each luxel that isn't in solid */
+    std::vector<int> representative(width * height, -1);
+    std::vector<bool> partlysolid(width * height, false);
+    for (int luxel = 0; luxel < width * height; luxel++) {
+        int bestdist = 0;
+        for (int sy = 0; sy < oversample; sy++) {
+            for (int sx = 0; sx < oversample; sx++) {
+                const int i = sampleIndex(luxel, sx, sy);
+                if (solid[i]) {
+                    partlysolid[luxel] = true;
+                    continue;
+                }
+                const int dist = (2 * sx + 1 - oversample) * (2 * sx + 1 - oversample)
+                               + (2 * sy + 1 - oversample) * (2 * sy + 1 - oversample);
+                if (representative[luxel] == -1 || dist < bestdist) {
+                    representative[luxel] = i;
+                    bestdist = dist;
+                }
+            }
+        }
+    }
+    
+    /* light the given samples only, with dirt worked out for just them too */
+    auto lightSamples = [&](const std::vector<bool> &active, lightmapdict_t *dict) {
+        int count = 0;
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            lightsurf->occluded[i] = !active[i];
+            count += active[i];
+        }
+        total_samplepoints += count;
+        if (dirt_in_use)
+            LightFace_CalculateDirt(lightsurf);
+        LightFace_Lights(bsp, face, lightsurf, dict);
+    };
+    
+    std::vector<bool> active(lightsurf->numpoints, false);
+    for (const int i : representative) {
+        if (i != -1)
+            active[i] = true;
+    }
+    lightSamples(active, lightmaps);
+    
+    /* find the luxels to supersample */
+    std::vector<bool> refine(width * height, false);
+    int numrefined = 0, numlit = 0;
+    for (int luxel = 0; luxel < width * height; luxel++) {
+        const int i = representative[luxel];
+        if (i == -1)
+            continue;
+        numlit++;
+        
+        bool changes = partlysolid[luxel];
+        const int s = luxel % width, t = luxel / width;
+        for (int nt = qmax(t - 1, 0); nt <= qmin(t + 1, height - 1) && !changes; nt++) {
+            for (int ns = qmax(s - 1, 0); ns <= qmin(s + 1, width - 1) && !changes; ns++) {
+                const int j = representative[nt * width + ns];
+                if (j == -1 || j == i)
+                    continue;
+                for (const lightmap_t &lm : *lightmaps) {
+                    if (lm.style == 255)
+                        continue;
+                    for (int k = 0; k < 3; k++) {
+                        if (fabs(lm.samples[i].color[k] - lm.samples[j].color[k]) > ADAPTIVE_THRESHOLD)
+                            changes = true;
+                    }
+                }
+            }
+        }
+        
+        if (changes) {
+            refine[luxel] = true;
+            numrefined++;
+        }
+    }
+    total_adaptive_luxels += numlit;
+    total_adaptive_refined += numrefined;
+    
+    /* light the rest of their samples separately, then merge them in */
+    if (numrefined) {
+        std::fill(active.begin(), active.end(), false);
+        for (int luxel = 0; luxel < width * height; luxel++) {
+            if (!refine[luxel])
+                continue;
+            for (int sy = 0; sy < oversample; sy++) {
+                for (int sx = 0; sx < oversample; sx++) {
+                    const int i = sampleIndex(luxel, sx, sy);
+                    active[i] = !solid[i] && i != representative[luxel];
+                }
+            }
+        }
+        
+        lightmapdict_t refined;
+        lightSamples(active, &refined);
+        
+        for (const lightmap_t &lm : refined) {
+            if (lm.style != 255) {
+                lightmap_t *dest = Lightmap_ForStyle(lightmaps, lm.style, lightsurf);
+                for (int i = 0; i < lightsurf->numpoints; i++) {
+                    if (active[i])
+                        dest->samples[i] = lm.samples[i];
+                }
+                Lightmap_Save(lightmaps, lightsurf, dest, lm.style);
+            }
+            free(lm.samples);
+        }
+    }
+    
+    /* fill in the luxels that weren't supersampled */
+    for (lightmap_t &lm : *lightmaps) {
+        if (lm.style == 255)
+            continue;
+        for (int luxel = 0; luxel < width * height; luxel++) {
+            const int i = representative[luxel];
+            if (i == -1 || refine[luxel])
+                continue;
+            for (int sy = 0; sy < oversample; sy++) {
+                for (int sx = 0; sx < oversample; sx++) {
+                    lm.samples[sampleIndex(luxel, sx, sy)] = lm.samples[i];
+                }
+            }
+        }
+    }
+    
+    std::copy(solid.begin(), solid.end(), lightsurf->occluded);
+}
+
 /*
  * ============
  * LightFace
@@ -3006,21 +3333,13 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
         for (int i = 0; i < MAXLIGHTMAPS; i++)
             face->styles[i] = 255;
     }
-    if (!Face_IsLightmapped(bsp, face))
-        return;
-    
-    /* don't save lightmaps for "trigger" texture */
-    if (!Q_strcasecmp(texname, "trigger"))
-        return;
-    
-    /* don't save lightmaps for "skip" texture */
-    if (!Q_strcasecmp(texname, "skip"))
+    if (!Face_NeedsLighting(bsp, face))
         return;
     
-    /* don't bother with degenerate faces */
-    if (face->numedges < 3)
+    /* same as last time? */
+    if (LightCache_Restore(bsp, face, facesup))
         return;
-    
+
     /* all good, this face is going to be lightmapped. */
     lightsurf_t *lightsurf = new lightsurf_t {};
     lightsurf->cfg = &cfg;
@@ -3040,7 +3359,7 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
 
     /* calculate dirt (ambient occlusion) but don't use it yet */
-    if (dirt_in_use && (debugmode != debugmode_phong))
+    if (dirt_in_use && (debugmode != debugmode_phong) && !LightFace_IsAdaptive())
         LightFace_CalculateDirt(lightsurf);
 
     /*
@@ -3051,48 +3370,35 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
 
     if (debugmode == debugmode_none) {
         
-        total_samplepoints += lightsurf->numpoints;
+        /* skip lights whose estimated visible bounds don't touch the face */
+        lightsurf->lights = LightsTouchingBBox(lightsurf->mins, lightsurf->maxs);
+        total_lights_considered += lightsurf->lights.size();
+        total_lights_culled += GetLights().size() - lightsurf->lights.size();
         
-        /* positive lights */
-        if (!modelinfo->lightignore.boolValue()) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
+        /* -pvscull: drop lights no leaf of this face can see */
+        if (pvscull) {
+            std::vector<const light_t *> pvs_culled;
+            PVS_FilterLights(lightsurf, &pvs_culled);
+            total_lights_pvs_culled += pvs_culled.size();
+            
+            int numvisible = 0;
+            for (int i = 0; i < lightsurf->numpoints; i++) {
+                if (!lightsurf->occluded[i])
+                    numvisible++;
+            }
+            for (const light_t *entity : pvs_culled) {
+                if (entity->getFormula() == LF_LOCALMIN || entity->light.floatValue() == 0)
                     continue;
-                if (entity.light.floatValue() > 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
+                if (!LightFace_EntityCulled(entity, lightsurf))
+                    total_pvs_rays_saved += numvisible;
             }
-            for ( const sun_t &sun : GetSuns() )
-                if (sun.sunlight > 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
-
-            /* add indirect lighting */
-            LightFace_Bounce(bsp, face, lightsurf, lightmaps);
         }
         
-        /* minlight - Use the greater of global or model minlight. */
-        if (lightsurf->minlight > cfg.minlight.floatValue())
-            LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
-        else {
-            const float light = cfg.minlight.floatValue();
-            vec3_t color;
-            VectorCopy(*cfg.minlight_color.vec3Value(), color);
-            
-            LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
-        }
-
-        /* negative lights */
-        if (!modelinfo->lightignore.boolValue()) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity.light.floatValue() < 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
-            }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
+        if (LightFace_IsAdaptive()) {
+            LightFace_Adaptive(bsp, face, lightsurf, lightmaps);
+        } else {
+            total_samplepoints += lightsurf->numpoints;
+            LightFace_Lights(bsp, face, lightsurf, lightmaps);
         }
     }
     
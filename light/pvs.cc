@@ -0,0 +1,285 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/trace.hh>
+#include <light/pvs.hh>
+
+#include <common/bsputils.hh>
+
+#include <vector>
+#include <set>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * PVS culling of lights (-pvscull)
+ *
+ * A "row" is one entry of the compiled PVS: a leaf (Q1) or a cluster (Q2).
+ * For every row we store a bitset over GetLights() of the lights sitting in
+ * a row that is potentially visible from it. An empty bitset means "can see
+ * everything" (unvised leaf).
+ *
+ * This assumes vis never blocks anything light can get through, which is
+ * not true of func_illusionary_visblocker, of water with qbsp -notranswater
+ * or of vis -farplane. None of those can be told from the bsp, so they're
+ * only documented: light through them is lost.
+ */
+
+static bool pvs_active = false;
+static int lightwords;                              // uint32_t's per light bitset
+static vector<vector<uint32_t>> visibleLightsForRow;
+static vector<vector<int>> rowsForFace;             // -1 = leaf without PVS
+
+static int
+PVS_NumRows(const mbsp_t *bsp)
+{
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        const dvis_t *dvis = reinterpret_cast<const dvis_t *>(bsp->dvisdata);
+        return dvis->numclusters;
+    }
+    return bsp->dmodels[0].visleafs;
+}
+
+/* returns the PVS row a leaf belongs to, or -1 if it has none */
+static int
+Leaf_PVSRow(const mbsp_t *bsp, const mleaf_t *leaf)
+{
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        return leaf->cluster;
+    }
+    
+    const int leafnum = static_cast<int>(leaf - bsp->dleafs);
+    if (leafnum < 1 || leafnum > bsp->dmodels[0].visleafs)
+        return -1; // solid leaf 0
+    if (leaf->visofs < 0)
+        return -1;
+    return leafnum - 1;
+}
+
+/* returns the offset of the compressed row in dvisdata, or -1 */
+static int
+PVS_RowOffset(const mbsp_t *bsp, int row)
+{
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        const dvis_t *dvis = reinterpret_cast<const dvis_t *>(bsp->dvisdata);
+        return dvis->bitofs[row][DVIS_PVS];
+    }
+    return bsp->dleafs[row + 1].visofs;
+}
+
+static void
+PVS_DecompressRow(const mbsp_t *bsp, int ofs, vector<uint8_t> *out)
+{
+    const uint8_t *in = bsp->dvisdata + ofs;
+    const uint8_t *end = bsp->dvisdata + bsp->visdatasize;
+    size_t pos = 0;
+    
+    while (pos < out->size() && in < end) {
+        if (*in) {
+            (*out)[pos++] = *in++;
+            continue;
+        }
+        
+        if (in + 1 >= end)
+            break;
+        int count = in[1];
+        in += 2;
+        while (count-- && pos < out->size()) {
+            (*out)[pos++] = 0;
+        }
+    }
+    
+    // corrupt or truncated row, pad it out as visible to stay conservative
+    while (pos < out->size()) {
+        (*out)[pos++] = 0xff;
+    }
+}
+
+static inline void
+LightBits_Set(vector<uint32_t> *bits, int lightnum)
+{
+    (*bits)[lightnum >> 5] |= (1u << (lightnum & 31));
+}
+
+static inline bool
+LightBits_Test(const vector<uint32_t> &bits, int lightnum)
+{
+    return !!(bits[lightnum >> 5] & (1u << (lightnum & 31)));
+}
+
+/*
+ * ==============
+ * SetupLightPVS
+ *
+ * Decompresses the PVS once and builds the per-row light lists, plus a
+ * lookup of which PVS rows touch each world face (via marksurfaces).
+ * ==============
+ */
+void
+SetupLightPVS(const mbsp_t *bsp)
+{
+    if (!pvscull)
+        return;
+    
+    logprint("--- SetupLightPVS ---\n");
+    
+    if (!bsp->visdatasize) {
+        logprint("WARNING: map has no vis data, -pvscull ignored\n");
+        return;
+    }
+    
+    const vector<light_t> &lights = GetLights();
+    const int numlights = static_cast<int>(lights.size());
+    const int numrows = PVS_NumRows(bsp);
+    
+    lightwords = (numlights + 31) / 32;
+    
+    /* lights in solid or unvised leafs can't be culled */
+    vector<uint32_t> alwaysVisible(lightwords, 0);
+    vector<vector<int>> lightsInRow(numrows);
+    
+    for (int i = 0; i < numlights; i++) {
+        const mleaf_t *leaf = Light_PointInLeaf(bsp, *lights[i].origin.vec3Value());
+        const int row = Leaf_PVSRow(bsp, leaf);
+        if (row < 0 || row >= numrows) {
+            LightBits_Set(&alwaysVisible, i);
+        } else {
+            lightsInRow[row].push_back(i);
+        }
+    }
+    
+    /* only the rows with lights in them need testing against each row */
+    vector<int> litrows;
+    for (int row = 0; row < numrows; row++) {
+        if (!lightsInRow[row].empty())
+            litrows.push_back(row);
+    }
+    
+    visibleLightsForRow.clear();
+    visibleLightsForRow.resize(numrows);
+    
+    vector<uint8_t> pvsrow((numrows + 7) / 8);
+    int64_t visiblepairs = 0;
+    
+    for (int row = 0; row < numrows; row++) {
+        const int ofs = PVS_RowOffset(bsp, row);
+        if (ofs < 0 || ofs >= bsp->visdatasize)
+            continue; // leave empty: sees everything
+        
+        PVS_DecompressRow(bsp, ofs, &pvsrow);
+        
+        vector<uint32_t> bits = alwaysVisible;
+        for (const int other : litrows) {
+            if (other != row && !(pvsrow[other >> 3] & (1 << (other & 7))))
+                continue;
+            for (const int lightnum : lightsInRow[other]) {
+                LightBits_Set(&bits, lightnum);
+                visiblepairs++;
+            }
+        }
+        visibleLightsForRow[row] = std::move(bits);
+    }
+    
+    /* map faces to the rows of the leafs that reference them */
+    rowsForFace.clear();
+    rowsForFace.resize(bsp->numfaces);
+    
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        const int row = Leaf_PVSRow(bsp, leaf);
+        
+        for (uint32_t j = 0; j < leaf->nummarksurfaces; j++) {
+            const uint32_t facenum = bsp->dleaffaces[leaf->firstmarksurface + j];
+            if (facenum >= static_cast<uint32_t>(bsp->numfaces))
+                continue;
+            
+            vector<int> &rows = rowsForFace[facenum];
+            if (std::find(rows.begin(), rows.end(), row) == rows.end()) {
+                rows.push_back(row);
+            }
+        }
+    }
+    
+    pvs_active = true;
+    
+    logprint("%d PVS rows, average %.1f visible lights per row\n",
+             numrows, numrows ? static_cast<double>(visiblepairs) / numrows : 0.0);
+}
+
+/*
+ * ==============
+ * PVS_FilterLights
+ *
+ * Removes lights from lightsurf->lights that are in no leaf potentially
+ * visible from any leaf touching the faces the sample points ended up on.
+ * The removed lights are appended to `culled`.
+ * ==============
+ */
+void
+PVS_FilterLights(lightsurf_t *lightsurf, vector<const light_t *> *culled)
+{
+    if (!pvs_active)
+        return;
+    
+    const mbsp_t *bsp = lightsurf->bsp;
+    
+    /* sample points can be moved onto neighbouring faces, so use those too */
+    set<int> facenums;
+    facenums.insert(Face_GetNum(bsp, lightsurf->face));
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        if (lightsurf->realfacenums[i] >= 0)
+            facenums.insert(lightsurf->realfacenums[i]);
+    }
+    
+    vector<uint32_t> visible(lightwords, 0);
+    for (const int facenum : facenums) {
+        const vector<int> &rows = rowsForFace.at(facenum);
+        
+        /* bmodel faces aren't in any leaf */
+        if (rows.empty())
+            return;
+        
+        for (const int row : rows) {
+            if (row < 0)
+                return;
+            
+            const vector<uint32_t> &rowbits = visibleLightsForRow.at(row);
+            if (rowbits.empty())
+                return;
+            
+            for (int j = 0; j < lightwords; j++) {
+                visible[j] |= rowbits[j];
+            }
+        }
+    }
+    
+    const light_t *first = GetLights().data();
+    vector<const light_t *> kept;
+    for (const light_t *light : lightsurf->lights) {
+        if (LightBits_Test(visible, static_cast<int>(light - first))) {
+            kept.push_back(light);
+        } else {
+            culled->push_back(light);
+        }
+    }
+    lightsurf->lights = std::move(kept);
+}
@@ -1,6 +1,8 @@
 #include "gtest/gtest.h"
 
 #include <light/light.hh>
+#include <light/bounce.hh>
+#include <light/lightcache.hh>
 
 #include <random>
 #include <algorithm> // for std::sort
@@ -11,6 +13,8 @@
 #include <common/aabb.hh>
 #include <common/octree.hh>
 
+#include <set>
+
 using namespace std;
 
 static qvec4f extendTo4(const qvec3f &v) {
@@ -1064,3 +1068,297 @@ TEST(qvec, matrix4x4inv) {
     qmat4x4f nanMat = qv::inverse(qmat4x4f(0));
     ASSERT_TRUE(std::isnan(nanMat.at(0, 0)));
 }
+
+static std::vector<bouncelight_t> RandomBounceLights(std::mt19937 &engine, int count) {
+    std::uniform_real_distribution<float> pos(-1024, 1024);
+    std::uniform_real_distribution<float> unit(-1, 1);
+    std::uniform_real_distribution<float> area(16, 1024);
+    
+    std::vector<bouncelight_t> lights(count);
+    for (bouncelight_t &l : lights) {
+        l.pos = qvec3f(pos(engine), pos(engine), pos(engine));
+        l.surfnormal = qv::normalize(qvec3f(unit(engine), unit(engine), unit(engine) + 0.01f));
+        l.area = area(engine);
+        BounceStyles_Add(l.colorByStyle, 0, qvec3f(unit(engine) + 1, unit(engine) + 1, unit(engine) + 1) * 0.5f);
+        if (unit(engine) > 0.5f)
+            BounceStyles_Add(l.colorByStyle, 1, qvec3f(0.25f));
+        l.componentwiseMaxColor = qvec3f(0);
+        for (const auto &styleColor : l.colorByStyle)
+            l.componentwiseMaxColor = qv::max(l.componentwiseMaxColor, styleColor.second);
+        for (int i = 0; i < 3; i++) {
+            l.mins[i] = l.pos[i] - 1024;
+            l.maxs[i] = l.pos[i] + 1024;
+        }
+    }
+    return lights;
+}
+
+TEST(light, BounceLightTree) {
+    std::mt19937 engine(0);
+    const auto lights = RandomBounceLights(engine, 300);
+    const auto tree = MakeBounceLightTree(lights);
+    
+    ASSERT_EQ(lights.size() * 2 - 1, tree.size());
+    
+    int leafs = 0;
+    for (const bouncenode_t &node : tree) {
+        if (node.children[0] == -1) {
+            leafs++;
+            const bouncelight_t &l = lights[node.representative];
+            EXPECT_EQ(l.pos, node.mins);
+            EXPECT_EQ(1.0f, node.cosangle);
+            continue;
+        }
+        
+        qvec3f power(0);
+        std::map<int, qvec3f> powerByStyle;
+        for (const int childnum : node.children) {
+            const bouncenode_t &child = tree[childnum];
+            for (int i = 0; i < 3; i++) {
+                EXPECT_LE(node.mins[i], child.mins[i]);
+                EXPECT_GE(node.maxs[i], child.maxs[i]);
+                EXPECT_LE(node.vismins[i], child.vismins[i]);
+                EXPECT_GE(node.vismaxs[i], child.vismaxs[i]);
+                EXPECT_GE(node.maxpower[i], child.maxpower[i]);
+            }
+            power = power + child.power;
+            for (const auto &stylePower : child.powerByStyle)
+                powerByStyle[stylePower.first] = powerByStyle[stylePower.first] + stylePower.second;
+            
+            // the child's cone fits inside
+            if (node.cosangle > -1.0f) {
+                const float between = acos(qclamp(qv::dot(node.axis, child.axis), -1.0f, 1.0f));
+                EXPECT_LE(between + acos(child.cosangle), acos(node.cosangle) + 0.001f);
+            }
+        }
+        EXPECT_EQ(powerByStyle.size(), node.powerByStyle.size());
+        EXPECT_TRUE(std::is_sorted(node.powerByStyle.begin(), node.powerByStyle.end(),
+                                   [](const std::pair<int, qvec3f> &a, const std::pair<int, qvec3f> &b) { return a.first < b.first; }));
+        for (int i = 0; i < 3; i++) {
+            EXPECT_FLOAT_EQ(power[i], node.power[i]);
+            for (const auto &stylePower : powerByStyle)
+                EXPECT_NEAR(stylePower.second[i], (*BounceStyles_Find(node.powerByStyle, stylePower.first))[i], 0.001f * stylePower.second[i]);
+        }
+    }
+    EXPECT_EQ(static_cast<int>(lights.size()), leafs);
+}
+
+TEST(light, BounceLightCutExact) {
+    std::mt19937 engine(1);
+    auto lights = RandomBounceLights(engine, 500);
+    
+    // plus a lit wall facing the face, which should be clustered
+    std::uniform_real_distribution<float> onwall(-256, 256);
+    for (int n = 0; n < 1000; n++) {
+        bouncelight_t l = lights[n % lights.size()];
+        l.pos = qvec3f(384, onwall(engine), onwall(engine) + 256);
+        l.surfnormal = qvec3f(-1, 0, 0);
+        l.area = 1024;
+        for (int i = 0; i < 3; i++) {
+            l.mins[i] = -1024;
+            l.maxs[i] = 1024;
+        }
+        l.colorByStyle.assign(1, std::make_pair(0, qvec3f(0.5f)));
+        l.componentwiseMaxColor = qvec3f(0.5f);
+        lights.push_back(l);
+    }
+    const auto tree = MakeBounceLightTree(lights);
+    const globalconfig_t cfg;
+    
+    // a 256 square floor face, sampled every 16 units
+    std::vector<qvec3f> points;
+    bouncereceiver_t receiver;
+    receiver.origin = qvec3f(0, 0, 0);
+    receiver.radius = sqrt(2.0f) * 128;
+    receiver.normal = receiver.normalmins = receiver.normalmaxs = qvec3f(0, 0, 1);
+    receiver.pointmins = qvec3f(-128, -128, 0);
+    receiver.pointmaxs = qvec3f(128, 128, 0);
+    for (int i = 0; i < 3; i++) {
+        receiver.mins[i] = receiver.pointmins[i];
+        receiver.maxs[i] = receiver.pointmaxs[i];
+    }
+    for (int x = -128; x <= 128; x += 16)
+        for (int y = -128; y <= 128; y += 16)
+            points.push_back(qvec3f(x, y, 0));
+    
+    const auto exact = BounceLightCut(cfg, tree, lights, receiver, 0.0f);
+    std::set<int> inCut;
+    for (const int nodenum : exact) {
+        ASSERT_EQ(-1, tree[nodenum].children[0]);
+        inCut.insert(tree[nodenum].representative);
+    }
+    
+    // everything left out is either dropped by the per-light visible AABB
+    // and sphere culls, or adds nothing at any sample point
+    for (int n = 0; n < static_cast<int>(lights.size()); n++) {
+        if (inCut.count(n))
+            continue;
+        const bouncelight_t &l = lights[n];
+        if (AABBsDisjoint(l.mins, l.maxs, receiver.mins, receiver.maxs))
+            continue;
+        const float spheredist = qv::length(receiver.origin - l.pos) + receiver.radius;
+        if (LightSample_Brightness(BounceLight_ColorAtDist(cfg, l.area, l.componentwiseMaxColor, spheredist)) < 0.25f)
+            continue;
+        for (const qvec3f &point : points) {
+            const qvec3f dir = qv::normalize(point - l.pos);
+            const float dp1 = qv::dot(l.surfnormal, dir);
+            const float dp2 = -qv::dot(dir, receiver.normal);
+            if (dp1 < 0 || dp2 < 0)
+                continue;
+            const qvec3f color = BounceLight_ColorAtDist(cfg, l.area, l.componentwiseMaxColor, qv::length(point - l.pos));
+            EXPECT_LT(LightSample_Brightness(color * dp1 * dp2), 0.25f);
+        }
+    }
+    
+    // an approximate cut is much smaller, and still covers every light of
+    // the exact one
+    const auto approx = BounceLightCut(cfg, tree, lights, receiver, 0.02f);
+    EXPECT_LT(approx.size(), exact.size() / 2);
+    std::set<int> covered;
+    std::vector<int> stack(approx);
+    while (!stack.empty()) {
+        const bouncenode_t &node = tree[stack.back()];
+        stack.pop_back();
+        if (node.children[0] == -1) {
+            covered.insert(node.representative);
+        } else {
+            stack.push_back(node.children[0]);
+            stack.push_back(node.children[1]);
+        }
+    }
+    for (const int n : inCut)
+        EXPECT_EQ(1u, covered.count(n));
+    
+    // and lights the face about the same, ignoring shadows and the
+    // per-sample cutoff: merged lights can only add back some of what
+    // culling every light separately throws away
+    auto unshadowed = [&](const std::vector<int> &cut) {
+        float total = 0;
+        for (const int nodenum : cut) {
+            const bouncelight_t &l = lights[tree[nodenum].representative];
+            const qvec3f color = tree[nodenum].power / l.area;
+            for (const qvec3f &point : points) {
+                const qvec3f dir = qv::normalize(point - l.pos);
+                const float dp1 = qv::dot(l.surfnormal, dir);
+                const float dp2 = -qv::dot(dir, receiver.normal);
+                if (dp1 < 0 || dp2 < 0)
+                    continue;
+                total += LightSample_Brightness(BounceLight_ColorAtDist(cfg, l.area, color, qv::length(point - l.pos)) * dp1 * dp2);
+            }
+        }
+        return total;
+    };
+    std::vector<int> everything;
+    for (int nodenum = 0; nodenum < static_cast<int>(tree.size()); nodenum++) {
+        if (tree[nodenum].children[0] == -1)
+            everything.push_back(nodenum);
+    }
+    const float approxTotal = unshadowed(approx);
+    EXPECT_GE(approxTotal, 0.98f * unshadowed(exact));
+    EXPECT_LE(approxTotal, 1.02f * unshadowed(everything));
+}
+
+static lightcacherecord_t
+LightCacheRecord(uint64_t hash, float x, bool bounce = false)
+{
+    lightcacherecord_t record;
+    record.hash = hash;
+    record.bounce = bounce;
+    VectorSet(record.mins, x - 100, -100, -100);
+    VectorSet(record.maxs, x + 100, 100, 100);
+    return record;
+}
+
+TEST(light, LightCacheChangedLights) {
+    const std::vector<lightcacherecord_t> before {
+        LightCacheRecord(1, 0), LightCacheRecord(2, 500), LightCacheRecord(3, 1000), LightCacheRecord(3, 1000)
+    };
+
+    // same lights in a different order
+    std::vector<lightcacherecord_t> after { before[3], before[1], before[0], before[2] };
+    EXPECT_TRUE(LightCache_ChangedLights(before, after).empty());
+
+    // light 2 moves: both where it was and where it is now need relighting
+    after[1] = LightCacheRecord(4, 2000);
+    auto changed = LightCache_ChangedLights(before, after);
+    ASSERT_EQ(2, changed.size());
+    std::set<float> xs;
+    for (const auto &record : changed)
+        xs.insert(record.mins[0] + 100);
+    EXPECT_EQ((std::set<float> { 500, 2000 }), xs);
+
+    // one of two identical lights removed
+    after = { before[0], before[1], before[2] };
+    changed = LightCache_ChangedLights(before, after);
+    ASSERT_EQ(1, changed.size());
+    EXPECT_EQ(3, changed[0].hash);
+}
+
+TEST(light, LightCacheFaceAffected) {
+    const std::vector<lightcacherecord_t> before {
+        LightCacheRecord(1, 0), LightCacheRecord(2, 500), LightCacheRecord(3, 1000)
+    };
+    // light 2 moves from x=500 to x=2000
+    const std::vector<lightcacherecord_t> after {
+        LightCacheRecord(1, 0), LightCacheRecord(4, 2000), LightCacheRecord(3, 1000)
+    };
+    const auto changed = LightCache_ChangedLights(before, after);
+    
+    auto relit = [&](float x0, float x1) {
+        const vec3_t mins { x0, -10, -10 };
+        const vec3_t maxs { x1, 10, 10 };
+        return LightCache_FaceAffected(mins, maxs, changed);
+    };
+    
+    // faces only the unchanged lights reach are restored
+    EXPECT_FALSE(relit(-50, 50));
+    EXPECT_FALSE(relit(950, 1050));
+    EXPECT_FALSE(relit(700, 800));
+    
+    // faces where the light was, or is now, are relit
+    EXPECT_TRUE(relit(450, 550));
+    EXPECT_TRUE(relit(1950, 2050));
+    
+    // so is a face spanning both
+    EXPECT_TRUE(relit(-50, 3000));
+    
+    // a face just outside the old bounds is relit too, like LightsTouchingBBox would find it
+    EXPECT_TRUE(relit(600.5f, 650));
+    EXPECT_FALSE(relit(602, 650));
+    
+    // nothing changed, nothing relit
+    EXPECT_FALSE(LightCache_FaceAffected(vec3_origin, vec3_origin, LightCache_ChangedLights(before, before)));
+}
+
+TEST(light, LightCacheBounceClusters) {
+    // a light and two bounce lights far apart, which a cluster could light as one
+    const std::vector<lightcacherecord_t> before {
+        LightCacheRecord(1, 0), LightCacheRecord(2, 1000, true), LightCacheRecord(3, 3000, true)
+    };
+    auto relit = [](const std::vector<lightcacherecord_t> &changed, float x) {
+        const vec3_t mins { x - 10, -10, -10 };
+        const vec3_t maxs { x + 10, 10, 10 };
+        return LightCache_FaceAffected(mins, maxs, changed);
+    };
+    
+    // bounce light 2 changes colour
+    std::vector<lightcacherecord_t> after { before[0], LightCacheRecord(4, 1000, true), before[2] };
+    auto changed = LightCache_ChangedLights(before, after);
+    EXPECT_FALSE(relit(changed, 3000));
+    
+    // a face next to bounce light 3 may have been lit by its cluster, with light 2 in it
+    LightCache_AddBounceClusters(before, after, &changed);
+    EXPECT_TRUE(relit(changed, 1000));
+    EXPECT_TRUE(relit(changed, 3000));
+    EXPECT_TRUE(relit(changed, 2000));
+    EXPECT_FALSE(relit(changed, 0));
+    EXPECT_FALSE(relit(changed, 5000));
+    
+    // only a normal light changed: bounce clusters don't matter
+    after = { LightCacheRecord(5, 0), before[1], before[2] };
+    changed = LightCache_ChangedLights(before, after);
+    LightCache_AddBounceClusters(before, after, &changed);
+    EXPECT_TRUE(relit(changed, 0));
+    EXPECT_FALSE(relit(changed, 1000));
+    EXPECT_FALSE(relit(changed, 3000));
+}
@@ -22,6 +22,8 @@
 
 #include <string.h>
 
+#include <mutex>
+
 #include <qbsp/qbsp.hh>
 
 /*
@@ -267,9 +269,13 @@ NewPlane(const vec3_t normal, const vec_t dist, int *side)
     return index;
 }
 
+static std::mutex plane_lock;
+
 /*
  * FindPlane
  * - Returns a global plane number and the side that will be the front
+ * - Safe to call from several threads, but map.planes may grow, so planes
+ *   that parallel hull processing will ask for are created up front
  */
 int
 FindPlane(const vec3_t normal, const vec_t dist, int *side)
@@ -278,6 +284,7 @@ FindPlane(const vec3_t normal, const vec_t dist, int *side)
     VectorCopy(normal, plane.normal);
     plane.dist = dist;
     
+    std::lock_guard<std::mutex> lock(plane_lock);
     for (int i : map.planehash[plane_hash_fn(&plane)]) {
         const qbsp_plane_t &p = map.planes.at(i);
         if (PlaneEqual(&p, &plane)) {
@@ -20,6 +20,8 @@
 */
 // csg4.c
 
+#include <algorithm>
+
 #include <qbsp/qbsp.hh>
 
 /*
@@ -30,9 +32,13 @@ Brushes that touch still need to be split at the cut point to make a tjunction
 
 */
 
-static int brushfaces;
-static int csgfaces;
-int csgmergefaces;
+/* per thread, hulls are built in parallel */
+static thread_local int brushfaces;
+static thread_local int csgfaces;
+thread_local int csgmergefaces;
+
+/* hidden by CSGFaces_ClipBrush, CSGFaces_AddSkip gives it the skip texinfo */
+#define TEXINFO_SKIP_PENDING -2
 
 /*
 ==================
@@ -324,6 +330,31 @@ ClipInside(const face_t *clipface, bool precedence,
 }
 
 
+/*
+==================
+MirrorIsSkip
+
+True if the mirrored copy SaveFacesToPlaneList makes of face gets the skip
+texinfo.
+==================
+*/
+static bool
+MirrorIsSkip(const face_t *face)
+{
+    // if CFLAGS_BMODEL_MIRROR_INSIDE is set, never change to skip
+    if (face->cflags[1] & CFLAGS_BMODEL_MIRROR_INSIDE)
+        return false;
+
+    // HACK: We only want this mirrored face for CONTENTS_DETAIL
+    // to force the right content type for the leaf, but we don't actually
+    // want the face. So just set the texinfo to "skip" so it gets deleted.
+    return face->contents[1] == CONTENTS_DETAIL
+        || face->contents[1] == CONTENTS_DETAIL_ILLUSIONARY
+        || face->contents[1] == CONTENTS_DETAIL_FENCE
+        || (face->cflags[1] & CFLAGS_WAS_ILLUSIONARY)
+        || (options.fContentHack && face->contents[1] == CONTENTS_SOLID);
+}
+
 /*
 ==================
 SaveFacesToPlaneList
@@ -368,19 +399,8 @@ SaveFacesToPlaneList(face_t *facelist, bool mirror, std::map<int, face_t *> &pla
             //   - newface->contents[0] is CONTENTS_WATER
             //   - newface->contents[1] is CONTENTS_EMPTY
             
-            // HACK: We only want this mirrored face for CONTENTS_DETAIL
-            // to force the right content type for the leaf, but we don't actually
-            // want the face. So just set the texinfo to "skip" so it gets deleted.
-            if (face->contents[1] == CONTENTS_DETAIL
-                || face->contents[1] == CONTENTS_DETAIL_ILLUSIONARY
-                || face->contents[1] == CONTENTS_DETAIL_FENCE
-                || (face->cflags[1] & CFLAGS_WAS_ILLUSIONARY)
-                || (options.fContentHack && face->contents[1] == CONTENTS_SOLID)) {
-                
-                // if CFLAGS_BMODEL_MIRROR_INSIDE is set, never change to skip
-                if (!(face->cflags[1] & CFLAGS_BMODEL_MIRROR_INSIDE)) {
-                	newface->texinfo = MakeSkipTexinfo();
-                }
+            if (MirrorIsSkip(face)) {
+                newface->texinfo = MakeSkipTexinfo();
             }
             
             for (int i = 0; i < face->w.numpoints; i++)
@@ -454,7 +474,7 @@ SaveInsideFaces(face_t *face, const brush_t *clipbrush, face_t **savelist)
             
             face->contents[0] = CONTENTS_EMPTY;
             face->cflags[0] = CFLAGS_STRUCTURAL_COVERED_BY_DETAIL;
-            face->texinfo = MakeSkipTexinfo();
+            face->texinfo = TEXINFO_SKIP_PENDING;
         }
         
         // N.B.: We don't need a hack like above for when clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY.
@@ -532,7 +552,6 @@ CopyBrushFaces(const brush_t *brush)
 
     facelist = NULL;
     for (face = brush->faces; face; face = face->next) {
-        brushfaces++;
         newface = (face_t *)AllocMem(FACE, 1, true);
         *newface = *face;
         newface->contents[0] = CONTENTS_EMPTY;
@@ -554,144 +573,231 @@ static bool IsLiquid(int contents)
         || contents == CONTENTS_LAVA
         || contents == CONTENTS_SLIME;
 }
+
+static bool
+BoundsOverlap(const brush_t *a, const brush_t *b, int firstaxis)
+{
+    for (int i = firstaxis; i < 3; i++) {
+        if (a->mins[i] > b->maxs[i])
+            return false;
+        if (a->maxs[i] < b->mins[i])
+            return false;
+    }
+    return true;
+}
+
 /*
 ==================
-CSGFaces
+CSGFaces_Prepare
 
-Returns a list of surfaces containing all of the faces
+Lists the entity's brushes and, for each one, the brushes whose bounds
+touch it. Sweeps along x so only brushes overlapping on that axis are
+compared, instead of every pair.
 ==================
 */
-surface_t *
-CSGFaces(const mapentity_t *entity)
+void
+CSGFaces_Prepare(const mapentity_t *entity, csgbrushes_t *csg)
 {
-    int i;
-    const brush_t *brush, *clipbrush;
-    const face_t *clipface;
-    face_t *inside, *outside;
-    bool overwrite, mirror;
-    surface_t *surfaces;
-    int progress = 0;
+    csg->brushes.clear();
+    for (const brush_t *brush = entity->brushes; brush; brush = brush->next)
+        csg->brushes.push_back(brush);
+
+    const int numbrushes = static_cast<int>(csg->brushes.size());
+    csg->touching.assign(numbrushes, std::vector<int>());
+    csg->outside.assign(numbrushes, nullptr);
+
+    std::vector<int> sorted(numbrushes);
+    for (int i = 0; i < numbrushes; i++)
+        sorted[i] = i;
+    std::stable_sort(sorted.begin(), sorted.end(), [csg](int a, int b) {
+        return csg->brushes[a]->mins[0] < csg->brushes[b]->mins[0];
+    });
+
+    std::vector<int> active;
+    for (int i : sorted) {
+        const brush_t *brush = csg->brushes[i];
+
+        /* drop the brushes that end before this one starts */
+        active.erase(std::remove_if(active.begin(), active.end(), [csg, brush](int j) {
+            return csg->brushes[j]->maxs[0] < brush->mins[0];
+        }), active.end());
+
+        for (int j : active) {
+            if (!BoundsOverlap(brush, csg->brushes[j], 1))
+                continue;
+            csg->touching[i].push_back(j);
+            csg->touching[j].push_back(i);
+        }
+        active.push_back(i);
+    }
 
-    Message(msgProgress, "CSGFaces");
+    /* clipping order matters, keep it the same as the brush list */
+    for (std::vector<int> &touching : csg->touching)
+        std::sort(touching.begin(), touching.end());
+}
 
-    std::map<int, face_t *> planefaces;
-    csgfaces = brushfaces = csgmergefaces = 0;
+/*
+==================
+CSGFaces_ClipBrush
+
+Clips brush i against the brushes touching it and keeps the surviving
+faces in csg->outside[i]. Only reads the brushes, so brushes can be
+clipped on different threads.
+==================
+*/
+void
+CSGFaces_ClipBrush(csgbrushes_t *csg, int i)
+{
+    const brush_t *brush = csg->brushes[i];
+    face_t *inside, *outside;
+    bool overwrite;
+
+    outside = CopyBrushFaces(brush);
 
-#if 0
-    logprint("CSGFaces brush order:\n");
-    for (brush = entity->brushes; brush; brush = brush->next) {
-        logprint("    %s (%s)\n", map.texinfoTextureName(brush->faces->texinfo).c_str(), GetContentsName(brush->contents));
-    }
-#endif
-    
     /*
      * For each brush, clip away the parts that are inside other brushes.
      * Solid brushes override non-solid brushes.
      *   brush     => the brush to be clipped
      *   clipbrush => the brush we are clipping against
      */
-    for (brush = entity->brushes; brush; brush = brush->next) {
-        outside = CopyBrushFaces(brush);
-        overwrite = false;
-        clipbrush = entity->brushes;
-        for (; clipbrush; clipbrush = clipbrush->next) {
-            if (brush == clipbrush) {
-                /* Brushes further down the list overried earlier ones */
-                overwrite = true;
-                continue;
-            }
-            if (clipbrush->contents == CONTENTS_EMPTY) {
-                /* Ensure hint never clips anything */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY
-                && brush->contents != CONTENTS_DETAIL_ILLUSIONARY) {
-                /* CONTENTS_DETAIL_ILLUSIONARY never clips anything but itself */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL && (clipbrush->cflags & CFLAGS_DETAIL_WALL)
-                && !(brush->contents == CONTENTS_DETAIL && (brush->cflags & CFLAGS_DETAIL_WALL))) {
-                /* if clipbrush has CONTENTS_DETAIL and CFLAGS_DETAIL_WALL are set,
-                   only clip other brushes with both CONTENTS_DETAIL and CFLAGS_DETAIL_WALL.
-                 */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL_FENCE
-                && brush->contents != CONTENTS_DETAIL_FENCE) {
-                /* CONTENTS_DETAIL_FENCE never clips anything but itself */
-                continue;
-            }
-            
-            if (clipbrush->contents == brush->contents
-                && (clipbrush->cflags & CFLAGS_NO_CLIPPING_SAME_TYPE)) {
-                /* _noclipfaces key */
-                continue;
-            }
+    for (int j : csg->touching[i]) {
+        const brush_t *clipbrush = csg->brushes[j];
 
-            /* check bounding box first */
-            for (i = 0; i < 3; i++) {
-                if (brush->mins[i] > clipbrush->maxs[i])
-                    break;
-                if (brush->maxs[i] < clipbrush->mins[i])
-                    break;
-            }
-            if (i < 3)
-                continue;
+        /* Brushes further down the list overried earlier ones */
+        overwrite = (j > i);
 
-            /*
-             * TODO - optimise by checking for opposing planes?
-             *  => brushes can't intersect
+        if (clipbrush->contents == CONTENTS_EMPTY) {
+            /* Ensure hint never clips anything */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY
+            && brush->contents != CONTENTS_DETAIL_ILLUSIONARY) {
+            /* CONTENTS_DETAIL_ILLUSIONARY never clips anything but itself */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL && (clipbrush->cflags & CFLAGS_DETAIL_WALL)
+            && !(brush->contents == CONTENTS_DETAIL && (brush->cflags & CFLAGS_DETAIL_WALL))) {
+            /* if clipbrush has CONTENTS_DETAIL and CFLAGS_DETAIL_WALL are set,
+               only clip other brushes with both CONTENTS_DETAIL and CFLAGS_DETAIL_WALL.
              */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL_FENCE
+            && brush->contents != CONTENTS_DETAIL_FENCE) {
+            /* CONTENTS_DETAIL_FENCE never clips anything but itself */
+            continue;
+        }
+        
+        if (clipbrush->contents == brush->contents
+            && (clipbrush->cflags & CFLAGS_NO_CLIPPING_SAME_TYPE)) {
+            /* _noclipfaces key */
+            continue;
+        }
 
-            // divide faces by the planes of the new brush
-            inside = outside;
-            outside = NULL;
+        /*
+         * TODO - optimise by checking for opposing planes?
+         *  => brushes can't intersect
+         */
 
-            RemoveOutsideFaces(clipbrush, &inside, &outside);
-            clipface = clipbrush->faces;
-            for (; clipface; clipface = clipface->next)
-                ClipInside(clipface, overwrite, &inside, &outside);
-            
-            // inside = parts of `brush` that are inside `clipbrush`
-            // outside = parts of `brush` that are outside `clipbrush`
-            
-            /*
-             * If the brush is solid and the clipbrush is not, then we need to
-             * keep the inside faces and set the outside contents to those of
-             * the clipbrush. Otherwise, these inside surfaces are hidden and
-             * should be discarded.
-             */
-            if ((brush->contents == CONTENTS_SOLID && clipbrush->contents != CONTENTS_SOLID)
-                || (brush->contents == CONTENTS_SKY && (clipbrush->contents != CONTENTS_SOLID
-                                                        && clipbrush->contents != CONTENTS_SKY))
-                || (brush->contents == CONTENTS_DETAIL && (clipbrush->contents != CONTENTS_SOLID
-                                                           && clipbrush->contents != CONTENTS_SKY
-                                                           && clipbrush->contents != CONTENTS_DETAIL))
-                || (IsLiquid(brush->contents)          && clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY)
-                || (brush->contents == CONTENTS_DETAIL_ILLUSIONARY && IsLiquid(clipbrush->contents))
-                || (brush->contents == CONTENTS_DETAIL_FENCE && IsLiquid(clipbrush->contents)))
-            {
-                SaveInsideFaces(inside, clipbrush, &outside);
-            } else {
-                FreeFaces(inside);
-            }
+        // divide faces by the planes of the new brush
+        inside = outside;
+        outside = NULL;
+
+        RemoveOutsideFaces(clipbrush, &inside, &outside);
+        for (const face_t *clipface = clipbrush->faces; clipface; clipface = clipface->next)
+            ClipInside(clipface, overwrite, &inside, &outside);
+        
+        // inside = parts of `brush` that are inside `clipbrush`
+        // outside = parts of `brush` that are outside `clipbrush`
+        
+        /*
+         * If the brush is solid and the clipbrush is not, then we need to
+         * keep the inside faces and set the outside contents to those of
+         * the clipbrush. Otherwise, these inside surfaces are hidden and
+         * should be discarded.
+         */
+        if ((brush->contents == CONTENTS_SOLID && clipbrush->contents != CONTENTS_SOLID)
+            || (brush->contents == CONTENTS_SKY && (clipbrush->contents != CONTENTS_SOLID
+                                                    && clipbrush->contents != CONTENTS_SKY))
+            || (brush->contents == CONTENTS_DETAIL && (clipbrush->contents != CONTENTS_SOLID
+                                                       && clipbrush->contents != CONTENTS_SKY
+                                                       && clipbrush->contents != CONTENTS_DETAIL))
+            || (IsLiquid(brush->contents)          && clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY)
+            || (brush->contents == CONTENTS_DETAIL_ILLUSIONARY && IsLiquid(clipbrush->contents))
+            || (brush->contents == CONTENTS_DETAIL_FENCE && IsLiquid(clipbrush->contents)))
+        {
+            SaveInsideFaces(inside, clipbrush, &outside);
+        } else {
+            FreeFaces(inside);
+        }
+    }
+
+    csg->outside[i] = outside;
+
+    /* only this brush's clip reads its list */
+    std::vector<int>().swap(csg->touching[i]);
+}
+
+/*
+==================
+CSGFaces_AddSkip
+
+Gives the faces CSGFaces_ClipBrush hid the skip texinfo, and adds it now if
+CSGFaces_Finish will need it, so that CSGFaces_Finish only looks it up.
+Adding the texinfo changes the shared texinfo list, so only call this while
+no other thread is using it.
+==================
+*/
+void
+CSGFaces_AddSkip(csgbrushes_t *csg)
+{
+    for (size_t i = 0; i < csg->brushes.size(); i++) {
+        const bool mirror = options.fContentHack ? true : (csg->brushes[i]->contents != CONTENTS_SOLID);
+        for (face_t *face = csg->outside[i]; face; face = face->next) {
+            if (face->texinfo == TEXINFO_SKIP_PENDING)
+                face->texinfo = MakeSkipTexinfo();
+            if (mirror && MirrorIsSkip(face))
+                MakeSkipTexinfo();
         }
+    }
+}
+
+/*
+==================
+CSGFaces_Finish
+
+Merges the clipped faces of every brush into surfaces, in brush order so
+the result doesn't depend on which thread clipped what, then frees csg.
+==================
+*/
+surface_t *
+CSGFaces_Finish(csgbrushes_t *csg)
+{
+    std::map<int, face_t *> planefaces;
+    csgfaces = brushfaces = csgmergefaces = 0;
+
+    for (size_t i = 0; i < csg->brushes.size(); i++) {
+        const brush_t *brush = csg->brushes[i];
+        for (const face_t *face = brush->faces; face; face = face->next)
+            brushfaces++;
 
         /*
          * All of the faces left on the outside list are real surface faces
          * If the brush is non-solid, mirror faces for the inside view
          */
-        mirror = options.fContentHack ? true : (brush->contents != CONTENTS_SOLID);
-        SaveFacesToPlaneList(outside, mirror, planefaces);
-
-        progress++;
-        Message(msgPercent, progress, entity->numbrushes);
+        const bool mirror = options.fContentHack ? true : (brush->contents != CONTENTS_SOLID);
+        SaveFacesToPlaneList(csg->outside[i], mirror, planefaces);
+        csg->outside[i] = nullptr;
     }
 
-    surfaces = BuildSurfaces(planefaces);
+    surface_t *surfaces = BuildSurfaces(planefaces);
+
+    std::vector<const brush_t *>().swap(csg->brushes);
+    std::vector<std::vector<int>>().swap(csg->touching);
+    std::vector<face_t *>().swap(csg->outside);
 
     Message(msgStat, "%8d brushfaces", brushfaces);
     Message(msgStat, "%8d csgfaces", csgfaces);
@@ -699,3 +805,36 @@ CSGFaces(const mapentity_t *entity)
 
     return surfaces;
 }
+
+/*
+==================
+CSGFaces
+
+Returns a list of surfaces containing all of the faces
+==================
+*/
+surface_t *
+CSGFaces(const mapentity_t *entity)
+{
+    csgbrushes_t csg;
+
+    Message(msgProgress, "CSGFaces");
+
+#if 0
+    logprint("CSGFaces brush order:\n");
+    for (const brush_t *brush = entity->brushes; brush; brush = brush->next) {
+        logprint("    %s (%s)\n", map.texinfoTextureName(brush->faces->texinfo).c_str(), GetContentsName(brush->contents));
+    }
+#endif
+
+    CSGFaces_Prepare(entity, &csg);
+
+    const int numbrushes = static_cast<int>(csg.brushes.size());
+    for (int i = 0; i < numbrushes; i++) {
+        CSGFaces_ClipBrush(&csg, i);
+        Message(msgPercent, i + 1, entity->numbrushes);
+    }
+
+    CSGFaces_AddSkip(&csg);
+    return CSGFaces_Finish(&csg);
+}
@@ -25,6 +25,7 @@
 #include <list>
 #include <utility>
 #include <cassert>
+#include <mutex>
 
 #include <ctype.h>
 #include <string.h>
@@ -165,12 +166,17 @@ AddAnimTex(const char *name)
     }
 }
 
+/* guards map.miptex and map.mtexinfos, CSG looks up the skip texinfo from any thread */
+static std::mutex texinfo_lock;
+
 int
 FindMiptex(const char *name)
 {
     const char *pathsep;
     int i;
 
+    std::lock_guard<std::mutex> lock(texinfo_lock);
+
     /* Ignore leading path in texture names (Q2 map compatibility) */
     pathsep = strrchr(name, '/');
     if (pathsep)
@@ -251,6 +257,8 @@ FindTexinfo(mtexinfo_t *texinfo, uint64_t flags)
         }
     }
     
+    std::lock_guard<std::mutex> lock(texinfo_lock);
+
     // check for an exact match in the reverse lookup
     const auto it = map.mtexinfo_lookup.find(*texinfo);
     if (it != map.mtexinfo_lookup.end()) {
@@ -21,6 +21,7 @@
 
 #include <qbsp/qbsp.hh>
 
+#include <array>
 #include <vector>
 #include <set>
 #include <list>
@@ -85,10 +86,10 @@ Returns true if the portal has non-opaque leafs on both sides
 from q3map
 =============
 */
-static bool Portal_Passable(const portal_t *p)
+static bool Portal_Passable(const portal_t *p, const node_t *outside_node)
 {
-    if (p->nodes[0] == &outside_node
-        || p->nodes[1] == &outside_node) {
+    if (p->nodes[0] == outside_node
+        || p->nodes[1] == outside_node) {
         // FIXME: need this because the outside_node doesn't have PLANENUM_LEAF set
         return false;
     }
@@ -109,7 +110,7 @@ precondition: all leafs have occupied set to 0
 ==================
 */
 static void
-BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &occupied_leafs)
+BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &occupied_leafs, const node_t *outside_node)
 {
     std::list<std::pair<node_t *, int>> queue;
     for (node_t *leaf : occupied_leafs) {
@@ -132,7 +133,7 @@ BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &occupied_leafs)
             for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
                 side = (portal->nodes[0] == node);
                 
-                if (!Portal_Passable(portal))
+                if (!Portal_Passable(portal, outside_node))
                     continue;
                 
                 node_t *neighbour = portal->nodes[side];
@@ -143,7 +144,7 @@ BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &occupied_leafs)
 }
 
 static std::pair<std::vector<portal_t *>, node_t*>
-MakeLeakLine(node_t *outleaf)
+MakeLeakLine(node_t *outleaf, const node_t *outside_node)
 {
     std::vector<portal_t *> result;
     
@@ -166,7 +167,7 @@ MakeLeakLine(node_t *outleaf)
         for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
             side = (portal->nodes[0] == node);
             
-            if (!Portal_Passable(portal))
+            if (!Portal_Passable(portal, outside_node))
                 continue;
             
             node_t *neighbour = portal->nodes[side];
@@ -215,26 +216,60 @@ WriteLeakTrail(FILE *leakfile, const vec3_t point1, const vec3_t point2)
     }
 }
 
+/*
+===============
+SaveLeakLine
+
+Keeps the points of the leak so the .pts file can be written once the
+portals are gone, see WriteLeakFile
+===============
+*/
 static void
-WriteLeakLine(const std::pair<std::vector<portal_t *>, node_t*> &leakline)
+SaveLeakLine(const std::pair<std::vector<portal_t *>, node_t*> &leakline, leakline_t *leak)
 {
-    FILE *ptsfile = InitPtsFile();
-    
-    vec3_t prevpt, currpt;
-    VectorCopy(leakline.second->occupant->origin, prevpt);
+    std::array<vec_t, 3> point;
+    VectorCopy(leakline.second->occupant->origin, point.data());
+    leak->points.push_back(point);
     
     for (auto it = leakline.first.rbegin(); it != leakline.first.rend(); ++it) {
         portal_t *portal = *it;
-        MidpointWinding(portal->winding, currpt);
-        
-        // draw dots from prevpt to currpt
-        WriteLeakTrail(ptsfile, prevpt, currpt);
-        
-        VectorCopy(currpt, prevpt);
+        MidpointWinding(portal->winding, point.data());
+        leak->points.push_back(point);
     }
+}
+
+/*
+===============
+WriteLeakFile
+
+Writes the .pts file for the first leak found and removes the .prt file
+===============
+*/
+void
+WriteLeakFile(const leakline_t &leak)
+{
+    if (leak.points.empty() || map.leakfile)
+        return;
+    
+    FILE *ptsfile = InitPtsFile();
+    
+    // draw dots between consecutive points
+    for (size_t i = 1; i < leak.points.size(); i++)
+        WriteLeakTrail(ptsfile, leak.points[i - 1].data(), leak.points[i].data());
     
     fclose(ptsfile);
     Message(msgLiteral, "Leak file written to %s\n", options.szBSPName);
+    map.leakfile = true;
+
+    /* Get rid of the .prt file since the map has a leak */
+    StripExtension(options.szBSPName);
+    strcat(options.szBSPName, ".prt");
+    remove(options.szBSPName);
+    
+    if (options.fLeakTest) {
+        logprint("Aborting because -leaktest was used.\n");
+        exit(1);
+    }
 }
 
 /*
@@ -336,10 +371,11 @@ OutLeafsToSolid(node_t *node)
 ===========
 FillOutside
 
+If the map leaks, the trail is saved to leak for WriteLeakFile
 ===========
 */
 bool
-FillOutside(node_t *node, const int hullnum)
+FillOutside(node_t *node, const node_t *outside_node, const int hullnum, leakline_t *leak)
 {
     Message(msgProgress, "FillOutside");
     
@@ -358,36 +394,21 @@ FillOutside(node_t *node, const int hullnum)
         return false;
     }
 
-    BFSFloodFillFromOccupiedLeafs(occupied_leafs);
+    BFSFloodFillFromOccupiedLeafs(occupied_leafs, outside_node);
 
     /* first check to see if an occupied leaf is hit */
-    const int side = (outside_node.portals->nodes[0] == &outside_node);
-    node_t *fillnode = outside_node.portals->nodes[side];
+    const int side = (outside_node->portals->nodes[0] == outside_node);
+    node_t *fillnode = outside_node->portals->nodes[side];
     
     if (fillnode->occupied > 0) {
-        const auto leakline = MakeLeakLine(fillnode);
+        const auto leakline = MakeLeakLine(fillnode, outside_node);
         
         mapentity_t *leakentity = leakline.second->occupant;
         Q_assert(leakentity != nullptr);
         
         const vec_t *origin = leakentity->origin;
         Message(msgWarning, warnMapLeak, origin[0], origin[1], origin[2]);
-        if (map.leakfile)
-            return false;
-        
-        WriteLeakLine(leakline);
-        map.leakfile = true;
-
-        /* Get rid of the .prt file since the map has a leak */
-        StripExtension(options.szBSPName);
-        strcat(options.szBSPName, ".prt");
-        remove(options.szBSPName);
-        
-        if (options.fLeakTest) {
-            logprint("Aborting because -leaktest was used.\n");
-            exit(1);
-        }
-        
+        SaveLeakLine(leakline, leak);
         return false;
     }
 
@@ -22,8 +22,6 @@
 
 #include <qbsp/qbsp.hh>
 
-node_t outside_node;    // portals outside the world face this
-
 class portal_state_t {
 public:
     int num_visportals;
@@ -383,19 +381,17 @@ RemovePortalFromNode(portal_t *portal, node_t *l)
 
 /*
 ================
-MakeHeadnodePortals
+HeadnodePlanes
 
-The created portals will face the global outside_node
+The six planes boxing in the entity, indexed j * 3 + i
 ================
 */
 static void
-MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
+HeadnodePlanes(const mapentity_t *entity, qbsp_plane_t bplanes[6])
 {
     vec3_t bounds[2];
-    int i, j, n;
-    portal_t *p, *portals[6];
-    qbsp_plane_t bplanes[6], *pl;
-    int side;
+    int i, j;
+    qbsp_plane_t *pl;
 
     // pad with some space so there will never be null volume leafs
     for (i = 0; i < 3; i++) {
@@ -403,17 +399,9 @@ MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
         bounds[1][i] = entity->maxs[i] + SIDESPACE;
     }
 
-    outside_node.contents = CONTENTS_SOLID;
-    outside_node.portals = NULL;
-
     for (i = 0; i < 3; i++)
         for (j = 0; j < 2; j++) {
-            n = j * 3 + i;
-
-            p = (portal_t *)AllocMem(PORTAL, 1, true);
-            portals[n] = p;
-
-            pl = &bplanes[n];
+            pl = &bplanes[j * 3 + i];
             memset(pl, 0, sizeof(*pl));
             if (j) {
                 pl->normal[i] = -1;
@@ -422,13 +410,65 @@ MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
                 pl->normal[i] = 1;
                 pl->dist = bounds[j][i];
             }
+        }
+}
+
+/*
+================
+FindHeadnodePlanes
+
+Adds the planes PortalizeWorld will use for this entity to map.planes, in
+the order MakeHeadnodePortals asks for them, so that portalizing on a
+worker thread finds them instead of creating new ones
+================
+*/
+void
+FindHeadnodePlanes(const mapentity_t *entity)
+{
+    qbsp_plane_t bplanes[6];
+    int i, j, side;
+
+    HeadnodePlanes(entity, bplanes);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 2; j++)
+            FindPlane(bplanes[j * 3 + i].normal, bplanes[j * 3 + i].dist, &side);
+}
+
+/*
+================
+MakeHeadnodePortals
+
+The created portals will face outside_node
+================
+*/
+static void
+MakeHeadnodePortals(const mapentity_t *entity, node_t *node, node_t *outside_node)
+{
+    int i, j, n;
+    portal_t *p, *portals[6];
+    qbsp_plane_t bplanes[6], *pl;
+    int side;
+
+    HeadnodePlanes(entity, bplanes);
+
+    outside_node->contents = CONTENTS_SOLID;
+    outside_node->portals = NULL;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 2; j++) {
+            n = j * 3 + i;
+
+            p = (portal_t *)AllocMem(PORTAL, 1, true);
+            portals[n] = p;
+
+            pl = &bplanes[n];
             p->planenum = FindPlane(pl->normal, pl->dist, &side);
 
             p->winding = BaseWindingForPlane(pl);
             if (side)
-                AddPortalToNodes(p, &outside_node, node);
+                AddPortalToNodes(p, outside_node, node);
             else
-                AddPortalToNodes(p, node, &outside_node);
+                AddPortalToNodes(p, node, outside_node);
         }
 
     // clip the basewindings by all the other planes
@@ -678,11 +718,13 @@ CutNodePortals_r(node_t *node, portal_state_t *state)
 ==================
 PortalizeWorld
 
-Builds the exact polyhedrons for the nodes and leafs
+Builds the exact polyhedrons for the nodes and leafs. The portals on the
+outside of the world face outside_node.
 ==================
 */
 void
-PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum)
+PortalizeWorld(const mapentity_t *entity, node_t *headnode, node_t *outside_node,
+               const int hullnum)
 {
     Message(msgProgress, "Portalize");
 
@@ -691,7 +733,7 @@ PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum)
     
     state.iNodesDone = 0;
 
-    MakeHeadnodePortals(entity, headnode);
+    MakeHeadnodePortals(entity, headnode, outside_node);
     CutNodePortals_r(headnode, &state);
 
     if (!hullnum) {
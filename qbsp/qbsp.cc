@@ -21,7 +21,11 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <common/log.hh>
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 #include <qbsp/wad.hh>
 
@@ -31,29 +35,49 @@ static const char *IntroString =
 // command line flags
 options_t options;
 
+/*
+ * One hull of one brush entity. Loading and exporting touch the shared
+ * tables and run in entity order; everything in between only reads them,
+ * so with -threads it runs on worker threads.
+ */
+struct hulljob_t {
+    mapentity_t *entity;        /* entity in map.entities, receives the lumps */
+    mapentity_t work;           /* copy holding this hull's brushes and bounds */
+    int hullnum;
+    csgbrushes_t csg;
+    bool clipped;               /* csg already clipped, only CSGFaces_Finish left */
+    node_t *nodes;
+    memarena_t *arena;          /* everything built between loading and exporting */
+    int splitnodes;             /* for MakeFaceEdges progress */
+    node_t outside;             /* portals outside the world face this */
+    leakline_t leak;
+    msgcapture_t messages;
+};
+
 /*
 ===============
-ProcessEntity
+LoadEntity
+
+Converts the entity's map brushes for hullnum into job. Returns false for
+entities with nothing to build.
 ===============
 */
-void
-ProcessEntity(mapentity_t *entity, const int hullnum)
+static bool
+LoadEntity(mapentity_t *entity, const int hullnum, hulljob_t *job)
 {
-    int i, firstface;
-    surface_t *surfs;
-    node_t *nodes;
+    int i;
     
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity->nummapbrushes && entity != pWorldEnt())
-        return;
+        return false;
     
     /*
      * func_group and func_detail entities get their brushes added to the
      * worldspawn
      */
     if (IsWorldBrushEntity(entity))
-        return;
+        return false;
 
     if (entity != pWorldEnt()) {
         char mod[20];
@@ -149,24 +173,72 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         Error("Entity with no valid brushes");
     }
 
+    /*
+     * The world's headnode planes are the only ones added after loading;
+     * add them now so plane numbering doesn't depend on thread timing.
+     */
+    if (entity == pWorldEnt() && !options.fNofill)
+        FindHeadnodePlanes(entity);
+
+    job->entity = entity;
+    job->work = *entity;
+    job->hullnum = hullnum;
+    job->clipped = false;
+    job->nodes = NULL;
+    job->arena = AllocArena();
+    job->splitnodes = 0;
+    job->messages.verbose = options.fVerbose;
+
+    /* the brushes belong to the job now */
+    entity->brushes = NULL;
+
+    map.cTotal[LUMP_MODELS]++;
+    return true;
+}
+
+/*
+===============
+BuildEntity
+
+CSG, BSP and outside filling for one job
+===============
+*/
+static void
+BuildEntity(hulljob_t *job)
+{
+    mapentity_t *entity = &job->work;
+    const int hullnum = job->hullnum;
+    const bool isworld = (job->entity == pWorldEnt());
+    memarena_t *previous = UseArena(job->arena);
+    const char *phase = "csg/bsp";
+    surface_t *surfs;
+    node_t *nodes;
+
     /*
      * Take the brush_t's and clip off all overlapping and contained faces,
      * leaving a perfect skin of the model with no hidden faces
      */
-    surfs = CSGFaces(entity);
+    if (job->clipped) {
+        Message(msgProgress, "CSGFaces");
+        surfs = CSGFaces_Finish(&job->csg);
+    } else {
+        surfs = CSGFaces(entity);
+    }
     
-    if (options.fObjExport && entity == pWorldEnt() && hullnum == 0) {
+    if (options.fObjExport && isworld && hullnum == 0) {
         ExportObj_Surfaces(surfs);
     }
     
     if (hullnum != 0) {
         nodes = SolidBSP(entity, surfs, true);
-        if (entity == pWorldEnt() && !options.fNofill) {
+        if (isworld && !options.fNofill) {
             // assume non-world bmodels are simple
-            PortalizeWorld(entity, nodes, hullnum);
-            if (FillOutside(nodes, hullnum)) {
+            PortalizeWorld(entity, nodes, &job->outside, hullnum);
+            if (FillOutside(nodes, &job->outside, hullnum, &job->leak)) {
                 // Free portals before regenerating new nodes
                 FreeAllPortals(nodes);
+                ReportArena(job->arena, phase);
+                phase = "final bsp";
                 surfs = GatherNodeFaces(nodes);
                 // make a really good tree
                 nodes = SolidBSP(entity, surfs, false);
@@ -174,9 +246,6 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
                 DetailToSolid(nodes);
             }
         }
-        AllocBSPPlanes();
-        AllocBSPTexinfo();
-        ExportClipNodes(entity, nodes, hullnum);
     } else {
         /*
          * SolidBSP generates a node tree
@@ -192,16 +261,20 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         if (options.forceGoodTree)
             nodes = SolidBSP(entity, surfs, false);
         else
-            nodes = SolidBSP(entity, surfs, entity == pWorldEnt());
+            nodes = SolidBSP(entity, surfs, isworld);
 
         // build all the portals in the bsp tree
         // some portals are solid polygons, and some are paths to other leafs
-        if (entity == pWorldEnt() && !options.fNofill) {
+        if (isworld && !options.fNofill) {
             // assume non-world bmodels are simple
-            PortalizeWorld(entity, nodes, hullnum);
-            if (FillOutside(nodes, hullnum)) {
+            PortalizeWorld(entity, nodes, &job->outside, hullnum);
+            if (FillOutside(nodes, &job->outside, hullnum, &job->leak)) {
                 FreeAllPortals(nodes);
 
+                // the first tree's memory is recycled by the final one
+                ReportArena(job->arena, phase);
+                phase = "final bsp";
+
                 // get the remaining faces together into surfaces again
                 surfs = GatherNodeFaces(nodes);
 
@@ -215,7 +288,7 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
                 DetailToSolid(nodes);
                 
                 // make the real portals for vis tracing
-                PortalizeWorld(entity, nodes, hullnum);
+                PortalizeWorld(entity, nodes, &job->outside, hullnum);
 
                 TJunc(entity, nodes);
             }
@@ -224,17 +297,64 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         
         // convert detail leafs to solid (in case we didn't make the call above)
         DetailToSolid(nodes);
+    }
+
+    job->nodes = nodes;
+    job->splitnodes = splitnodes;
+    ReportArena(job->arena, phase);
+    UseArena(previous);
+}
+
+/*
+===============
+ExportEntity
+
+Writes the job's tree into the bsp lumps and frees its brushes and tree
+===============
+*/
+static void
+ExportEntity(hulljob_t *job)
+{
+    const bool verbose = options.fVerbose;
+    int firstface;
+
+    options.fVerbose = job->messages.verbose;
+    Message_Replay(&job->messages);
+    WriteLeakFile(job->leak);
+
+    splitnodes = job->splitnodes;
 
-        AllocBSPPlanes();
-        AllocBSPTexinfo();
+    AllocBSPPlanes();
+    AllocBSPTexinfo();
 
-        firstface = MakeFaceEdges(entity, nodes);
-        ExportDrawNodes(entity, nodes, firstface);
+    if (job->hullnum != 0) {
+        ExportClipNodes(job->entity, job->nodes, job->hullnum);
+    } else {
+        firstface = MakeFaceEdges(job->entity, job->nodes);
+        ExportDrawNodes(job->entity, job->nodes, firstface);
     }
 
-    FreeBrushes(entity);
-    
-    map.cTotal[LUMP_MODELS]++;
+    FreeBrushes(&job->work);
+    FreeArena(job->arena);
+    job->nodes = NULL;
+    job->arena = NULL;
+    options.fVerbose = verbose;
+}
+
+/*
+===============
+ProcessEntity
+===============
+*/
+void
+ProcessEntity(mapentity_t *entity, const int hullnum)
+{
+    hulljob_t job;
+
+    if (!LoadEntity(entity, hullnum, &job))
+        return;
+    BuildEntity(&job);
+    ExportEntity(&job);
 }
 
 /*
@@ -535,6 +655,101 @@ CreateSingleHull(const int hullnum)
     }
 }
 
+/*
+=================
+BuildHullGroup
+
+Clips the brushes of every job in the group as one pool of work, builds
+the jobs in parallel, largest first, then exports them in order. The
+clipped faces of the group are all held until each job's build merges
+them, so the pool spans only this group, not every hull of the map.
+=================
+*/
+static void
+BuildHullGroup(std::vector<hulljob_t> *group, int *hullnum)
+{
+    std::vector<hulljob_t> &jobs = *group;
+
+    std::vector<std::pair<int, int>> brushes;
+    for (int i = 0; i < static_cast<int>(jobs.size()); i++) {
+        CSGFaces_Prepare(&jobs[i].work, &jobs[i].csg);
+        jobs[i].clipped = true;
+        for (int j = 0; j < static_cast<int>(jobs[i].csg.brushes.size()); j++)
+            brushes.push_back(std::make_pair(i, j));
+    }
+
+    Message(msgLiteral, "Clipping %d brushes on %d threads...\n", static_cast<int>(brushes.size()), numthreads);
+    ParallelFor(0, static_cast<int>(brushes.size()), [&](int i) {
+        hulljob_t &job = jobs[brushes[i].first];
+        memarena_t *previous = UseArena(job.arena);
+        CSGFaces_ClipBrush(&job.csg, brushes[i].second);
+        UseArena(previous);
+    });
+
+    /* in job order, so the skip texinfo is added where the serial path adds it */
+    for (hulljob_t &job : jobs)
+        CSGFaces_AddSkip(&job.csg);
+
+    std::vector<int> order(jobs.size());
+    for (int i = 0; i < static_cast<int>(jobs.size()); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return jobs[a].work.numbrushes > jobs[b].work.numbrushes;
+    });
+
+    Message(msgLiteral, "Building %d hulls on %d threads...\n", static_cast<int>(jobs.size()), numthreads);
+    ParallelForOrdered(order, [&](int i) {
+        Message_Capture(&jobs[i].messages);
+        BuildEntity(&jobs[i]);
+        Message_Capture(nullptr);
+    });
+
+    for (hulljob_t &job : jobs) {
+        if (job.hullnum != *hullnum) {
+            *hullnum = job.hullnum;
+            Message(msgLiteral, "Processing hull %d...\n", *hullnum);
+        }
+        ExportEntity(&job);
+    }
+    jobs.clear();
+}
+
+/*
+=================
+CreateHullsParallel
+
+Loads the hulls of the brush entities in the order CreateSingleHull
+would, numthreads at a time, and builds each group on numthreads threads
+before loading the next. Only one group's brushes and trees are held at
+once. The output is identical to the serial path.
+=================
+*/
+static void
+CreateHullsParallel(const std::vector<int> &hulls)
+{
+    std::vector<hulljob_t> jobs;
+    int exported = -1;
+
+    for (int hullnum : hulls) {
+        Message(msgLiteral, "Loading hull %d...\n", hullnum);
+        map.cTotal[LUMP_MODELS] = 0;
+
+        for (int i = 0; i < map.numentities(); i++) {
+            hulljob_t job;
+            if (LoadEntity(&map.entities.at(i), hullnum, &job))
+                jobs.push_back(std::move(job));
+            if (!options.fAllverbose)
+                options.fVerbose = false;   // don't print rest of entities
+
+            if (static_cast<int>(jobs.size()) >= numthreads)
+                BuildHullGroup(&jobs, &exported);
+        }
+    }
+
+    if (!jobs.empty())
+        BuildHullGroup(&jobs, &exported);
+}
+
 /*
 =================
 CreateHulls
@@ -544,25 +759,32 @@ CreateHulls
 void
 CreateHulls(void)
 {
-    /* create the hulls sequentially */
-    if (!options.fNoverbose)
-        options.fVerbose = true;
-
-    CreateSingleHull(0);
+    std::vector<int> hulls { 0 };
 
     /* ignore the clipping hulls altogether */
-    if (options.fNoclip)
-        return;
+    if (!options.fNoclip) {
+        hulls.push_back(1);
+        hulls.push_back(2);
+
+        if (options.hexen2)
+        {   /*note: h2mp doesn't use hull 2 automatically, however gamecode can explicitly set ent.hull=3 to access it*/
+            hulls.push_back(3);
+            hulls.push_back(4);
+            hulls.push_back(5);
+        }
+    }
 
-    CreateSingleHull(1);
-    CreateSingleHull(2);
+    if (!options.fNoverbose)
+        options.fVerbose = true;
 
-    if (options.hexen2)
-    {   /*note: h2mp doesn't use hull 2 automatically, however gamecode can explicitly set ent.hull=3 to access it*/
-        CreateSingleHull(3);
-        CreateSingleHull(4);
-        CreateSingleHull(5);
+    if (numthreads > 1) {
+        CreateHullsParallel(hulls);
+        return;
     }
+
+    /* create the hulls sequentially */
+    for (int hullnum : hulls)
+        CreateSingleHull(hullnum);
 }
 
 wad_t *wadlist = NULL;
@@ -677,9 +899,12 @@ PrintOptions(void)
            "   -2psb           Request output in 2psb format (RMQ compatible)\n"
            "   -leakdist  [n]  Space between leakfile points (default 2)\n"
            "   -subdivide [n]  Use different texture subdivision (default 240)\n"
+           "   -threads [n]    Build hulls and brush entities on n threads, holding up to n hulls in memory (default: all cores)\n"
            "   -wadpath <dir>  Search this directory for wad files\n"
            "   -oldrottex      Use old rotate_ brush texturing aligned at (0 0 0)\n"
            "   -maxnodesize [n]Triggers simpler BSP Splitting when node exceeds size (default 1024, 0 to disable)\n"
+           "   -bsptasks [n]   With -threads, SolidBSP nodes with at least n surfaces build their two sides in parallel (default 512, 0 to disable)\n"
+           "   -splitsample [n]Only test n candidate planes per node when choosing a split (default 0, test all)\n"
            "   -epsilon [n]    Customize ON_EPSILON (default 0.0001)\n"
            "   -forceprt1      Create a PRT1 file for loading in editors, even if PRT2 is required to run vis.\n"
            "   -objexport      Export the map file as an .OBJ model after the CSG phase\n"
@@ -827,6 +1052,12 @@ ParseOptions(char *szOptions)
                     Error("Invalid argument to option %s", szTok);
                 options.dxLeakDist = atoi(szTok2);
                 szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "threads")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                numthreads = atoi(szTok2);
+                szTok = szTok2;
             } else if (!Q_strcasecmp(szTok, "subdivide")) {
                 szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
                 if (!szTok2)
@@ -850,6 +1081,18 @@ ParseOptions(char *szOptions)
                     Error("Invalid argument to option %s", szTok);
                 options.maxNodeSize= atoi(szTok2);
                 szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "bsptasks")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                options.bspTaskSurfaces = atoi(szTok2);
+                szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "splitsample")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                options.splitSample = atoi(szTok2);
+                szTok = szTok2;
             } else if (!Q_strcasecmp(szTok, "epsilon")) {
                 szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
                 if (!szTok2)
@@ -917,6 +1160,8 @@ InitQBSP(int argc, const char **argv)
     char *szBuf;
     int length;
 
+    numthreads = GetDefaultThreads();
+
     length = LoadFile("qbsp.ini", &szBuf, false);
     if (length) {
         Message(msgLiteral, "Loading options from qbsp.ini\n");
@@ -21,15 +21,68 @@
 
 #include <limits.h>
 
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 
-int splitnodes;
+/* per thread, hulls are built in parallel */
+thread_local int splitnodes;
+
+/*
+ * State of one SolidBSP call. Subtrees built as separate tasks get their
+ * own copy, and the counts are added up when they are done.
+ */
+struct partition_t {
+    bool midsplit;
+    bool percent;       /* report progress; only on the calling thread */
+    int splitnodes;
+    int leaffaces;
+    int nodefaces;
+    int c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
+    int c_illusionary_visblocker;
+};
+
+/* nodes with fewer candidate surfaces than this just count their splits */
+#define SPLITCACHE_MIN_SURFACES 256
 
-static int leaffaces;
-static int nodefaces;
-static int c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
-static int c_illusionary_visblocker;
-static bool usemidsplit;
+/*
+ * Faces crossing each candidate plane of a node, for ChoosePlaneFromList.
+ * Built once for a node, then when the node is divided the counts are
+ * handed down to the larger child and corrected for the faces that left
+ * it or were split, instead of testing every face against every plane
+ * again. The smaller child builds its own when it needs it.
+ *
+ * Planes are grouped by normal and sorted by distance, so a face is only
+ * tested against the planes that pass through its extent.
+ */
+struct planesplits_t {
+    int planenum;
+    vec_t dist;
+    int splits;         /* faces the plane would split */
+    int hintsplits;     /* how many of those are hint faces */
+};
+
+struct planegroup_t {
+    vec3_t normal;
+    int type;
+    std::vector<planesplits_t> planes;  /* sorted by dist */
+};
+
+struct splitcache_t {
+    bool valid;
+    std::vector<planegroup_t> groups;
+
+    splitcache_t() : valid(false) {}
+};
+
+/* a face cut by DividePlane, saved for the split counts */
+struct splitface_t {
+    face_t original;
+    face_t *front, *back;
+};
 
 //============================================================================
 
@@ -286,7 +339,7 @@ The clipping hull BSP doesn't worry about avoiding splits
 ==================
 */
 static surface_t *
-ChooseMidPlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
+ChooseMidPlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs, const partition_t *part)
 {
     surface_t *surf, *bestsurface;
     vec_t metric, bestmetric;
@@ -346,14 +399,14 @@ ChooseMidPlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
     if (!bestsurface)
         Error("No valid planes in surface list (%s)", __func__);
 
-    // ericw -- (!usemidsplit) is true on the final SolidBSP phase for the world.
+    // ericw -- (!midsplit) is true on the final SolidBSP phase for the world.
     // !bestsurface->has_struct means all surfaces in this node are detail, so
     // mark the surface as a detail separator.
     //
     // TODO: investigate dropping the maxNodeSize feature (dynamically choosing
     // between ChooseMidPlaneFromList and ChoosePlaneFromList) and use Q2's
     // chopping on a uniform grid?
-    if (!usemidsplit && !bestsurface->has_struct) {
+    if (!part->midsplit && !bestsurface->has_struct) {
         bestsurface->detail_separator = true;
     }
     
@@ -362,6 +415,307 @@ ChooseMidPlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
 
 
 
+/*
+==================
+SurfaceStraddles
+
+False if the bounds of surf are clear of the plane, so none of its faces
+can be split by it.
+==================
+*/
+static bool
+SurfaceStraddles(const surface_t *surf, const qbsp_plane_t *plane)
+{
+    vec_t lo, hi;
+    int i;
+
+    if (plane->type < 3) {
+        lo = surf->mins[plane->type];
+        hi = surf->maxs[plane->type];
+    } else {
+        lo = hi = 0;
+        for (i = 0; i < 3; i++) {
+            if (plane->normal[i] > 0) {
+                lo += plane->normal[i] * surf->mins[i];
+                hi += plane->normal[i] * surf->maxs[i];
+            } else {
+                lo += plane->normal[i] * surf->maxs[i];
+                hi += plane->normal[i] * surf->mins[i];
+            }
+        }
+    }
+
+    return lo <= plane->dist + ON_EPSILON && hi >= plane->dist - ON_EPSILON;
+}
+
+/*
+==================
+SurfaceSplits
+
+Counts the faces the plane of surf would split, stopping once there are
+more than minsplits. INT_MAX if it would split a hint face and isn't
+a hint itself.
+==================
+*/
+static int
+SurfaceSplits(surface_t *surfaces, const surface_t *surf, bool hintsplit,
+              int minsplits)
+{
+    const qbsp_plane_t *plane, *plane2;
+    const surface_t *surf2;
+    const face_t *face;
+    int splits;
+
+    plane = &map.planes[surf->planenum];
+    splits = 0;
+
+    for (surf2 = surfaces; surf2; surf2 = surf2->next) {
+        if (surf2 == surf || surf2->onnode)
+            continue;
+        plane2 = &map.planes[surf2->planenum];
+        if (plane->type < 3 && plane->type == plane2->type)
+            continue;
+        if (!SurfaceStraddles(surf2, plane))
+            continue;
+        for (face = surf2->faces; face; face = face->next) {
+            const uint64_t flags = map.mtexinfos.at(face->texinfo).flags;
+            /* Don't penalize for splitting skip faces */
+            if (flags & TEX_SKIP)
+                continue;
+            if (FaceSide(face, plane) == SIDE_ON) {
+                /* Never split a hint face except with a hint */
+                if (!hintsplit && (flags & TEX_HINT)) {
+                    splits = INT_MAX;
+                    break;
+                }
+                splits++;
+                if (splits >= minsplits)
+                    break;
+            }
+        }
+        if (splits > minsplits)
+            break;
+    }
+
+    return splits;
+}
+
+static bool
+SplitCache_Less(const planesplits_t &a, const planesplits_t &b)
+{
+    if (a.dist != b.dist)
+        return a.dist < b.dist;
+    return a.planenum < b.planenum;
+}
+
+/*
+==================
+SplitCache_Group
+
+Returns the group for the normal of plane, NULL if there isn't one
+==================
+*/
+static planegroup_t *
+SplitCache_Group(splitcache_t *cache, const qbsp_plane_t *plane)
+{
+    for (planegroup_t &group : cache->groups)
+        if (group.normal[0] == plane->normal[0]
+            && group.normal[1] == plane->normal[1]
+            && group.normal[2] == plane->normal[2])
+            return &group;
+    return NULL;
+}
+
+/*
+==================
+SplitCache_Find
+==================
+*/
+static std::vector<planesplits_t>::iterator
+SplitCache_Find(splitcache_t *cache, int planenum, planegroup_t **group)
+{
+    const qbsp_plane_t *plane = &map.planes[planenum];
+    const planesplits_t key = { planenum, plane->dist, 0, 0 };
+
+    *group = SplitCache_Group(cache, plane);
+    if (*group) {
+        auto it = std::lower_bound((*group)->planes.begin(), (*group)->planes.end(),
+                                   key, SplitCache_Less);
+        if (it != (*group)->planes.end() && it->planenum == planenum)
+            return it;
+    }
+    Error("Internal error: plane %d not in split cache (%s)", planenum, __func__);
+}
+
+/*
+==================
+SplitCache_AddFace
+
+Adds (sign 1) or removes (sign -1) a face's splits to every plane in
+the cache, with the same rules as SurfaceSplits.
+==================
+*/
+static void
+SplitCache_AddFace(splitcache_t *cache, const face_t *face, int sign)
+{
+    const uint64_t flags = map.mtexinfos.at(face->texinfo).flags;
+    const qbsp_plane_t *faceplane = &map.planes[face->planenum];
+    vec3_t mins, maxs;
+    vec_t lo, hi, dot;
+    int i, j;
+
+    if (flags & TEX_SKIP)
+        return;
+
+    for (i = 0; i < 3; i++) {
+        mins[i] = VECT_MAX;
+        maxs[i] = -VECT_MAX;
+    }
+    for (i = 0; i < face->w.numpoints; i++)
+        for (j = 0; j < 3; j++) {
+            mins[j] = qmin(mins[j], face->w.points[i][j]);
+            maxs[j] = qmax(maxs[j], face->w.points[i][j]);
+        }
+
+    for (planegroup_t &group : cache->groups) {
+        if (group.type < 3 && group.type == faceplane->type)
+            continue;
+
+        // a plane can only split the face if it passes through its bounds
+        if (group.type < 3) {
+            lo = mins[group.type];
+            hi = maxs[group.type];
+        } else {
+            dot = DotProduct(face->origin, group.normal);
+            lo = dot - face->radius - ON_EPSILON;
+            hi = dot + face->radius + ON_EPSILON;
+        }
+
+        const planesplits_t key = { -1, lo, 0, 0 };
+        for (auto it = std::lower_bound(group.planes.begin(), group.planes.end(), key, SplitCache_Less);
+             it != group.planes.end() && it->dist <= hi; ++it) {
+            if (it->planenum == face->planenum)
+                continue;
+            if (FaceSide(face, &map.planes[it->planenum]) != SIDE_ON)
+                continue;
+            it->splits += sign;
+            if (flags & TEX_HINT)
+                it->hintsplits += sign;
+        }
+    }
+}
+
+/*
+==================
+SplitCache_Build
+==================
+*/
+static void
+SplitCache_Build(surface_t *surfaces, splitcache_t *cache)
+{
+    const surface_t *surf;
+    const face_t *face;
+
+    cache->groups.clear();
+    for (surf = surfaces; surf; surf = surf->next) {
+        if (surf->onnode)
+            continue;
+        const qbsp_plane_t *plane = &map.planes[surf->planenum];
+        planegroup_t *group = SplitCache_Group(cache, plane);
+        if (!group) {
+            cache->groups.push_back(planegroup_t());
+            group = &cache->groups.back();
+            VectorCopy(plane->normal, group->normal);
+            group->type = plane->type;
+        }
+        group->planes.push_back(planesplits_t { surf->planenum, plane->dist, 0, 0 });
+    }
+    for (planegroup_t &group : cache->groups)
+        std::sort(group.planes.begin(), group.planes.end(), SplitCache_Less);
+
+    for (surf = surfaces; surf; surf = surf->next) {
+        if (surf->onnode)
+            continue;
+        for (face = surf->faces; face; face = face->next)
+            SplitCache_AddFace(cache, face, 1);
+    }
+    cache->valid = true;
+}
+
+/*
+==================
+SplitCache_Divide
+
+Hands the counts of a divided node down to the child with more faces.
+The faces that went to the other child, the faces that were cut (as
+they were before the cut) and the faces on the split plane itself
+(already removed by the caller) no longer count; the pieces of the cut
+faces on this side do.
+==================
+*/
+static void
+SplitCache_Divide(splitcache_t *cache, surface_t *front, surface_t *back,
+                  const std::vector<splitface_t> &splitfaces,
+                  splitcache_t *frontcache, splitcache_t *backcache)
+{
+    const surface_t *surf;
+    const face_t *face;
+    int numfaces[2] = { 0, 0 };
+
+    for (surf = front; surf; surf = surf->next)
+        if (!surf->onnode)
+            for (face = surf->faces; face; face = face->next)
+                numfaces[0]++;
+    for (surf = back; surf; surf = surf->next)
+        if (!surf->onnode)
+            for (face = surf->faces; face; face = face->next)
+                numfaces[1]++;
+
+    const int side = (numfaces[0] >= numfaces[1]) ? 0 : 1;
+    splitcache_t *child = side ? backcache : frontcache;
+    const surface_t *kept = side ? back : front;
+    const surface_t *other = side ? front : back;
+
+    *child = std::move(*cache);
+    child->valid = true;
+    cache->valid = false;
+
+    std::unordered_set<const face_t *> pieces;
+    for (const splitface_t &cut : splitfaces) {
+        pieces.insert(cut.front);
+        pieces.insert(cut.back);
+    }
+
+    for (surf = other; surf; surf = surf->next) {
+        if (surf->onnode)
+            continue;
+        for (face = surf->faces; face; face = face->next)
+            if (!pieces.count(face))
+                SplitCache_AddFace(child, face, -1);
+    }
+    for (const splitface_t &cut : splitfaces) {
+        SplitCache_AddFace(child, &cut.original, -1);
+        SplitCache_AddFace(child, side ? cut.back : cut.front, 1);
+    }
+
+    /* drop the planes that only went to the other side */
+    std::unordered_set<int> planenums;
+    for (surf = kept; surf; surf = surf->next)
+        if (!surf->onnode)
+            planenums.insert(surf->planenum);
+    auto dropped = [&](const planesplits_t &entry) {
+        return !planenums.count(entry.planenum);
+    };
+    for (planegroup_t &group : child->groups)
+        group.planes.erase(std::remove_if(group.planes.begin(), group.planes.end(), dropped),
+                           group.planes.end());
+    child->groups.erase(std::remove_if(child->groups.begin(), child->groups.end(),
+                                       [](const planegroup_t &group) {
+                                           return group.planes.empty();
+                                       }),
+                        child->groups.end());
+}
+
 /*
 ==================
 ChoosePlaneFromList
@@ -370,15 +724,36 @@ The real BSP hueristic
 ==================
 */
 static surface_t *
-ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
+ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs,
+                    splitcache_t *cache)
 {
-    int pass, splits, minsplits;
-    bool hintsplit;
-    surface_t *surf, *surf2, *bestsurface;
+    int pass, splits, minsplits, candidates, stride;
+    bool hintsplit, usecache;
+    surface_t *surf, *bestsurface;
     vec_t distribution, bestdistribution;
-    const qbsp_plane_t *plane, *plane2;
+    const qbsp_plane_t *plane;
     const face_t *face;
 
+    candidates = 0;
+    for (surf = surfaces; surf; surf = surf->next)
+        if (!surf->onnode)
+            candidates++;
+
+    /*
+     * With -splitsample, only test every n'th candidate on nodes with
+     * too many. Otherwise large nodes use the split counts, and small
+     * ones are cheap enough to just count.
+     */
+    stride = 1;
+    if (options.splitSample > 0 && candidates > options.splitSample)
+        stride = (candidates + options.splitSample - 1) / options.splitSample;
+
+    usecache = (stride == 1 && candidates >= SPLITCACHE_MIN_SURFACES);
+    if (!usecache)
+        *cache = splitcache_t();
+    else if (!cache->valid)
+        SplitCache_Build(surfaces, cache);
+
     /* pick the plane that splits the least */
     minsplits = INT_MAX - 1;
     bestdistribution = VECT_MAX;
@@ -386,6 +761,7 @@ ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
 
     /* Two passes - exhaust all non-detail faces before details */
     for (pass = 0; pass < 2; pass++) {
+        candidates = 0;
         for (surf = surfaces; surf; surf = surf->next) {
             if (surf->onnode)
                 continue;
@@ -404,35 +780,30 @@ ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
                 continue;
             if( !surf->has_struct && !pass )
                 continue;
-            
+            if (candidates++ % stride)
+                continue;
 
             plane = &map.planes[surf->planenum];
-            splits = 0;
-
-            for (surf2 = surfaces; surf2; surf2 = surf2->next) {
-                if (surf2 == surf || surf2->onnode)
-                    continue;
-                plane2 = &map.planes[surf2->planenum];
-                if (plane->type < 3 && plane->type == plane2->type)
+            if (!usecache) {
+                splits = SurfaceSplits(surfaces, surf, hintsplit, minsplits);
+            } else {
+                planegroup_t *group;
+                const auto counts = SplitCache_Find(cache, surf->planenum, &group);
+
+                /*
+                 * Up to minsplits the count is what SurfaceSplits would
+                 * return. Above that it can stop counting part way
+                 * through a surface and call it a tie, which only
+                 * matters for an axial plane that would win on
+                 * distribution, so ask it then.
+                 */
+                if (counts->splits <= minsplits)
+                    splits = (counts->hintsplits && !hintsplit) ? INT_MAX : counts->splits;
+                else if (plane->type < 3
+                         && SplitPlaneMetric(plane, mins, maxs) <= bestdistribution)
+                    splits = SurfaceSplits(surfaces, surf, hintsplit, minsplits);
+                else
                     continue;
-                for (face = surf2->faces; face; face = face->next) {
-                    const uint64_t flags = map.mtexinfos.at(face->texinfo).flags;
-                    /* Don't penalize for splitting skip faces */
-                    if (flags & TEX_SKIP)
-                        continue;
-                    if (FaceSide(face, plane) == SIDE_ON) {
-                        /* Never split a hint face except with a hint */
-                        if (!hintsplit && (flags & TEX_HINT)) {
-                            splits = INT_MAX;
-                            break;
-                        }
-                        splits++;
-                        if (splits >= minsplits)
-                            break;
-                    }
-                }
-                if (splits > minsplits)
-                    break;
             }
             if (splits > minsplits)
                 continue;
@@ -474,7 +845,7 @@ returns NULL if the surface list can not be divided any more (a leaf)
 ==================
 */
 static surface_t *
-SelectPartition(surface_t *surfaces)
+SelectPartition(surface_t *surfaces, const partition_t *part, splitcache_t *cache)
 {
     int i, surfcount;
     vec3_t mins, maxs;
@@ -517,11 +888,11 @@ SelectPartition(surface_t *surfaces)
             || (maxs[2] - mins[2]) > maxnodesize;
     }
 
-    if (usemidsplit || largenode) // do fast way for clipping hull
-        return ChooseMidPlaneFromList(surfaces, mins, maxs);
+    if (part->midsplit || largenode) // do fast way for clipping hull
+        return ChooseMidPlaneFromList(surfaces, mins, maxs, part);
 
     // do slow way to save poly splits for drawing hull
-    return ChoosePlaneFromList(surfaces, mins, maxs);
+    return ChoosePlaneFromList(surfaces, mins, maxs, cache);
 }
 
 //============================================================================
@@ -595,7 +966,7 @@ DividePlane
 */
 static void
 DividePlane(surface_t *in, qbsp_plane_t *split, surface_t **front,
-            surface_t **back)
+            surface_t **back, std::vector<splitface_t> *splitfaces)
 {
     face_t *facet, *next;
     face_t *frontlist, *backlist;
@@ -661,7 +1032,28 @@ DividePlane(surface_t *in, qbsp_plane_t *split, surface_t **front,
 
     for (facet = in->faces; facet; facet = next) {
         next = facet->next;
+
+        // SplitFace frees the face it cuts, keep a copy for the split counts
+        bool saved = false;
+        if (splitfaces) {
+            const vec_t dot = DotProduct(facet->origin, split->normal) - split->dist;
+            if (fabs(dot) <= facet->radius + ON_EPSILON) {
+                splitfaces->push_back(splitface_t());
+                splitfaces->back().original = *facet;
+                saved = true;
+            }
+        }
+
         SplitFace(facet, split, &frontfrag, &backfrag);
+        if (saved) {
+            if (frontfrag && backfrag) {
+                splitfaces->back().front = frontfrag;
+                splitfaces->back().back = backfrag;
+            } else {
+                splitfaces->pop_back();
+            }
+        }
+        Q_assert(saved || !splitfaces || !(frontfrag && backfrag));
         if (frontfrag) {
             frontfrag->next = frontlist;
             frontlist = frontfrag;
@@ -791,7 +1183,7 @@ original faces that have some fragment inside this leaf
 ==================
 */
 static void
-LinkConvexFaces(surface_t *planelist, node_t *leafnode)
+LinkConvexFaces(surface_t *planelist, node_t *leafnode, partition_t *part)
 {
     face_t *f, *next;
     surface_t *surf, *pnext;
@@ -831,28 +1223,28 @@ LinkConvexFaces(surface_t *planelist, node_t *leafnode)
     
     switch (leafnode->contents) {
     case CONTENTS_EMPTY:
-        c_empty++;
+        part->c_empty++;
         break;
     case CONTENTS_SOLID:
-        c_solid++;
+        part->c_solid++;
         break;
     case CONTENTS_WATER:
     case CONTENTS_SLIME:
     case CONTENTS_LAVA:
     case CONTENTS_SKY:
-        c_water++;
+        part->c_water++;
         break;
     case CONTENTS_DETAIL:
-        c_detail++;
+        part->c_detail++;
         break;
     case CONTENTS_DETAIL_ILLUSIONARY:
-        c_detail_illusionary++;
+        part->c_detail_illusionary++;
         break;
     case CONTENTS_DETAIL_FENCE:
-        c_detail_fence++;
+        part->c_detail_fence++;
         break;
     case CONTENTS_ILLUSIONARY_VISBLOCKER:
-        c_illusionary_visblocker++;
+        part->c_illusionary_visblocker++;
         break;
     default:
         Error("Bad contents in face (%s)", __func__);
@@ -860,7 +1252,7 @@ LinkConvexFaces(surface_t *planelist, node_t *leafnode)
 
     // write the list of the original faces to the leaf's markfaces
     // free surf and the surf->faces list.
-    leaffaces += count;
+    part->leaffaces += count;
     leafnode->markfaces = (face_t **)AllocMem(OTHER, sizeof(face_t *) * (count + 1), true);
 
     i = 0;
@@ -890,7 +1282,7 @@ is returned here (why?)
 ==================
 */
 static face_t *
-LinkNodeFaces(surface_t *surface)
+LinkNodeFaces(surface_t *surface, partition_t *part)
 {
     face_t *f, *newf, **prevptr;
     face_t *list = NULL;
@@ -906,7 +1298,7 @@ LinkNodeFaces(surface_t *surface)
 
     // copy
     for (f = surface->faces; f; f = f->next) {
-        nodefaces++;
+        part->nodefaces++;
         newf = (face_t *)AllocMem(FACE, 1, true);
         *newf = *f;
         f->original = newf;
@@ -920,31 +1312,47 @@ LinkNodeFaces(surface_t *surface)
 
 /*
 ==================
-PartitionSurfaces
+DivideNode
+
+Chooses a split for node and divides the surfaces into front and back
+lists. Returns false if node became a leaf instead.
 ==================
 */
-static void
-PartitionSurfaces(surface_t *surfaces, node_t *node)
+static bool
+DivideNode(surface_t *surfaces, splitcache_t *cache, node_t *node,
+           partition_t *part, surface_t **frontlist, surface_t **backlist,
+           splitcache_t childcache[2])
 {
     surface_t *split, *surf, *next;
-    surface_t *frontlist, *backlist;
     surface_t *frontfrag, *backfrag;
     qbsp_plane_t *splitplane;
+    const face_t *face;
+    std::vector<splitface_t> splitfaces;
 
-    split = SelectPartition(surfaces);
+    split = SelectPartition(surfaces, part, cache);
     if (!split) {               // this is a leaf node
         node->planenum = PLANENUM_LEAF;
         
         // frees `surfaces` and the faces on it.
         // saves pointers to face->original in the leaf's markfaces list.
-        LinkConvexFaces(surfaces, node);
-        return;
+        LinkConvexFaces(surfaces, node, part);
+        return false;
     }
 
-    splitnodes++;
-    Message(msgPercent, splitnodes, csgmergefaces);
+    part->splitnodes++;
+    if (part->percent)
+        Message(msgPercent, part->splitnodes, csgmergefaces);
+
+    // the split surface goes on the node, so its faces stop counting
+    if (cache->valid) {
+        for (face = split->faces; face; face = face->next)
+            SplitCache_AddFace(cache, face, -1);
+        planegroup_t *group;
+        auto it = SplitCache_Find(cache, split->planenum, &group);
+        group->planes.erase(it);
+    }
 
-    node->faces = LinkNodeFaces(split);
+    node->faces = LinkNodeFaces(split, part);
     node->children[0] = (node_t *)AllocMem(NODE, 1, true);
     node->children[1] = (node_t *)AllocMem(NODE, 1, true);
     node->planenum = split->planenum;
@@ -955,12 +1363,13 @@ PartitionSurfaces(surface_t *surfaces, node_t *node)
     DivideNodeBounds(node, splitplane);
 
     // multiple surfaces, so split all the polysurfaces into front and back lists
-    frontlist = NULL;
-    backlist = NULL;
+    *frontlist = NULL;
+    *backlist = NULL;
 
     for (surf = surfaces; surf; surf = next) {
         next = surf->next;
-        DividePlane(surf, splitplane, &frontfrag, &backfrag);
+        DividePlane(surf, splitplane, &frontfrag, &backfrag,
+                    (cache->valid && !surf->onnode) ? &splitfaces : nullptr);
         if (frontfrag && backfrag) {
             // the plane was split, which may expose oportunities to merge
             // adjacent faces into a single face
@@ -971,19 +1380,107 @@ PartitionSurfaces(surface_t *surfaces, node_t *node)
         if (frontfrag) {
             if (!frontfrag->faces)
                 Error("Surface with no faces (%s)", __func__);
-            frontfrag->next = frontlist;
-            frontlist = frontfrag;
+            frontfrag->next = *frontlist;
+            *frontlist = frontfrag;
         }
         if (backfrag) {
             if (!backfrag->faces)
                 Error("Surface with no faces (%s)", __func__);
-            backfrag->next = backlist;
-            backlist = backfrag;
+            backfrag->next = *backlist;
+            *backlist = backfrag;
         }
     }
 
-    PartitionSurfaces(frontlist, node->children[0]);
-    PartitionSurfaces(backlist, node->children[1]);
+    if (cache->valid)
+        SplitCache_Divide(cache, *frontlist, *backlist, splitfaces,
+                          &childcache[0], &childcache[1]);
+
+    return true;
+}
+
+/*
+==================
+PartitionSurfaces
+==================
+*/
+static void
+PartitionSurfaces(surface_t *surfaces, splitcache_t *cache, node_t *node,
+                  partition_t *part)
+{
+    surface_t *frontlist, *backlist;
+    splitcache_t childcache[2];
+
+    if (!DivideNode(surfaces, cache, node, part, &frontlist, &backlist, childcache))
+        return;
+
+    PartitionSurfaces(frontlist, &childcache[0], node->children[0], part);
+    PartitionSurfaces(backlist, &childcache[1], node->children[1], part);
+}
+
+/* adds the leaf and face counts of a task's partition into part */
+static void
+Partition_Add(partition_t *part, const partition_t &sub)
+{
+    part->splitnodes += sub.splitnodes;
+    part->leaffaces += sub.leaffaces;
+    part->nodefaces += sub.nodefaces;
+    part->c_solid += sub.c_solid;
+    part->c_empty += sub.c_empty;
+    part->c_water += sub.c_water;
+    part->c_detail += sub.c_detail;
+    part->c_detail_illusionary += sub.c_detail_illusionary;
+    part->c_detail_fence += sub.c_detail_fence;
+    part->c_illusionary_visblocker += sub.c_illusionary_visblocker;
+}
+
+/*
+==================
+PartitionSurfaces_Parallel
+
+Once split, the front and back of a node don't share any surfaces, faces
+or nodes, so nodes with at least options.bspTaskSurfaces surfaces build
+their two sides as parallel tasks. Smaller nodes recurse serially. The
+tree is the same as the one PartitionSurfaces builds.
+==================
+*/
+static void
+PartitionSurfaces_Parallel(surface_t *surfaces, splitcache_t *cache, node_t *node,
+                           partition_t *part)
+{
+    surface_t *sides[2];
+    splitcache_t childcache[2];
+    int numsurfaces = 0;
+
+    for (const surface_t *surf = surfaces; surf; surf = surf->next)
+        numsurfaces++;
+
+    if (numsurfaces < options.bspTaskSurfaces) {
+        PartitionSurfaces(surfaces, cache, node, part);
+        return;
+    }
+
+    if (!DivideNode(surfaces, cache, node, part, &sides[0], &sides[1], childcache))
+        return;
+
+    partition_t parts[2];
+    for (partition_t &sub : parts) {
+        memset(&sub, 0, sizeof(sub));
+        sub.midsplit = part->midsplit;
+    }
+
+    /* the tasks may run on other threads; give them this thread's arena and messages */
+    memarena_t *arena = CurrentArena();
+    msgcapture_t *capture = Message_CurrentCapture();
+    ParallelFor(0, 2, [&](int i) {
+        memarena_t *previous = UseArena(arena);
+        msgcapture_t *previouscapture = Message_Capture(capture);
+        PartitionSurfaces_Parallel(sides[i], &childcache[i], node->children[i], &parts[i]);
+        Message_Capture(previouscapture);
+        UseArena(previous);
+    }, 1);
+
+    Partition_Add(part, parts[0]);
+    Partition_Add(part, parts[1]);
 }
 
 
@@ -1025,7 +1522,6 @@ SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit)
     Message(msgProgress, "SolidBSP");
 
     headnode = (node_t *)AllocMem(NODE, 1, true);
-    usemidsplit = midsplit;
 
     // calculate a bounding box for the entire model
     for (i = 0; i < 3; i++) {
@@ -1034,29 +1530,29 @@ SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit)
     }
 
     // recursively partition everything
-    splitnodes = 0;
-    leaffaces = 0;
-    nodefaces = 0;
-    c_solid = 0;
-    c_empty = 0;
-    c_water = 0;
-    c_detail = 0;
-    c_detail_illusionary = 0;
-    c_detail_fence = 0;
-    c_illusionary_visblocker = 0;
-
-    PartitionSurfaces(surfhead, headnode);
-
-    Message(msgStat, "%8d split nodes", splitnodes);
-    Message(msgStat, "%8d solid leafs", c_solid);
-    Message(msgStat, "%8d empty leafs", c_empty);
-    Message(msgStat, "%8d water leafs", c_water);
-    Message(msgStat, "%8d detail leafs", c_detail);
-    Message(msgStat, "%8d detail illusionary leafs", c_detail_illusionary);
-    Message(msgStat, "%8d detail fence leafs", c_detail_fence);
-    Message(msgStat, "%8d illusionary visblocker leafs", c_illusionary_visblocker);
-    Message(msgStat, "%8d leaffaces", leaffaces);
-    Message(msgStat, "%8d nodefaces", nodefaces);
+    partition_t part;
+    memset(&part, 0, sizeof(part));
+    part.midsplit = midsplit;
+    part.percent = true;
+
+    splitcache_t cache;
+    if (numthreads > 1 && options.bspTaskSurfaces > 0)
+        PartitionSurfaces_Parallel(surfhead, &cache, headnode, &part);
+    else
+        PartitionSurfaces(surfhead, &cache, headnode, &part);
+
+    splitnodes = part.splitnodes;
+
+    Message(msgStat, "%8d split nodes", part.splitnodes);
+    Message(msgStat, "%8d solid leafs", part.c_solid);
+    Message(msgStat, "%8d empty leafs", part.c_empty);
+    Message(msgStat, "%8d water leafs", part.c_water);
+    Message(msgStat, "%8d detail leafs", part.c_detail);
+    Message(msgStat, "%8d detail illusionary leafs", part.c_detail_illusionary);
+    Message(msgStat, "%8d detail fence leafs", part.c_detail_fence);
+    Message(msgStat, "%8d illusionary visblocker leafs", part.c_illusionary_visblocker);
+    Message(msgStat, "%8d leaffaces", part.leaffaces);
+    Message(msgStat, "%8d nodefaces", part.nodefaces);
 
     return headnode;
 }
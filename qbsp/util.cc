@@ -23,16 +23,228 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
 #include <common/threads.hh>
 #include <common/log.hh>
 
 #include <qbsp/qbsp.hh>
 
-static int rgMemTotal[GLOBAL + 1];
-static int rgMemActive[GLOBAL + 1];
-static int rgMemPeak[GLOBAL + 1];
-static int rgMemActiveBytes[GLOBAL + 1];
-static int rgMemPeakBytes[GLOBAL + 1];
+/* atomic since the hulls and brush entities are built on several threads */
+static std::atomic<int> rgMemTotal[GLOBAL + 1];
+static std::atomic<int> rgMemActive[GLOBAL + 1];
+static std::atomic<int> rgMemPeak[GLOBAL + 1];
+static std::atomic<int> rgMemActiveBytes[GLOBAL + 1];
+static std::atomic<int> rgMemPeakBytes[GLOBAL + 1];
+
+static void
+RaisePeak(std::atomic<int> &peak, int value)
+{
+    int current = peak.load();
+    while (value > current && !peak.compare_exchange_weak(current, value))
+        ;
+}
+
+/*
+ * Every allocation is preceded by a header saying where it came from, so
+ * FreeMem works the same on arena and malloc memory.
+ */
+struct alignas(16) memheader_t {
+    memarena_t *arena;          /* owning arena, nullptr if malloc'ed */
+    int size;                   /* bytes asked for, without the header */
+    int slot;                   /* arena size class, 0 for a large allocation */
+};
+
+/*
+ * Arenas hand out memory from blocks of growing size and keep one free
+ * list per size class, so the short lived faces and windings of CSG and
+ * SolidBSP are recycled within the hull that made them, and everything is
+ * released at once when the hull has been exported. Each thread using an
+ * arena gets its own heap; memory freed by a thread that isn't using the
+ * owning arena just waits for the arena to be released.
+ */
+#define ARENA_MIN_BLOCK         (16 * 1024)     /* most brush entities need little */
+#define ARENA_MAX_BLOCK         (1024 * 1024)
+#define ARENA_GRANULE           16
+#define ARENA_MAX_SMALL         4096    /* larger allocations are malloc'ed */
+
+struct arenaheap_t {
+    memarena_t *arena;
+    std::thread::id thread;
+    std::vector<char *> blocks;
+    char *next;
+    char *end;
+    int blocksize;              /* of the next block */
+    memheader_t *freelist[ARENA_MAX_SMALL / ARENA_GRANULE + 1];
+};
+
+struct memarena_t {
+    std::mutex lock;            /* guards heaps and large */
+    std::vector<std::unique_ptr<arenaheap_t>> heaps;
+    std::unordered_set<memheader_t *> large;
+    std::atomic<int> allocs;            /* since the last ReportArena */
+    std::atomic<int> activeBytes;
+    std::atomic<int> peakBytes;         /* since the last ReportArena */
+    std::atomic<int> reservedBytes;
+    std::atomic<int> active[GLOBAL + 1];        /* per type, as rgMemActive */
+    std::atomic<int> typeBytes[GLOBAL + 1];     /* per type, as rgMemActiveBytes */
+};
+
+/* heap of the arena this thread allocates from, see UseArena */
+static thread_local arenaheap_t *currentheap = nullptr;
+
+/*
+==========
+AllocArena
+==========
+*/
+memarena_t *
+AllocArena(void)
+{
+    memarena_t *arena = new memarena_t;
+
+    arena->allocs = 0;
+    arena->activeBytes = 0;
+    arena->peakBytes = 0;
+    arena->reservedBytes = 0;
+    for (int i = 0; i <= GLOBAL; i++) {
+        arena->active[i] = 0;
+        arena->typeBytes[i] = 0;
+    }
+
+    return arena;
+}
+
+/*
+==========
+ReportArena
+
+Prints the allocations and peak memory of the phase that just ended, and
+starts counting the next one
+==========
+*/
+void
+ReportArena(memarena_t *arena, const char *phase)
+{
+    Message(msgStat, "%8d %s allocations, %dk peak, %dk reserved",
+            arena->allocs.load(), phase, arena->peakBytes.load() / 1024,
+            arena->reservedBytes.load() / 1024);
+
+    arena->allocs = 0;
+    arena->peakBytes = arena->activeBytes.load();
+}
+
+/*
+==========
+FreeArena
+
+Releases everything allocated from the arena, whether it was freed or not.
+No thread may still be using it.
+==========
+*/
+void
+FreeArena(memarena_t *arena)
+{
+    for (int i = 0; i <= OTHER; i++) {
+        rgMemActive[i] -= arena->active[i];
+        rgMemActiveBytes[i] -= arena->typeBytes[i];
+    }
+    rgMemActive[GLOBAL] -= arena->activeBytes;
+
+    for (const std::unique_ptr<arenaheap_t> &heap : arena->heaps)
+        for (char *block : heap->blocks)
+            free(block);
+    for (memheader_t *header : arena->large)
+        free(header);
+
+    delete arena;
+}
+
+/*
+==========
+UseArena
+
+Makes this thread allocate from arena, or from malloc if arena is nullptr.
+Returns the arena used until now.
+==========
+*/
+memarena_t *
+UseArena(memarena_t *arena)
+{
+    memarena_t *previous = currentheap ? currentheap->arena : nullptr;
+
+    if (arena == previous)
+        return previous;
+
+    currentheap = nullptr;
+    if (!arena)
+        return previous;
+
+    const std::thread::id self = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(arena->lock);
+    for (const std::unique_ptr<arenaheap_t> &heap : arena->heaps) {
+        if (heap->thread == self) {
+            currentheap = heap.get();
+            return previous;
+        }
+    }
+
+    arenaheap_t *heap = new arenaheap_t;
+    heap->arena = arena;
+    heap->thread = self;
+    heap->next = heap->end = nullptr;
+    heap->blocksize = ARENA_MIN_BLOCK;
+    memset(heap->freelist, 0, sizeof(heap->freelist));
+    arena->heaps.push_back(std::unique_ptr<arenaheap_t>(heap));
+    currentheap = heap;
+
+    return previous;
+}
+
+/*
+==========
+CurrentArena
+==========
+*/
+memarena_t *
+CurrentArena(void)
+{
+    return currentheap ? currentheap->arena : nullptr;
+}
+
+static memheader_t *
+ArenaAlloc(arenaheap_t *heap, int slot)
+{
+    memheader_t *header = heap->freelist[slot];
+
+    if (header) {
+        heap->freelist[slot] = *(memheader_t **)header;
+        return header;
+    }
+
+    const int bytes = slot * ARENA_GRANULE;
+    if (heap->end - heap->next < bytes) {
+        heap->next = (char *)malloc(heap->blocksize);
+        if (!heap->next)
+            Error("allocation of %d bytes failed (%s)", heap->blocksize, __func__);
+        heap->end = heap->next + heap->blocksize;
+        heap->blocks.push_back(heap->next);
+        heap->arena->reservedBytes += heap->blocksize;
+        heap->blocksize = qmin(heap->blocksize * 2, ARENA_MAX_BLOCK);
+    }
+
+    header = (memheader_t *)heap->next;
+    heap->next += bytes;
+
+    return header;
+}
 
 /*
 ==========
@@ -42,8 +254,10 @@ AllocMem
 void *
 AllocMem(int Type, int cElements, bool fZero)
 {
+    memheader_t *header;
+    memarena_t *arena;
     void *pTemp;
-    int cSize;
+    int cSize, cTotal;
 
     if (Type < 0 || Type > OTHER)
         Error("Internal error: invalid memory type %d (%s)", Type, __func__);
@@ -53,16 +267,32 @@ AllocMem(int Type, int cElements, bool fZero)
         if (cElements > MAX_POINTS_ON_WINDING)
             Error("Too many points (%d) on winding (%s)", cElements, __func__);
 
-        cSize = offsetof(winding_t, points[cElements]) + sizeof(int);
+        cSize = offsetof(winding_t, points[cElements]);
 
         // Set cElements to 1 so bookkeeping works OK
         cElements = 1;
     } else
         cSize = cElements * MemSize[Type];
 
-    pTemp = malloc(cSize);
-    if (!pTemp)
-        Error("allocation of %d bytes failed (%s)", cSize, __func__);
+    cTotal = cSize + sizeof(memheader_t);
+    arena = currentheap ? currentheap->arena : nullptr;
+    if (arena && cTotal <= ARENA_MAX_SMALL) {
+        const int slot = (cTotal + ARENA_GRANULE - 1) / ARENA_GRANULE;
+        header = ArenaAlloc(currentheap, slot);
+        header->slot = slot;
+    } else {
+        header = (memheader_t *)malloc(cTotal);
+        if (!header)
+            Error("allocation of %d bytes failed (%s)", cSize, __func__);
+        header->slot = 0;
+        if (arena) {
+            std::lock_guard<std::mutex> lock(arena->lock);
+            arena->large.insert(header);
+        }
+    }
+    header->arena = arena;
+    header->size = cSize;
+    pTemp = header + 1;
 
     if (fZero)
         memset(pTemp, 0, cSize);
@@ -70,25 +300,21 @@ AllocMem(int Type, int cElements, bool fZero)
     // Special stuff for face_t
     if (Type == FACE && cElements == 1)
         ((face_t *)pTemp)->planenum = -1;
-    if (Type == WINDING) {
-        // FIXME: Remove this! Causing UBSan warnings
-        *(int *)pTemp = cSize;
-        pTemp = (char *)pTemp + sizeof(int);
-    }
 
     rgMemTotal[Type] += cElements;
-    rgMemActive[Type] += cElements;
-    rgMemActiveBytes[Type] += cSize;
-    if (rgMemActive[Type] > rgMemPeak[Type])
-        rgMemPeak[Type] = rgMemActive[Type];
-    if (rgMemActiveBytes[Type] > rgMemPeakBytes[Type])
-        rgMemPeakBytes[Type] = rgMemActiveBytes[Type];
+    RaisePeak(rgMemPeak[Type], rgMemActive[Type] += cElements);
+    RaisePeak(rgMemPeakBytes[Type], rgMemActiveBytes[Type] += cSize);
 
     // Also keep global statistics
     rgMemTotal[GLOBAL] += cSize;
-    rgMemActive[GLOBAL] += cSize;
-    if (rgMemActive[GLOBAL] > rgMemPeak[GLOBAL])
-        rgMemPeak[GLOBAL] = rgMemActive[GLOBAL];
+    RaisePeak(rgMemPeak[GLOBAL], rgMemActive[GLOBAL] += cSize);
+
+    if (arena) {
+        arena->allocs++;
+        arena->active[Type] += cElements;
+        arena->typeBytes[Type] += cSize;
+        RaisePeak(arena->peakBytes, arena->activeBytes += cSize);
+    }
 
     return pTemp;
 }
@@ -102,17 +328,36 @@ FreeMem
 void
 FreeMem(void *pMem, int Type, int cElements)
 {
+    memheader_t *header;
+    memarena_t *arena;
+
+    if (!pMem)
+        return;
+
+    header = (memheader_t *)pMem - 1;
+    arena = header->arena;
+
     rgMemActive[Type] -= cElements;
-    if (Type == WINDING) {
-        pMem = (char *)pMem - sizeof(int);
-        rgMemActiveBytes[Type] -= *(int *)pMem;
-        rgMemActive[GLOBAL] -= *(int *)pMem;
-    } else {
-        rgMemActiveBytes[Type] -= cElements * MemSize[Type];
-        rgMemActive[GLOBAL] -= cElements * MemSize[Type];
+    rgMemActiveBytes[Type] -= header->size;
+    rgMemActive[GLOBAL] -= header->size;
+
+    if (!arena) {
+        free(header);
+        return;
     }
 
-    free(pMem);
+    arena->active[Type] -= cElements;
+    arena->typeBytes[Type] -= header->size;
+    arena->activeBytes -= header->size;
+
+    if (!header->slot) {
+        std::lock_guard<std::mutex> lock(arena->lock);
+        arena->large.erase(header);
+        free(header);
+    } else if (currentheap && currentheap->arena == arena) {
+        *(memheader_t **)header = currentheap->freelist[header->slot];
+        currentheap->freelist[header->slot] = header;
+    }
 }
 
 
@@ -157,13 +402,13 @@ PrintMem(void)
                 "\nData type        CurrentNum    PeakNum      PeakMem\n");
         for (i = 0; i <= OTHER; i++)
             Message(msgLiteral, "%-16s  %9d  %9d %12d %8s\n",
-                    MemTypes[i], rgMemActive[i], rgMemPeak[i],
-                    rgMemPeakBytes[i], MemString(rgMemPeakBytes[i]));
+                    MemTypes[i], rgMemActive[i].load(), rgMemPeak[i].load(),
+                    rgMemPeakBytes[i].load(), MemString(rgMemPeakBytes[i]));
         Message(msgLiteral, "%-16s                       %12d %8s\n",
-                MemTypes[GLOBAL], rgMemPeak[GLOBAL],
+                MemTypes[GLOBAL], rgMemPeak[GLOBAL].load(),
                 MemString(rgMemPeak[GLOBAL]));
     } else
-        Message(msgLiteral, "Peak memory usage: %d (%s)\n", rgMemPeak[GLOBAL],
+        Message(msgLiteral, "Peak memory usage: %d (%s)\n", rgMemPeak[GLOBAL].load(),
                 MemString(rgMemPeak[GLOBAL]));
 }
 
@@ -206,6 +451,61 @@ FreeAllMem(void)
 /* Keep track of output state */
 static bool fInPercent = false;
 
+/* Set while a worker thread builds a hull; see Message_Capture */
+static thread_local msgcapture_t *msgcapture = nullptr;
+static std::mutex msgcapture_lock;
+
+static void
+Message_Output(int msgType, const char *szBuffer)
+{
+    switch (msgType) {
+    case msgScreen:
+        fprintf(stdout, "%s", szBuffer);
+        fflush(stdout);
+        break;
+    case msgFile:
+        logprint_silent("%s", szBuffer);
+        break;
+    default:
+        logprint("%s", szBuffer);
+    }
+}
+
+/*
+=================
+Message_Capture
+
+Redirects this thread's messages into capture (nullptr to stop), so work
+done in parallel can be printed later in the order the serial path uses.
+Percent messages are dropped while capturing. Several threads may share a
+capture. Returns the capture used until now.
+=================
+*/
+msgcapture_t *
+Message_Capture(msgcapture_t *capture)
+{
+    msgcapture_t *previous = msgcapture;
+    msgcapture = capture;
+    return previous;
+}
+
+msgcapture_t *
+Message_CurrentCapture(void)
+{
+    return msgcapture;
+}
+
+void
+Message_Replay(const msgcapture_t *capture)
+{
+    if (fInPercent && !capture->lines.empty()) {
+        printf("\r");
+        fInPercent = false;
+    }
+    for (const auto &line : capture->lines)
+        Message_Output(line.first, line.second.c_str());
+}
+
 /*
 =================
 Message
@@ -225,14 +525,15 @@ Message(int msgType, ...)
     va_start(argptr, msgType);
 
     // Exit if necessary
+    const bool verbose = msgcapture ? msgcapture->verbose : options.fVerbose;
     if ((msgType == msgStat || msgType == msgProgress)
-        && (!options.fVerbose || options.fNoverbose))
+        && (!verbose || options.fNoverbose))
         return;
     else if (msgType == msgPercent
-             && (options.fNopercent || options.fNoverbose))
+             && (options.fNopercent || options.fNoverbose || msgcapture))
         return;
 
-    if (fInPercent && msgType != msgPercent) {
+    if (fInPercent && msgType != msgPercent && !msgcapture) {
         printf("\r");
         fInPercent = false;
     }
@@ -300,17 +601,11 @@ Message(int msgType, ...)
         return;
     }
 
-    switch (msgType) {
-    case msgScreen:
-        fprintf(stdout, "%s", szBuffer);
-        fflush(stdout);
-        break;
-    case msgFile:
-        logprint_silent("%s", szBuffer);
-        break;
-    default:
-        logprint("%s", szBuffer);
-    }
+    if (msgcapture) {
+        std::lock_guard<std::mutex> lock(msgcapture_lock);
+        msgcapture->lines.emplace_back(msgType, szBuffer);
+    } else
+        Message_Output(msgType, szBuffer);
 
     va_end(argptr);
 }
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# usage: visbenchmark.sh <qbsp> <vis> [-update]
+#
+# Builds each map below with qbsp and runs vis -threads 1 on it, collecting
+# the per-map -benchmark reports into visbenchmark.json in the current
+# directory. Fails if any map's PVS hash differs from visbenchmark.golden;
+# with -update, rewrites visbenchmark.golden instead, but only once every
+# map has built.
+#
+# Qbsp and vis are run single threaded, so the results (and the timings)
+# don't depend on thread scheduling.
+
+MAPS="testshadows.map
+lightstest1.map
+quake_map_source/E1M7.map
+quake_map_source/E1M8.map
+quake_map_source/DM3.map
+quake_map_source/END.map
+quake_map_source/DM7.map
+quake_map_source/E2M1.map
+quake_map_source/E1M1.map"
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 <qbsp> <vis> [-update]"
+  exit 1
+fi
+
+QBSP="$1"
+VIS="$2"
+UPDATE="$3"
+TESTMAPS="$(cd "$(dirname "$0")" && pwd)"
+GOLDEN="$TESTMAPS/visbenchmark.golden"
+WORKDIR="$(pwd)/visbenchmark"
+NEWGOLDEN="$WORKDIR/visbenchmark.golden"
+
+rm -rf "$WORKDIR"
+mkdir -p "$WORKDIR" || exit 1
+
+failed=0
+first=1
+echo "[" > visbenchmark.json
+[ "$UPDATE" = "-update" ] && : > "$NEWGOLDEN"
+
+for map in $MAPS; do
+  name="$(basename "$map" .map)"
+
+  cp "$TESTMAPS/$map" "$WORKDIR/" || exit 1
+  (cd "$WORKDIR" && "$QBSP" -threads 1 "$name.map" > /dev/null) || { echo "$name: qbsp failed"; exit 1; }
+  (cd "$WORKDIR" && "$VIS" -threads 1 -benchmark "$name.json" "$name" > /dev/null) || { echo "$name: vis failed"; exit 1; }
+
+  [ $first = 1 ] || echo "," >> visbenchmark.json
+  first=0
+  cat "$WORKDIR/$name.json" >> visbenchmark.json
+
+  hash="$(sed -n 's/.*"pvs_hash": "\([0-9a-f]*\)".*/\1/p' "$WORKDIR/$name.json")"
+  total="$(sed -n 's/.*"total": \([0-9.]*\).*/\1/p' "$WORKDIR/$name.json")"
+  chains="$(sed -n 's/.*"chains_per_second": \([0-9]*\).*/\1/p' "$WORKDIR/$name.json")"
+
+  if [ "$UPDATE" = "-update" ]; then
+    echo "$name $hash" >> "$NEWGOLDEN"
+    status="updated"
+  else
+    expected="$(sed -n "s/^$name \([0-9a-f]*\)$/\1/p" "$GOLDEN")"
+    if [ "$hash" = "$expected" ]; then
+      status="ok"
+    else
+      status="PVS CHANGED (expected ${expected:-nothing}, got $hash)"
+      failed=1
+    fi
+  fi
+  printf "%-10s %8ss %10s chains/s  %s\n" "$name" "$total" "$chains" "$status"
+done
+
+echo "]" >> visbenchmark.json
+
+if [ "$UPDATE" = "-update" ]; then
+  mv "$NEWGOLDEN" "$GOLDEN" || exit 1
+fi
+
+exit $failed
@@ -0,0 +1,243 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Coarse pre-pass (-coarse). Neighbouring leafs are grouped into regions
+ * and the full portal flow is run on the much smaller region graph, using
+ * the portals between regions unchanged. Any line of sight from a portal
+ * only leaves its region through one of those, so the regions the flow
+ * reaches bound what each leaf portal can see, and the mightsee of every
+ * portal is cut down to their leafs before the real flow starts.
+ */
+
+#include <common/threads.hh>
+#include <vis/vis.hh>
+#include <vis/leafbits.hh>
+
+#include <vector>
+
+#define REGION_LEAFS 16
+
+qboolean coarsepass = false;
+
+/*
+  ==============
+  GroupRegions
+
+  Grows regions breadth first from the lowest numbered free leaf, up to
+  REGION_LEAFS leafs and as many portals out of the region as a leaf_t
+  can hold. Returns the number of regions.
+  ==============
+*/
+static int
+GroupRegions(std::vector<int> &regionof)
+{
+    int numregions = 0;
+    std::vector<int> members;
+
+    regionof.assign(portalleafs, -1);
+    for (int seed = 0; seed < portalleafs; seed++) {
+        if (regionof[seed] != -1)
+            continue;
+
+        const int region = numregions++;
+        int external = leafs[seed].numportals;
+
+        regionof[seed] = region;
+        members.assign(1, seed);
+        for (size_t head = 0; head < members.size(); head++) {
+            const leaf_t *leaf = &leafs[members[head]];
+            for (int i = 0; i < leaf->numportals; i++) {
+                if (members.size() == REGION_LEAFS)
+                    break;
+                const int next = leaf->portals[i]->leaf;
+                if (regionof[next] != -1)
+                    continue;
+
+                /* portals back into the region become internal, both ways */
+                int change = 0;
+                for (int j = 0; j < leafs[next].numportals; j++) {
+                    if (regionof[leafs[next].portals[j]->leaf] == region)
+                        change--;
+                    else
+                        change++;
+                }
+                if (external + change > MAX_PORTALS_ON_LEAF)
+                    continue;
+
+                regionof[next] = region;
+                external += change;
+                members.push_back(next);
+            }
+        }
+    }
+
+    return numregions;
+}
+
+/*
+  ==============
+  RegionsSeen
+
+  The regions a line of sight through leaf portal p can reach. A portal
+  between regions is a region portal itself; one inside a region can see
+  the whole region and whatever its region portals can, of those it might
+  see through.
+  ==============
+*/
+static void
+RegionsSeen(const portal_t *p, const std::vector<int> &regionof,
+            const std::vector<int> &coarseof, const std::vector<portal_t> &coarseportals,
+            const std::vector<leaf_t> &regions, leafbits_t *seen)
+{
+    const int numblocks = (static_cast<int>(regions.size()) + LEAFMASK) >> LEAFSHIFT;
+    const int portalnum = p - portals;
+
+    if (coarseof[portalnum] != -1) {
+        memcpy(seen->bits, coarseportals[coarseof[portalnum]].visbits->bits,
+               numblocks * sizeof(leafblock_t));
+        return;
+    }
+
+    const leaf_t *region = &regions[regionof[p->leaf]];
+    memset(seen->bits, 0, numblocks * sizeof(leafblock_t));
+    SetLeafBit(seen, regionof[p->leaf]);
+    for (int i = 0; i < region->numportals; i++) {
+        const portal_t *exit = region->portals[i];
+        if (PortalMightSee(p, exit))
+            Leafbits_Or(seen->bits, exit->visbits->bits, numblocks);
+    }
+}
+
+/*
+  ==============
+  CoarsePortalVis
+
+  Called after BasePortalVis. Swaps the region graph in for the leaf graph,
+  floods and flows it like the real thing, then swaps back and trims each
+  pending portal's mightsee to the leafs of the regions it can see.
+  ==============
+*/
+void
+CoarsePortalVis(void)
+{
+    std::vector<int> regionof;
+    std::vector<int> coarseof(numportals * 2, -1);
+    std::vector<portal_t> coarseportals;
+    double start, end;
+    int i;
+
+    start = I_FloatTime();
+
+    const int numregions = GroupRegions(regionof);
+
+    /* the pairs of portals between regions, kept in pairs */
+    for (i = 0; i < numportals * 2; i += 2) {
+        if (regionof[portals[i].leaf] == regionof[portals[i + 1].leaf])
+            continue;
+        for (int j = i; j < i + 2; j++) {
+            portal_t c = portals[j];
+            c.leaf = regionof[portals[j].leaf];
+            c.status = pstat_none;
+            c.visbits = NULL;
+            c.mightsee = NULL;
+            c.nummightsee = 0;
+            c.numcansee = 0;
+            coarseof[j] = static_cast<int>(coarseportals.size());
+            coarseportals.push_back(c);
+        }
+    }
+
+    std::vector<leaf_t> regions(numregions);
+    for (i = 0; i < static_cast<int>(coarseportals.size()); i++) {
+        /* a portal leaves the region its partner leads into */
+        leaf_t *region = &regions[coarseportals[i ^ 1].leaf];
+        region->portals[region->numportals++] = &coarseportals[i];
+    }
+
+    logprint("Coarse vis: %d regions, %d portals\n",
+             numregions, static_cast<int>(coarseportals.size()));
+
+    /*
+     * Flow the region graph. There's no farplane here: it's measured from
+     * the leaf portal, and it's only applied by the real flow.
+     */
+    const int saved_numportals = numportals;
+    const int saved_portalleafs = portalleafs;
+    portal_t *const saved_portals = portals;
+    leaf_t *const saved_leafs = leafs;
+    const vec_t saved_farplane = farplane;
+    const unsigned long saved_chains = c_chains;
+
+    numportals = static_cast<int>(coarseportals.size()) / 2;
+    portalleafs = numregions;
+    portals = coarseportals.data();
+    leafs = regions.data();
+    farplane = 0;
+    coarsepass = true;
+
+    BasePortalVis();
+    FlowPortals(0);
+
+    coarsepass = false;
+    const unsigned long coarsechains = c_chains - saved_chains;
+    numportals = saved_numportals;
+    portalleafs = saved_portalleafs;
+    portals = saved_portals;
+    leafs = saved_leafs;
+    farplane = saved_farplane;
+    c_chains = saved_chains;
+
+    /* Trim mightsee to the leafs of the regions seen */
+    int64_t before = 0, after = 0;
+    std::mutex count_lock;
+
+    ParallelFor(0, numportals * 2, [&](int portalnum) {
+        portal_t *p = &portals[portalnum];
+        if (p->status != pstat_none)
+            return;
+
+        leafbits_t *seen = static_cast<leafbits_t *>(malloc(LeafbitsSize(numregions)));
+        RegionsSeen(p, regionof, coarseof, coarseportals, regions, seen);
+
+        const int oldcount = p->nummightsee;
+        for (int leafnum = 0; leafnum < portalleafs; leafnum++) {
+            if (TestLeafBit(p->mightsee, leafnum) && !TestLeafBit(seen, regionof[leafnum]))
+                ClearLeafBit(p->mightsee, leafnum);
+        }
+        p->nummightsee = Leafbits_Count(p->mightsee->bits, (portalleafs + LEAFMASK) >> LEAFSHIFT);
+        free(seen);
+
+        std::lock_guard<std::mutex> lock(count_lock);
+        before += oldcount;
+        after += p->nummightsee;
+    });
+
+    for (portal_t &c : coarseportals) {
+        if (c.visbits != c.mightsee)
+            free(c.visbits);
+        free(c.mightsee);
+    }
+
+    end = I_FloatTime();
+
+    logprint("Coarse vis: %lu chains, mightsee %lld -> %lld, %5.1f seconds elapsed\n",
+             coarsechains, static_cast<long long>(before), static_cast<long long>(after),
+             end - start);
+}
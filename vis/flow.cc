@@ -2,8 +2,13 @@
 #include <vis/vis.hh>
 #include <vis/leafbits.hh>
 
+#include <stdint.h>
+
+#include <vector>
+
 unsigned long c_chains;
 int c_vistest, c_mighttest;
+int c_leafstackmallocs, c_leafstackdepth;
 
 static int c_portalskip;
 static int c_leafskip;
@@ -130,10 +135,74 @@ ClipToSeperators(const winding_t *source,
     return target;
 }
 
+#define CACHE_LINE 64
+
+static thread_local leafstack_t leafstack;
+
+leafstack_t::~leafstack_t()
+{
+    for (void *mem : memory)
+        free(mem);
+}
+
+/*
+  ==================
+  LeafStackLevel
+
+  Returns the mightsee buffer for the given recursion depth, allocating
+  the levels up to it the first time this thread gets that deep
+  ==================
+*/
+static leafbits_t *
+LeafStackLevel(threaddata_t *thread, int depth)
+{
+    leafstack_t *stack = thread->leafstack;
+
+    /* sized for the other pass's leafs (or regions), start again */
+    if (stack->numleafs != portalleafs) {
+        for (void *mem : stack->memory)
+            free(mem);
+        stack->memory.clear();
+        stack->levels.clear();
+        stack->numleafs = portalleafs;
+    }
+
+    while (static_cast<int>(stack->levels.size()) < depth) {
+        void *mem = malloc(LeafbitsSize(portalleafs) + CACHE_LINE - 1);
+        if (!mem)
+            Error("%s: allocation failed", __func__);
+        uintptr_t aligned = reinterpret_cast<uintptr_t>(mem) + CACHE_LINE - 1;
+        aligned &= ~static_cast<uintptr_t>(CACHE_LINE - 1);
+        stack->memory.push_back(mem);
+        stack->levels.push_back(reinterpret_cast<leafbits_t *>(aligned));
+
+        ThreadLock();
+        c_leafstackmallocs++;
+        if (c_leafstackdepth < static_cast<int>(stack->levels.size()))
+            c_leafstackdepth = static_cast<int>(stack->levels.size());
+        ThreadUnlock();
+    }
+
+    return stack->levels[depth - 1];
+}
+
+/*
+ * The regions of the coarse pass aren't convex, so a line of sight can
+ * enter one more than once; there it's only crossing the same portal (in
+ * either direction) twice that can't happen.
+ */
 static int
-CheckStack(leaf_t *leaf, threaddata_t *thread)
+CheckStack(leaf_t *leaf, threaddata_t *thread, const pstack_t *prevstack)
 {
-    pstack_t *p;
+    const pstack_t *p;
+
+    if (coarsepass) {
+        const ptrdiff_t entered = (prevstack->portal - portals) >> 1;
+        for (p = &thread->pstack_head; p != prevstack; p = p->next)
+            if ((p->portal - portals) >> 1 == entered)
+                return 1;
+        return 0;
+    }
 
     for (p = thread->pstack_head.next; p; p = p->next)
         if (p->leaf == leaf)
@@ -141,6 +210,23 @@ CheckStack(leaf_t *leaf, threaddata_t *thread)
     return 0;
 }
 
+/*
+ * True if p is more than farplane units from the source portal. The gap
+ * between bounding spheres is a lower bound on the distance between the
+ * windings, so nothing within farplane is ever dropped.
+ */
+static inline bool
+BeyondFarplane(const portal_t *source, const portal_t *p)
+{
+    vec3_t delta;
+
+    if (!farplane)
+        return false;
+
+    VectorSubtract(p->winding->origin, source->winding->origin, delta);
+    return VectorLength(delta) - source->winding->radius - p->winding->radius > farplane;
+}
+
 /*
   ==================
   RecursiveLeafFlow
@@ -157,7 +243,7 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     plane_t backplane;
     leaf_t *leaf;
     int i, j, err, numblocks;
-    leafblock_t *test, *might, *vis, more;
+    leafblock_t *test, *might, *vis;
 
     ++c_chains;
 
@@ -166,10 +252,12 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     /*
      * Check we haven't recursed into a leaf already on the stack
      */
-    err = CheckStack(leaf, thread);
+    err = CheckStack(leaf, thread, prevstack);
     if (err) {
-        logprint("WARNING: %s: recursion on leaf %d\n", __func__, leafnum);
-        LogLeaf(leaf);
+        if (!coarsepass) {
+            logprint("WARNING: %s: recursion on leaf %d\n", __func__, leafnum);
+            LogLeaf(leaf);
+        }
         return;
     }
 
@@ -190,7 +278,8 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     for (i = 0; i < STACK_WINDINGS; i++)
         stack.freewindings[i] = 1;
 
-    stack.mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    stack.depth = prevstack->depth + 1;
+    stack.mightsee = LeafStackLevel(thread, stack.depth);
     might = stack.mightsee->bits;
     vis = thread->leafvis->bits;
 
@@ -202,6 +291,8 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
             c_leafskip++;
             continue;           // can't possibly see it
         }
+        if (BeyondFarplane(thread->base, p))
+            continue;           // too far away to matter
         // if the portal can't see anything we haven't allready seen, skip it
         if (p->status == pstat_done) {
             c_vistest++;
@@ -211,14 +302,8 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
             test = p->mightsee->bits;
         }
 
-        more = 0;
         numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
-        for (j = 0; j < numblocks; j++) {
-            might[j] = prevstack->mightsee->bits[j] & test[j];
-            more |= (might[j] & ~vis[j]);
-        }
-
-        if (!more) {
+        if (!Leafbits_AndNew(might, prevstack->mightsee->bits, test, vis, numblocks)) {
             // can't see anything new
             c_portalskip++;
             continue;
@@ -351,8 +436,6 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
         FreeStackWinding(stack.source, &stack);
         FreeStackWinding(stack.pass, &stack);
     }
-
-    free(stack.mightsee);
 }
 
 
@@ -375,6 +458,7 @@ PortalFlow(portal_t *p)
     memset(&data, 0, sizeof(data));
     data.leafvis = p->visbits;
     data.base = p;
+    data.leafstack = &leafstack;
 
     data.pstack_head.portal = p;
     data.pstack_head.source = p->winding;
@@ -392,8 +476,62 @@ PortalFlow(portal_t *p)
   ============================================================================
 */
 
+/*
+  ==============
+  PortalMightSee
+
+  True if srcportal could possibly see through portal p: p is at least
+  partly in front of srcportal and srcportal at least partly behind p.
+  ==============
+*/
+bool
+PortalMightSee(const portal_t *srcportal, const portal_t *p)
+{
+    const winding_t *w = srcportal->winding;
+    const winding_t *tw = p->winding;
+    float d;
+    int j;
+
+    if (p == srcportal)
+        return false;
+    if (BeyondFarplane(srcportal, p))
+        return false;
+
+    // Quick test - completely at the back?
+    d = DotProduct(tw->origin, srcportal->plane.normal) - srcportal->plane.dist;
+    if (d < -tw->radius)
+        return false;
+
+    for (j = 0; j < tw->numpoints; j++) {
+        d = DotProduct(tw->points[j], srcportal->plane.normal) - srcportal->plane.dist;
+        if (d > ON_EPSILON)
+            break;
+    }
+    if (j == tw->numpoints)
+        return false;       // no points on front
+
+    // Quick test - completely on front?
+    d = DotProduct(w->origin, p->plane.normal) - p->plane.dist;
+    if (d > w->radius)
+        return false;
+
+    for (j = 0; j < w->numpoints; j++) {
+        d = DotProduct(w->points[j], p->plane.normal) - p->plane.dist;
+        if (d < -ON_EPSILON)
+            break;
+    }
+    if (j == w->numpoints)
+        return false;       // no points on back
+
+    return true;
+}
+
+/*
+ * Each leaf is flooded at most once and each portal belongs to one leaf,
+ * so every portal is tested at most once, and only if the flood gets to it.
+ */
 static void
-SimpleFlood(portal_t *srcportal, int leafnum, byte *portalsee)
+SimpleFlood(portal_t *srcportal, int leafnum)
 {
     int i;
     leaf_t *leaf;
@@ -408,84 +546,34 @@ SimpleFlood(portal_t *srcportal, int leafnum, byte *portalsee)
     leaf = &leafs[leafnum];
     for (i = 0; i < leaf->numportals; i++) {
         p = leaf->portals[i];
-        if (!portalsee[p - portals])
+        if (!PortalMightSee(srcportal, p))
             continue;
-        SimpleFlood(srcportal, p->leaf, portalsee);
+        SimpleFlood(srcportal, p->leaf);
     }
 }
 
 /*
   ==============
-  BasePortalVis
+  BasePortalThread
+
+  Floods mightsee through the portals that pass PortalMightSee. Rather than
+  testing against every other portal up front, only the portals the flood
+  reaches are tested.
   ==============
 */
-static void *
-BasePortalThread(void *dummy)
+static void
+BasePortalThread(int portalnum)
 {
-    int i, j, portalnum;
-    portal_t *p, *tp;
-    winding_t *w, *tw;
-    float d;
-    byte *portalsee;
+    portal_t *p = portals + portalnum;
 
-    portalsee = static_cast<byte *>(malloc(sizeof(*portalsee) * numportals * 2));
-    if (!portalsee)
-        Error("%s: Out of Memory", __func__);
+    if (p->status == pstat_done)
+        return;                 // reused by ReuseVisState
 
-    while (1) {
-        portalnum = GetThreadWork();
-        if (portalnum == -1)
-            break;
-
-        p = portals + portalnum;
-        w = p->winding;
-
-        p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
-        memset(p->mightsee, 0, LeafbitsSize(portalleafs));
+    p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    memset(p->mightsee, 0, LeafbitsSize(portalleafs));
 
-        memset(portalsee, 0, numportals * 2);
-
-        for (i = 0, tp = portals; i < numportals * 2; i++, tp++) {
-            tw = tp->winding;
-            if (tp == p)
-                continue;
-
-            // Quick test - completely at the back?
-            d = DotProduct(tw->origin, p->plane.normal) - p->plane.dist;
-            if (d < -tw->radius)
-                continue;
-
-            for (j = 0; j < tw->numpoints; j++) {
-                d = DotProduct(tw->points[j], p->plane.normal) - p->plane.dist;
-                if (d > ON_EPSILON)
-                    break;
-            }
-            if (j == tw->numpoints)
-                continue;       // no points on front
-
-            // Quick test - completely on front?
-            d = DotProduct(w->origin, tp->plane.normal) - tp->plane.dist;
-            if (d > w->radius)
-                continue;
-
-            for (j = 0; j < w->numpoints; j++) {
-                d = DotProduct(w->points[j], tp->plane.normal) - tp->plane.dist;
-                if (d < -ON_EPSILON)
-                    break;
-            }
-            if (j == w->numpoints)
-                continue;       // no points on back
-
-            portalsee[i] = 1;
-        }
-
-        p->nummightsee = 0;
-        SimpleFlood(p, p->leaf, portalsee);
-    }
-
-    free(portalsee);
-
-    return NULL;
+    p->nummightsee = 0;
+    SimpleFlood(p, p->leaf);
 }
 
 
@@ -497,5 +585,11 @@ BasePortalThread(void *dummy)
 void
 BasePortalVis(void)
 {
-    RunThreadsOn(0, numportals * 2, BasePortalThread, NULL);
+    double start, end;
+
+    start = I_FloatTime();
+    ParallelFor(0, numportals * 2, BasePortalThread);
+    end = I_FloatTime();
+
+    logprint("Base vis: %5.1f seconds elapsed\n", end - start);
 }
@@ -0,0 +1,329 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Whole-bitstring operations for vis. Each has a scalar version and, on
+ * x86 with GCC or Clang, SSE2 and AVX2 versions; the widest one the CPU
+ * supports is picked at startup.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vis/leafbits.hh>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEAFBITS_X86
+#include <immintrin.h>
+#endif
+
+static int
+PopCount(leafblock_t block)
+{
+#ifdef __GNUC__
+    return __builtin_popcountl(block);
+#else
+    int count = 0;
+    for (; block; block &= block - 1)
+        count++;
+    return count;
+#endif
+}
+
+/* ------------------------------------------------------------------------ */
+
+static bool
+AndNew_Scalar(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+              const leafblock_t *seen, int numblocks)
+{
+    leafblock_t more = 0;
+
+    for (int i = 0; i < numblocks; i++) {
+        dst[i] = a[i] & b[i];
+        more |= dst[i] & ~seen[i];
+    }
+    return more != 0;
+}
+
+static bool
+AnyAndNot_Scalar(const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    for (int i = 0; i < numblocks; i++)
+        if (a[i] & ~b[i])
+            return true;
+    return false;
+}
+
+static void
+Or_Scalar(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    for (int i = 0; i < numblocks; i++)
+        dst[i] |= src[i];
+}
+
+static int
+Count_Scalar(const leafblock_t *bits, int numblocks)
+{
+    int count = 0;
+
+    for (int i = 0; i < numblocks; i++)
+        count += PopCount(bits[i]);
+    return count;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef LEAFBITS_X86
+
+/* leafblock_t's per vector */
+#define SSE2_BLOCKS (int)(sizeof(__m128i) / sizeof(leafblock_t))
+#define AVX2_BLOCKS (int)(sizeof(__m256i) / sizeof(leafblock_t))
+
+__attribute__((target("sse2"))) static bool
+AndNew_SSE2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+            const leafblock_t *seen, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % SSE2_BLOCKS;
+    __m128i more = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < vecblocks; i += SSE2_BLOCKS) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        const __m128i vs = _mm_loadu_si128((const __m128i *)(seen + i));
+        const __m128i vd = _mm_and_si128(va, vb);
+        _mm_storeu_si128((__m128i *)(dst + i), vd);
+        more = _mm_or_si128(more, _mm_andnot_si128(vs, vd));
+    }
+
+    const bool found = _mm_movemask_epi8(_mm_cmpeq_epi8(more, _mm_setzero_si128())) != 0xffff;
+    return AndNew_Scalar(dst + i, a + i, b + i, seen + i, numblocks - i) || found;
+}
+
+__attribute__((target("sse2"))) static bool
+AnyAndNot_SSE2(const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % SSE2_BLOCKS;
+    int i;
+
+    for (i = 0; i < vecblocks; i += SSE2_BLOCKS) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        const __m128i diff = _mm_andnot_si128(vb, va);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff)
+            return true;
+    }
+    return AnyAndNot_Scalar(a + i, b + i, numblocks - i);
+}
+
+__attribute__((target("sse2"))) static void
+Or_SSE2(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % SSE2_BLOCKS;
+    int i;
+
+    for (i = 0; i < vecblocks; i += SSE2_BLOCKS) {
+        const __m128i vd = _mm_loadu_si128((const __m128i *)(dst + i));
+        const __m128i vs = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(vd, vs));
+    }
+    Or_Scalar(dst + i, src + i, numblocks - i);
+}
+
+__attribute__((target("avx2"))) static bool
+AndNew_AVX2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+            const leafblock_t *seen, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % AVX2_BLOCKS;
+    __m256i more = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i < vecblocks; i += AVX2_BLOCKS) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        const __m256i vs = _mm256_loadu_si256((const __m256i *)(seen + i));
+        const __m256i vd = _mm256_and_si256(va, vb);
+        _mm256_storeu_si256((__m256i *)(dst + i), vd);
+        more = _mm256_or_si256(more, _mm256_andnot_si256(vs, vd));
+    }
+
+    const bool found = !_mm256_testz_si256(more, more);
+    return AndNew_Scalar(dst + i, a + i, b + i, seen + i, numblocks - i) || found;
+}
+
+__attribute__((target("avx2"))) static bool
+AnyAndNot_AVX2(const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % AVX2_BLOCKS;
+    int i;
+
+    for (i = 0; i < vecblocks; i += AVX2_BLOCKS) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        if (!_mm256_testc_si256(vb, va))        /* any bit of a not in b */
+            return true;
+    }
+    return AnyAndNot_Scalar(a + i, b + i, numblocks - i);
+}
+
+__attribute__((target("avx2"))) static void
+Or_AVX2(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % AVX2_BLOCKS;
+    int i;
+
+    for (i = 0; i < vecblocks; i += AVX2_BLOCKS) {
+        const __m256i vd = _mm256_loadu_si256((const __m256i *)(dst + i));
+        const __m256i vs = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(vd, vs));
+    }
+    Or_Scalar(dst + i, src + i, numblocks - i);
+}
+
+/*
+ * Counts bits a nibble at a time with a shuffle lookup and sums the bytes
+ * with SAD (Mula's method)
+ */
+__attribute__((target("avx2"))) static int
+Count_AVX2(const leafblock_t *bits, int numblocks)
+{
+    const int vecblocks = numblocks - numblocks % AVX2_BLOCKS;
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i < vecblocks; i += AVX2_BLOCKS) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(bits + i));
+        const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+        const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)sums, total);
+    return static_cast<int>(sums[0] + sums[1] + sums[2] + sums[3]) + Count_Scalar(bits + i, numblocks - i);
+}
+
+#endif /* LEAFBITS_X86 */
+
+/* ------------------------------------------------------------------------ */
+
+struct leafbitsops_t {
+    const char *name;
+    bool (*andnew)(leafblock_t *, const leafblock_t *, const leafblock_t *, const leafblock_t *, int);
+    bool (*anyandnot)(const leafblock_t *, const leafblock_t *, int);
+    void (*or_)(leafblock_t *, const leafblock_t *, int);
+    int (*count)(const leafblock_t *, int);
+};
+
+static const leafbitsops_t ops_scalar = {
+    "scalar", AndNew_Scalar, AnyAndNot_Scalar, Or_Scalar, Count_Scalar
+};
+
+#ifdef LEAFBITS_X86
+static const leafbitsops_t ops_sse2 = {
+    "sse2", AndNew_SSE2, AnyAndNot_SSE2, Or_SSE2, Count_Scalar
+};
+static const leafbitsops_t ops_avx2 = {
+    "avx2", AndNew_AVX2, AnyAndNot_AVX2, Or_AVX2, Count_AVX2
+};
+#endif
+
+static const leafbitsops_t *const implementations[] = {
+#ifdef LEAFBITS_X86
+    &ops_avx2,
+    &ops_sse2,
+#endif
+    &ops_scalar,
+};
+
+static bool
+Supported(const leafbitsops_t *ops)
+{
+#ifdef LEAFBITS_X86
+    __builtin_cpu_init();
+    if (ops == &ops_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (ops == &ops_sse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+static const leafbitsops_t *
+SelectOps(void)
+{
+    for (const leafbitsops_t *impl : implementations)
+        if (Supported(impl))
+            return impl;
+    return &ops_scalar;
+}
+
+/* the widest the CPU supports, chosen before main() */
+static const leafbitsops_t *ops = SelectOps();
+
+bool
+Leafbits_AndNew(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+                const leafblock_t *seen, int numblocks)
+{
+    return ops->andnew(dst, a, b, seen, numblocks);
+}
+
+bool
+Leafbits_AnyAndNot(const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    return ops->anyandnot(a, b, numblocks);
+}
+
+void
+Leafbits_Or(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    ops->or_(dst, src, numblocks);
+}
+
+int
+Leafbits_Count(const leafblock_t *bits, int numblocks)
+{
+    return ops->count(bits, numblocks);
+}
+
+const char *
+Leafbits_Implementation(void)
+{
+    return ops->name;
+}
+
+/*
+ * Switches to the named implementation ("avx2", "sse2" or "scalar").
+ * Returns false, changing nothing, if it isn't built in or the CPU can't
+ * run it.
+ */
+bool
+Leafbits_UseImplementation(const char *name)
+{
+    for (const leafbitsops_t *impl : implementations) {
+        if (!strcmp(impl->name, name) && Supported(impl)) {
+            ops = impl;
+            return true;
+        }
+    }
+    return false;
+}
@@ -21,6 +21,9 @@
 
 #include <vis/vis.hh>
 #include <common/bsputils.hh>
+#include <common/threads.hh>
+
+#include <vector>
 
 /*
 
@@ -68,6 +71,10 @@ SurfaceBBox(const mbsp_t *bsp, const bsp2_dface_t *surf,
 /*
   ====================
   CalcAmbientSounds
+
+  Each leaf is independent, so they are done in parallel. Which ambient a
+  face makes and its bounding box are worked out once up front rather than
+  for every leaf that can see it.
   ====================
 */
 void
@@ -76,17 +83,44 @@ CalcAmbientSounds(mbsp_t *bsp)
     const bsp2_dface_t *surf;
     const gtexinfo_t *info;
     const miptex_t *miptex;
-    int i, j, k, l;
-    mleaf_t *leaf, *hit;
-    byte *vis;
-    vec3_t mins, maxs;
-    float d, maxd;
-    int ambient_type;
-    int ofs;
-    float dists[NUM_AMBIENTS];
-    float vol;
-
-    for (i = 0; i < portalleafs_real; i++) {
+    int i, ofs;
+
+    std::vector<int> ambient(bsp->numfaces, -1);
+    std::vector<qvec3f> facemins(bsp->numfaces), facemaxs(bsp->numfaces);
+    for (i = 0; i < bsp->numfaces; i++) {
+        surf = BSP_GetFace(bsp, i);
+        info = &bsp->texinfo[surf->texinfo];
+        ofs = bsp->dtexdata->dataofs[info->miptex];
+        miptex = (const miptex_t *)((byte *)bsp->dtexdata + ofs);
+
+        if (!Q_strncasecmp(miptex->name, "sky", 3) && ambientsky)
+            ambient[i] = AMBIENT_SKY;
+        else if (!Q_strncasecmp(miptex->name, "*water", 6) && ambientwater)
+            ambient[i] = AMBIENT_WATER;
+        else if (!Q_strncasecmp(miptex->name, "*04water", 8) && ambientwater)
+            ambient[i] = AMBIENT_WATER;
+        else if (!Q_strncasecmp(miptex->name, "*slime", 6) && ambientslime)
+            ambient[i] = AMBIENT_WATER;       // AMBIENT_SLIME;
+        else if (!Q_strncasecmp(miptex->name, "*lava", 5) && ambientlava)
+            ambient[i] = AMBIENT_LAVA;
+        else
+            continue;
+
+        vec3_t mins, maxs;
+        SurfaceBBox(bsp, surf, mins, maxs);
+        facemins[i] = VectorToGLM(mins);
+        facemaxs[i] = VectorToGLM(maxs);
+    }
+
+    ParallelFor(0, portalleafs_real, [&](int i) {
+        int j, k, l;
+        mleaf_t *leaf, *hit;
+        const byte *vis;
+        float d, maxd;
+        int facenum, ambient_type;
+        float dists[NUM_AMBIENTS];
+        float vol;
+
         leaf = &bsp->dleafs[i + 1];
 
         //
@@ -111,26 +145,14 @@ CalcAmbientSounds(mbsp_t *bsp)
             hit = &bsp->dleafs[j + 1];
 
             for (k = 0; k < hit->nummarksurfaces; k++) {
-                surf = BSP_GetFace(bsp, bsp->dleaffaces[hit->firstmarksurface + k]);
-                info = &bsp->texinfo[surf->texinfo];
-                ofs = bsp->dtexdata->dataofs[info->miptex];
-                miptex = (const miptex_t *)((byte *)bsp->dtexdata + ofs);
-
-                if (!Q_strncasecmp(miptex->name, "sky", 3) && ambientsky)
-                    ambient_type = AMBIENT_SKY;
-                else if (!Q_strncasecmp(miptex->name, "*water", 6) && ambientwater)
-                    ambient_type = AMBIENT_WATER;
-                else if (!Q_strncasecmp(miptex->name, "*04water", 8) && ambientwater)
-                    ambient_type = AMBIENT_WATER;
-                else if (!Q_strncasecmp(miptex->name, "*slime", 6) && ambientslime)
-                    ambient_type = AMBIENT_WATER;       // AMBIENT_SLIME;
-                else if (!Q_strncasecmp(miptex->name, "*lava", 5) && ambientlava)
-                    ambient_type = AMBIENT_LAVA;
-                else
+                facenum = bsp->dleaffaces[hit->firstmarksurface + k];
+                ambient_type = ambient[facenum];
+                if (ambient_type < 0)
                     continue;
 
                 // find distance from source leaf to polygon
-                SurfaceBBox(bsp, surf, mins, maxs);
+                const qvec3f &mins = facemins[facenum];
+                const qvec3f &maxs = facemaxs[facenum];
                 maxd = 0;
                 for (l = 0; l < 3; l++) {
                     if (mins[l] > leaf->maxs[l])
@@ -159,5 +181,5 @@ CalcAmbientSounds(mbsp_t *bsp)
             }
             leaf->ambient_level[j] = (byte)(vol * 255);
         }
-    }
+    });
 }
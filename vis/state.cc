@@ -27,7 +27,13 @@
 #include <vis/vis.hh>
 #include <common/cmdlib.hh>
 
-#define VIS_STATE_VERSION ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1')
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+
+#define VIS_STATE_VERSION ('T' << 24 | 'Y' << 16 | 'R' << 8 | '3')
 
 typedef struct {
     uint32_t version;
@@ -35,6 +41,7 @@ typedef struct {
     uint32_t numleafs;
     uint32_t testlevel;
     uint32_t time_elapsed;
+    float farplane;
 } dvisstate_t;
 
 typedef struct {
@@ -45,6 +52,39 @@ typedef struct {
     uint32_t numcansee;
 } dportal_t;
 
+/*
+ * After the dportal_t's comes a dportalgeom_t per portal, so -incremental
+ * can match the portals against those of a new portal file.
+ */
+typedef struct {
+    uint32_t hash[2];           // PortalHash, low word first
+    uint32_t leaf;              // the leaf it leads into
+} dportalgeom_t;
+
+/*
+ * The state file is a full snapshot. Between snapshots, portals completed
+ * and mightsee updates are appended to a journal, which LoadVisState()
+ * replays on top of it. Each record is a header followed by "length"
+ * bytes of data:
+ *
+ *   JOURNAL_PORTAL:  num is the portal, data is a dportal_t then the
+ *                    compressed mightsee and vis, as in the state file
+ *   JOURNAL_UNSEEN:  num is a leaf, data is the uint32_t leafs that can no
+ *                    longer see it (see UpdateMightsee)
+ *
+ * Replaying a record that is already reflected in the snapshot changes
+ * nothing, so the two don't have to be kept in lock step.
+ */
+#define JOURNAL_PORTAL 1
+#define JOURNAL_UNSEEN 2
+
+typedef struct {
+    uint32_t type;
+    uint32_t num;
+    uint32_t length;
+    uint32_t crc;               // of the data, catches a torn final write
+} djournal_t;
+
 static int
 CompressBits(uint8_t *out, const leafbits_t *in)
 {
@@ -87,14 +127,14 @@ CompressBits(uint8_t *out, const leafbits_t *in)
 }
 
 static void
-DecompressBits(leafbits_t *dst, const uint8_t *src)
+DecompressBits(leafbits_t *dst, const uint8_t *src, int numleafs)
 {
     int i, rep, shift, numbytes;
     uint8_t val;
 
-    numbytes = (portalleafs + 7) >> 3;
+    numbytes = (numleafs + 7) >> 3;
     memset(dst->bits, 0, numbytes);
-    dst->numleafs = portalleafs;
+    dst->numleafs = numleafs;
 
     for (i = 0; i < numbytes; i++) {
         val = *src++;
@@ -132,6 +172,63 @@ CopyLeafBits(leafbits_t *dst, const byte *src, int numleafs)
     }
 }
 
+static void
+ReadLeafBits(leafbits_t *dst, const uint8_t *src, int len, int numleafs)
+{
+    if (len < ((numleafs + 7) >> 3))
+        DecompressBits(dst, src, numleafs);
+    else
+        CopyLeafBits(dst, src, numleafs);
+}
+
+/*
+ * Hash of the portal winding, with the points rounded to 1/8 unit and
+ * starting from the smallest one, so the same portal hashes the same after
+ * qbsp has renumbered everything. The point order (and so the direction the
+ * portal faces) still counts.
+ */
+static uint64_t
+PortalHash(const portal_t *p)
+{
+    const winding_t *w = p->winding;
+    std::vector<int32_t> points(w->numpoints * 3);
+    uint64_t hash = 14695981039346656037ULL;   // FNV-1a
+    int i, j, first;
+
+    for (i = 0; i < w->numpoints * 3; i++)
+        points[i] = (int32_t)floor(w->points[i / 3][i % 3] * 8 + 0.5);
+
+    first = 0;
+    for (i = 1; i < w->numpoints; i++) {
+        if (std::lexicographical_compare(&points[i * 3], &points[i * 3 + 3],
+                                         &points[first * 3], &points[first * 3 + 3]))
+            first = i;
+    }
+
+    for (i = 0; i < w->numpoints; i++) {
+        const int32_t *point = &points[((first + i) % w->numpoints) * 3];
+        for (j = 0; j < 3; j++) {
+            for (int shift = 0; shift < 32; shift += 8) {
+                hash ^= (uint8_t)(point[j] >> shift);
+                hash *= 1099511628211ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+/* Only touched by the checkpoint thread while it is running */
+static bool hasstate;           // statefile holds a snapshot to journal against
+static long statesize, journalsize;
+
+/*
+  ==============
+  SaveVisState
+
+  Writes a full snapshot and discards the journal. The state must not
+  change while it is saved.
+  ==============
+*/
 void
 SaveVisState(void)
 {
@@ -152,6 +249,7 @@ SaveVisState(void)
     state.numleafs = LittleLong(portalleafs);
     state.testlevel = LittleLong(testlevel);
     state.time_elapsed = LittleLong((uint32_t)(statetime - starttime));
+    state.farplane = LittleFloat(farplane);
 
     SafeWrite(outfile, &state, sizeof(state));
 
@@ -181,6 +279,17 @@ SaveVisState(void)
     free(might);
     free(vis);
 
+    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
+        const uint64_t hash = PortalHash(p);
+        dportalgeom_t geom;
+
+        geom.hash[0] = LittleLong((uint32_t)hash);
+        geom.hash[1] = LittleLong((uint32_t)(hash >> 32));
+        geom.leaf = LittleLong(p->leaf);
+        SafeWrite(outfile, &geom, sizeof(geom));
+    }
+
+    statesize = ftell(outfile);
     err = fclose(outfile);
     if (err)
         Error("%s: error writing new state (%s)", __func__, strerror(errno));
@@ -190,6 +299,293 @@ SaveVisState(void)
     err = rename(statetmpfile, statefile);
     if (err)
         Error("%s: error renaming state file (%s)", __func__, strerror(errno));
+    err = unlink(journalfile);
+    if (err && errno != ENOENT)
+        Error("%s: error removing old journal (%s)", __func__, strerror(errno));
+
+    hasstate = true;
+    journalsize = 0;
+}
+
+static uint32_t
+JournalCRC(const std::vector<uint8_t> &data)
+{
+    unsigned short crc;
+
+    CRC_Init(&crc);
+    for (uint8_t byte : data)
+        CRC_ProcessByte(&crc, byte);
+    return CRC_Value(crc);
+}
+
+/*
+  ==============
+  ReplayVisJournal
+
+  Applies the journal records to the state just loaded. Stops at the first
+  record that is incomplete or damaged; everything before it is good.
+  Returns the number of records applied.
+  ==============
+*/
+static int
+ReplayVisJournal(void)
+{
+    FILE *infile;
+    int count;
+    uint32_t i, leafnum;
+    portal_t *p;
+    const leaf_t *leaf;
+    djournal_t record;
+    dportal_t pstate;
+    std::vector<uint8_t> data;
+    bool damaged;
+
+    infile = fopen(journalfile, "rb");
+    if (!infile)
+        return 0;
+
+    count = 0;
+    damaged = false;
+    while (fread(&record, sizeof(record), 1, infile) == 1) {
+        record.type = LittleLong(record.type);
+        record.num = LittleLong(record.num);
+        record.length = LittleLong(record.length);
+        record.crc = LittleLong(record.crc);
+
+        data.resize(record.length);
+        if (record.length && fread(data.data(), record.length, 1, infile) != 1) {
+            damaged = true;
+            break;
+        }
+        if (JournalCRC(data) != record.crc) {
+            damaged = true;
+            break;
+        }
+
+        if (record.type == JOURNAL_PORTAL) {
+            if (record.num >= (uint32_t)numportals * 2 || record.length < sizeof(pstate)) {
+                damaged = true;
+                break;
+            }
+            memcpy(&pstate, data.data(), sizeof(pstate));
+            pstate.might = LittleLong(pstate.might);
+            pstate.vis = LittleLong(pstate.vis);
+            if (sizeof(pstate) + pstate.might + pstate.vis != record.length) {
+                damaged = true;
+                break;
+            }
+
+            p = portals + record.num;
+            p->status = pstat_done;
+            p->nummightsee = LittleLong(pstate.nummightsee);
+            p->numcansee = LittleLong(pstate.numcansee);
+            memset(p->mightsee, 0, LeafbitsSize(portalleafs));
+            ReadLeafBits(p->mightsee, data.data() + sizeof(pstate), pstate.might, portalleafs);
+            memset(p->visbits, 0, LeafbitsSize(portalleafs));
+            ReadLeafBits(p->visbits, data.data() + sizeof(pstate) + pstate.might, pstate.vis, portalleafs);
+        } else if (record.type == JOURNAL_UNSEEN) {
+            if (record.num >= (uint32_t)portalleafs || record.length % sizeof(uint32_t)) {
+                damaged = true;
+                break;
+            }
+            for (i = 0; i < record.length / sizeof(uint32_t); i++) {
+                memcpy(&leafnum, data.data() + i * sizeof(uint32_t), sizeof(leafnum));
+                leafnum = LittleLong(leafnum);
+                if (leafnum >= (uint32_t)portalleafs)
+                    break;
+
+                /* as UpdateMightsee() */
+                leaf = &leafs[leafnum];
+                for (int j = 0; j < leaf->numportals; j++) {
+                    p = leaf->portals[j];
+                    if (p->status != pstat_none)
+                        continue;
+                    if (TestLeafBit(p->mightsee, record.num)) {
+                        ClearLeafBit(p->mightsee, record.num);
+                        p->nummightsee--;
+                    }
+                }
+            }
+        } else {
+            damaged = true;
+            break;
+        }
+        count++;
+    }
+
+    if (damaged)
+        logprint("WARNING: ignoring damaged end of journal %s\n", journalfile);
+
+    fclose(infile);
+    return count;
+}
+
+/*
+ * Records are built by the worker threads and written out by the checkpoint
+ * thread, so workers never wait on the disk. Every record is queued after
+ * the change it describes, which is what lets a snapshot simply drop the
+ * queue.
+ */
+static std::mutex journal_lock;         // guards the members below
+static std::vector<uint8_t> journal_pending;
+static std::condition_variable journal_wake;
+static bool journal_stop;
+
+static std::thread journal_thread;
+static bool journal_active;
+
+static void
+JournalRecord(uint32_t type, uint32_t num, const std::vector<uint8_t> &data)
+{
+    djournal_t record;
+    const uint8_t *header;
+
+    record.type = LittleLong(type);
+    record.num = LittleLong(num);
+    record.length = LittleLong(data.size());
+    record.crc = LittleLong(JournalCRC(data));
+    header = reinterpret_cast<const uint8_t *>(&record);
+
+    std::lock_guard<std::mutex> lock(journal_lock);
+    journal_pending.insert(journal_pending.end(), header, header + sizeof(record));
+    journal_pending.insert(journal_pending.end(), data.begin(), data.end());
+}
+
+void
+JournalPortal(const portal_t *p)
+{
+    int might_len, vis_len, numbytes;
+    dportal_t pstate;
+
+    if (!journal_active)
+        return;
+
+    numbytes = (portalleafs + 7) >> 3;
+    std::vector<uint8_t> data(sizeof(pstate) + numbytes * 2);
+    might_len = CompressBits(data.data() + sizeof(pstate), p->mightsee);
+    vis_len = CompressBits(data.data() + sizeof(pstate) + might_len, p->visbits);
+    data.resize(sizeof(pstate) + might_len + vis_len);
+
+    pstate.status = LittleLong(p->status);
+    pstate.might = LittleLong(might_len);
+    pstate.vis = LittleLong(vis_len);
+    pstate.nummightsee = LittleLong(p->nummightsee);
+    pstate.numcansee = LittleLong(p->numcansee);
+    memcpy(data.data(), &pstate, sizeof(pstate));
+
+    JournalRecord(JOURNAL_PORTAL, p - portals, data);
+}
+
+void
+JournalUnseen(const leaf_t *leaf, const std::vector<int> &unseen)
+{
+    if (!journal_active)
+        return;
+
+    std::vector<uint8_t> data(unseen.size() * sizeof(uint32_t));
+    for (size_t i = 0; i < unseen.size(); i++) {
+        const uint32_t leafnum = LittleLong(unseen[i]);
+        memcpy(data.data() + i * sizeof(uint32_t), &leafnum, sizeof(leafnum));
+    }
+
+    JournalRecord(JOURNAL_UNSEEN, leaf - leafs, data);
+}
+
+/* Takes a fresh snapshot, so the queued records are no longer needed */
+static void
+CompactVisState(void)
+{
+    std::lock_guard<std::mutex> lock(portal_lock);
+    {
+        std::lock_guard<std::mutex> jlock(journal_lock);
+        journal_pending.clear();
+    }
+    statetime = I_FloatTime();
+    SaveVisState();
+}
+
+static void
+FlushVisJournal(void)
+{
+    FILE *outfile;
+    std::vector<uint8_t> records;
+    int err;
+
+    {
+        std::lock_guard<std::mutex> lock(journal_lock);
+        records.swap(journal_pending);
+    }
+    if (records.empty())
+        return;
+
+    outfile = fopen(journalfile, "ab");
+    if (!outfile)
+        Error("%s: error opening %s (%s)", __func__, journalfile, strerror(errno));
+    SafeWrite(outfile, records.data(), records.size());
+    err = fclose(outfile);
+    if (err)
+        Error("%s: error writing journal (%s)", __func__, strerror(errno));
+
+    journalsize += records.size();
+}
+
+/*
+ * Appends to the journal every journalinterval seconds, once the first
+ * snapshot has been taken stateinterval seconds in. A new snapshot is taken
+ * whenever the journal grows bigger than the last one.
+ */
+static void
+CheckpointThread(double stateinterval, double journalinterval)
+{
+    std::unique_lock<std::mutex> lock(journal_lock);
+    bool stopping = false;
+
+    while (!stopping) {
+        stopping = journal_wake.wait_for(lock, std::chrono::duration<double>(journalinterval),
+                                         [] { return journal_stop; });
+        if (!hasstate) {
+            /* nothing to journal against yet; the snapshot will cover it */
+            journal_pending.clear();
+            if (I_FloatTime() <= statetime + stateinterval)
+                continue;
+            lock.unlock();
+            CompactVisState();
+        } else {
+            lock.unlock();
+            FlushVisJournal();
+            if (journalsize > statesize && !stopping)
+                CompactVisState();
+        }
+        lock.lock();
+    }
+}
+
+/*
+  ==============
+  StartVisCheckpoints
+
+  Starts saving progress in the background while the portals are flowed
+  ==============
+*/
+void
+StartVisCheckpoints(double stateinterval, double journalinterval)
+{
+    journal_stop = false;
+    journal_pending.clear();
+    journal_active = true;
+    journal_thread = std::thread(CheckpointThread, stateinterval, journalinterval);
+}
+
+void
+StopVisCheckpoints(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(journal_lock);
+        journal_stop = true;
+    }
+    journal_wake.notify_one();
+    journal_thread.join();
+    journal_active = false;
 }
 
 qboolean
@@ -197,7 +593,7 @@ LoadVisState(void)
 {
     FILE *infile;
     int prt_time, state_time;
-    int i, numbytes, err;
+    int i, numbytes, err, records;
     portal_t *p;
     dvisstate_t state;
     dportal_t pstate;
@@ -228,6 +624,7 @@ LoadVisState(void)
     state.numleafs = LittleLong(state.numleafs);
     state.testlevel = LittleLong(state.testlevel);
     state.time_elapsed = LittleLong(state.time_elapsed);
+    state.farplane = LittleFloat(state.farplane);
 
     /* Sanity check the headers */
     if (state.version != VIS_STATE_VERSION) {
@@ -239,6 +636,11 @@ LoadVisState(void)
         Error("%s: state file %s does not match portal file %s", __func__,
               statefile, portalfile);
     }
+    if (state.farplane != (float)farplane) {
+        fclose(infile);
+        Error("%s: state file %s was saved with -farplane %g, not %g",
+              __func__, statefile, state.farplane, farplane);
+    }
 
     /* Move back the start time to simulate already elapsed time */
     starttime -= state.time_elapsed;
@@ -263,7 +665,7 @@ LoadVisState(void)
         p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
         memset(p->mightsee, 0, LeafbitsSize(portalleafs));
         if (pstate.might < numbytes)
-            DecompressBits(p->mightsee, compressed);
+            DecompressBits(p->mightsee, compressed, portalleafs);
         else
             CopyLeafBits(p->mightsee, compressed, portalleafs);
 
@@ -272,7 +674,7 @@ LoadVisState(void)
         if (pstate.vis) {
             SafeRead(infile, compressed, pstate.vis);
             if (pstate.vis < numbytes)
-                DecompressBits(p->visbits, compressed);
+                DecompressBits(p->visbits, compressed, portalleafs);
             else
                 CopyLeafBits(p->visbits, compressed, portalleafs);
         }
@@ -285,5 +687,197 @@ LoadVisState(void)
     free(compressed);
     fclose(infile);
 
+    hasstate = true;
+    records = ReplayVisJournal();
+    if (records) {
+        logprint("Replayed %d journal records\n", records);
+        SaveVisState();
+    }
+
     return true;
 }
+
+/*
+  ==============
+  ReuseVisState
+
+  For -incremental, when the state file was made from an older portal file.
+  Portals are matched to the old ones by PortalHash, and a leaf to an old
+  leaf when all its portals match the old leaf's. A portal finished in the
+  old state whose leaf and whole old mightsee matched floods and flows
+  exactly as before, so its vis is carried over and it is marked done;
+  everything else is left for BasePortalVis and the full vis.
+
+  Returns the number of portals reused.
+  ==============
+*/
+int
+ReuseVisState(void)
+{
+    FILE *infile;
+    int i, j, oldnumbytes, reused;
+    int oldnumportals, oldnumleafs, oldleaf;
+    portal_t *p;
+    dvisstate_t state;
+    dportal_t pstate;
+    dportalgeom_t geom;
+    uint8_t *compressed;
+
+    if (FileTime(statefile) == -1)
+        return 0;
+
+    infile = SafeOpenRead(statefile);
+    SafeRead(infile, &state, sizeof(state));
+    state.version = LittleLong(state.version);
+    state.numportals = LittleLong(state.numportals);
+    state.numleafs = LittleLong(state.numleafs);
+    state.testlevel = LittleLong(state.testlevel);
+    state.farplane = LittleFloat(state.farplane);
+
+    if (state.version != VIS_STATE_VERSION || (int)state.testlevel != testlevel
+        || state.farplane != (float)farplane) {
+        logprint("State file %s was made with different settings, not reusing it\n", statefile);
+        fclose(infile);
+        return 0;
+    }
+
+    oldnumportals = state.numportals * 2;
+    oldnumleafs = state.numleafs;
+    oldnumbytes = (oldnumleafs + 7) >> 3;
+    compressed = static_cast<uint8_t *>(malloc(oldnumbytes));
+
+    /* Keep the finished portals from the old state */
+    std::vector<leafbits_t *> oldmight(oldnumportals, nullptr), oldvis(oldnumportals, nullptr);
+    std::vector<dportal_t> oldstate(oldnumportals);
+    for (i = 0; i < oldnumportals; i++) {
+        SafeRead(infile, &pstate, sizeof(pstate));
+        pstate.status = LittleLong(pstate.status);
+        pstate.might = LittleLong(pstate.might);
+        pstate.vis = LittleLong(pstate.vis);
+        pstate.nummightsee = LittleLong(pstate.nummightsee);
+        pstate.numcansee = LittleLong(pstate.numcansee);
+        oldstate[i] = pstate;
+
+        SafeRead(infile, compressed, pstate.might);
+        if (pstate.status == pstat_done) {
+            oldmight[i] = static_cast<leafbits_t *>(calloc(1, LeafbitsSize(oldnumleafs)));
+            ReadLeafBits(oldmight[i], compressed, pstate.might, oldnumleafs);
+        }
+        if (pstate.vis) {
+            SafeRead(infile, compressed, pstate.vis);
+            oldvis[i] = static_cast<leafbits_t *>(calloc(1, LeafbitsSize(oldnumleafs)));
+            ReadLeafBits(oldvis[i], compressed, pstate.vis, oldnumleafs);
+        }
+    }
+    free(compressed);
+
+    /* Match the portals */
+    std::unordered_map<uint64_t, int> newportal;
+    for (i = 0; i < numportals * 2; i++) {
+        auto inserted = newportal.emplace(PortalHash(&portals[i]), i);
+        if (!inserted.second)
+            inserted.first->second = -1;        /* ambiguous, don't match either */
+    }
+
+    std::vector<int> portalmap(oldnumportals, -1);
+    std::vector<int> oldportalleaf(oldnumportals);
+    for (i = 0; i < oldnumportals; i++) {
+        SafeRead(infile, &geom, sizeof(geom));
+        const uint64_t hash = (uint32_t)LittleLong(geom.hash[0])
+                            | (uint64_t)(uint32_t)LittleLong(geom.hash[1]) << 32;
+        oldportalleaf[i] = LittleLong(geom.leaf);
+
+        auto found = newportal.find(hash);
+        if (found != newportal.end())
+            portalmap[i] = found->second;
+    }
+    fclose(infile);
+
+    /*
+     * Match the leafs. The portals of a pair lead in opposite directions,
+     * so a portal is on the leaf its partner leads into.
+     */
+    std::vector<int> leafmap(oldnumleafs, -2);      /* -2 no portals seen yet */
+    std::vector<int> oldleafportals(oldnumleafs, 0);
+    for (i = 0; i < oldnumportals; i++) {
+        oldleaf = oldportalleaf[i ^ 1];
+        oldleafportals[oldleaf]++;
+        if (leafmap[oldleaf] == -1)
+            continue;
+        const int newleaf = (portalmap[i] < 0) ? -1 : portals[portalmap[i] ^ 1].leaf;
+        if (newleaf < 0 || (leafmap[oldleaf] != -2 && leafmap[oldleaf] != newleaf))
+            leafmap[oldleaf] = -1;
+        else
+            leafmap[oldleaf] = newleaf;
+    }
+    std::vector<int> newleafowner(portalleafs, -1);
+    for (i = 0; i < oldnumleafs; i++) {
+        if (leafmap[i] < 0)
+            continue;
+        if (leafs[leafmap[i]].numportals != oldleafportals[i] || newleafowner[leafmap[i]] != -1) {
+            /* the new leaf gained portals, or two old leafs claim it */
+            if (newleafowner[leafmap[i]] >= 0)
+                leafmap[newleafowner[leafmap[i]]] = -1;
+            newleafowner[leafmap[i]] = -2;
+            leafmap[i] = -1;
+            continue;
+        }
+        newleafowner[leafmap[i]] = i;
+    }
+
+    /*
+     * A finished portal is clean if it, its leafs and its whole mightsee
+     * matched. A portal's flow also uses the vis of the portals it passes
+     * through, so it is only carried over if every portal on the leafs in
+     * its mightsee is clean too.
+     */
+    std::vector<bool> clean(oldnumportals, false);
+    for (i = 0; i < oldnumportals; i++) {
+        if (!oldvis[i] || portalmap[i] < 0 || oldstate[i].status != pstat_done)
+            continue;
+        if (leafmap[oldportalleaf[i ^ 1]] < 0 || leafmap[oldportalleaf[i]] < 0)
+            continue;
+        for (j = 0; j < oldnumleafs; j++)
+            if (TestLeafBit(oldmight[i], j) && leafmap[j] < 0)
+                break;
+        clean[i] = (j == oldnumleafs);
+    }
+    std::vector<bool> cleanleaf(oldnumleafs, true);
+    for (i = 0; i < oldnumportals; i++)
+        if (!clean[i])
+            cleanleaf[oldportalleaf[i ^ 1]] = false;
+
+    reused = 0;
+    for (i = 0; i < oldnumportals; i++) {
+        if (!clean[i])
+            continue;
+        for (j = 0; j < oldnumleafs; j++)
+            if (TestLeafBit(oldmight[i], j) && !cleanleaf[j])
+                break;
+        if (j < oldnumleafs)
+            continue;
+
+        p = portals + portalmap[i];
+        p->mightsee = static_cast<leafbits_t *>(calloc(1, LeafbitsSize(portalleafs)));
+        p->visbits = static_cast<leafbits_t *>(calloc(1, LeafbitsSize(portalleafs)));
+        p->mightsee->numleafs = portalleafs;
+        p->visbits->numleafs = portalleafs;
+        for (j = 0; j < oldnumleafs; j++) {
+            if (TestLeafBit(oldmight[i], j))
+                SetLeafBit(p->mightsee, leafmap[j]);
+            if (TestLeafBit(oldvis[i], j) && leafmap[j] >= 0)
+                SetLeafBit(p->visbits, leafmap[j]);
+        }
+        p->nummightsee = oldstate[i].nummightsee;
+        p->numcansee = oldstate[i].numcansee;
+        p->status = pstat_done;
+        reused++;
+    }
+
+    for (i = 0; i < oldnumportals; i++) {
+        free(oldmight[i]);
+        free(oldvis[i]);
+    }
+
+    return reused;
+}
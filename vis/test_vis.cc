@@ -0,0 +1,161 @@
+#include "gtest/gtest.h"
+
+#include <vis/leafbits.hh>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+// The loops vis used before the leafbits kernels, as the reference
+
+static bool AndNew_Reference(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+                             const leafblock_t *seen, int numblocks) {
+    leafblock_t more = 0;
+    for (int j = 0; j < numblocks; j++) {
+        dst[j] = a[j] & b[j];
+        more |= (dst[j] & ~seen[j]);
+    }
+    return more != 0;
+}
+
+static bool AnyAndNot_Reference(const leafblock_t *a, const leafblock_t *b, int numblocks) {
+    leafblock_t changed = 0;
+    for (int j = 0; j < numblocks; j++)
+        changed |= a[j] & ~b[j];
+    return changed != 0;
+}
+
+static int Count_Reference(const leafblock_t *bits, int numblocks) {
+    int count = 0;
+    for (int j = 0; j < numblocks * (int)sizeof(leafblock_t) * 8; j++)
+        if (bits[j >> LEAFSHIFT] & (1UL << (j & LEAFMASK)))
+            count++;
+    return count;
+}
+
+static std::vector<leafblock_t> RandomBlocks(std::mt19937 &rng, int numblocks, int density) {
+    std::vector<leafblock_t> blocks(numblocks);
+    for (leafblock_t &block : blocks) {
+        block = 0;
+        for (int bit = 0; bit <= (int)LEAFMASK; bit++)
+            if ((int)(rng() % 100) < density)
+                block |= 1UL << bit;
+    }
+    return blocks;
+}
+
+static const char *implementations[] = { "avx2", "sse2", "scalar" };
+static const int sizes[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 31, 32, 33, 317 };
+
+class LeafbitsTest : public ::testing::Test {
+protected:
+    void SetUp() override { original = Leafbits_Implementation(); }
+    void TearDown() override { ASSERT_TRUE(Leafbits_UseImplementation(original)); }
+    const char *original;
+};
+
+TEST_F(LeafbitsTest, matchReference) {
+    std::mt19937 rng(1234);
+
+    for (const char *impl : implementations) {
+        if (!Leafbits_UseImplementation(impl)) {
+            printf("leafbits: %s not supported, skipping\n", impl);
+            continue;
+        }
+        SCOPED_TRACE(impl);
+        for (int numblocks : sizes) {
+            SCOPED_TRACE(numblocks);
+            for (int density : { 0, 2, 50, 100 }) {
+                const auto a = RandomBlocks(rng, numblocks, density);
+                const auto b = RandomBlocks(rng, numblocks, density);
+                auto seen = RandomBlocks(rng, numblocks, 100 - density);
+
+                std::vector<leafblock_t> expected(numblocks), actual(numblocks);
+                EXPECT_EQ(AndNew_Reference(expected.data(), a.data(), b.data(), seen.data(), numblocks),
+                          Leafbits_AndNew(actual.data(), a.data(), b.data(), seen.data(), numblocks));
+                EXPECT_EQ(expected, actual);
+
+                // seen covering everything must always report nothing new
+                seen = expected;
+                EXPECT_FALSE(Leafbits_AndNew(actual.data(), a.data(), b.data(), seen.data(), numblocks));
+
+                EXPECT_EQ(AnyAndNot_Reference(a.data(), b.data(), numblocks),
+                          Leafbits_AnyAndNot(a.data(), b.data(), numblocks));
+                EXPECT_FALSE(Leafbits_AnyAndNot(a.data(), a.data(), numblocks));
+
+                expected = a;
+                actual = a;
+                for (int j = 0; j < numblocks; j++)
+                    expected[j] |= b[j];
+                Leafbits_Or(actual.data(), b.data(), numblocks);
+                EXPECT_EQ(expected, actual);
+
+                EXPECT_EQ(Count_Reference(a.data(), numblocks), Leafbits_Count(a.data(), numblocks));
+            }
+        }
+    }
+}
+
+TEST_F(LeafbitsTest, newBitInLastBlock) {
+    // the tail handling of the vector versions must still see a lone bit
+    for (const char *impl : implementations) {
+        if (!Leafbits_UseImplementation(impl))
+            continue;
+        SCOPED_TRACE(impl);
+        for (int numblocks : sizes) {
+            if (!numblocks)
+                continue;
+            std::vector<leafblock_t> ones(numblocks, ~0UL), zeros(numblocks, 0), dst(numblocks);
+            std::vector<leafblock_t> last(numblocks, 0);
+            last[numblocks - 1] = 1UL << LEAFMASK;
+
+            EXPECT_TRUE(Leafbits_AndNew(dst.data(), ones.data(), last.data(), zeros.data(), numblocks));
+            EXPECT_TRUE(Leafbits_AnyAndNot(last.data(), zeros.data(), numblocks));
+            EXPECT_EQ(1, Leafbits_Count(last.data(), numblocks));
+        }
+    }
+}
+
+// Prints timings against the reference loops, and checks the totals agree
+TEST_F(LeafbitsTest, benchmark) {
+    const int numblocks = (20000 + LEAFMASK) >> LEAFSHIFT; // a 20k cluster map
+    const int iterations = 2000;
+    std::mt19937 rng(5678);
+
+    const auto a = RandomBlocks(rng, numblocks, 30);
+    const auto b = RandomBlocks(rng, numblocks, 30);
+    auto seen = a;
+    for (int j = 0; j < numblocks; j++)
+        seen[j] |= b[j];
+    std::vector<leafblock_t> dst(numblocks);
+
+    using clock = std::chrono::steady_clock;
+    auto msec = [](clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+
+    int64_t expected = 0;
+    clock::time_point start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        expected += AndNew_Reference(dst.data(), a.data(), b.data(), seen.data(), numblocks);
+        expected += AnyAndNot_Reference(a.data(), seen.data(), numblocks);
+        expected += Count_Reference(dst.data(), numblocks);
+    }
+    const double reference = msec(clock::now() - start);
+    printf("leafbits: %-8s %8.2fms\n", "current", reference);
+
+    for (const char *impl : implementations) {
+        if (!Leafbits_UseImplementation(impl))
+            continue;
+        int64_t actual = 0;
+        start = clock::now();
+        for (int i = 0; i < iterations; i++) {
+            actual += Leafbits_AndNew(dst.data(), a.data(), b.data(), seen.data(), numblocks);
+            actual += Leafbits_AnyAndNot(a.data(), seen.data(), numblocks);
+            actual += Leafbits_Count(dst.data(), numblocks);
+        }
+        const double elapsed = msec(clock::now() - start);
+        printf("leafbits: %-8s %8.2fms (%.1fx)\n", impl, elapsed, reference / elapsed);
+        EXPECT_EQ(expected, actual);
+    }
+}
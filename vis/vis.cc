@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #include <vis/leafbits.hh>
 #include <vis/vis.hh>
 #include <common/log.hh>
@@ -43,6 +47,10 @@ int leafbytes_real;             // (portalleafs_real+63)>>3
 qboolean fastvis;
 static int verbose = 0;
 int testlevel = 4;
+vec_t farplane = 0;
+qboolean incremental = false;
+qboolean coarsevis = false;
+static const char *benchmarkfile = NULL;
 qboolean ambientsky = true;
 qboolean ambientwater = true;
 qboolean ambientslime = true;
@@ -346,6 +354,90 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 
 //============================================================================
 
+/*
+ * Portals waiting to be flowed, in a binary heap ordered by nummightsee and
+ * then by portal number - the order a linear search for the smallest
+ * nummightsee would give. portal_lock guards the heap, portal status
+ * changes and the mightsee of the waiting portals.
+ */
+std::mutex portal_lock;
+static std::vector<int> portalheap;
+static std::vector<int> heapslot;       /* index in portalheap, -1 if not queued */
+
+static bool
+PortalHeap_Less(int a, int b)
+{
+    if (portals[a].nummightsee != portals[b].nummightsee)
+        return portals[a].nummightsee < portals[b].nummightsee;
+    return a < b;
+}
+
+static void
+PortalHeap_Set(int slot, int portalnum)
+{
+    portalheap[slot] = portalnum;
+    heapslot[portalnum] = slot;
+}
+
+static void
+PortalHeap_Up(int slot)
+{
+    const int portalnum = portalheap[slot];
+
+    while (slot > 0) {
+        const int parent = (slot - 1) / 2;
+        if (!PortalHeap_Less(portalnum, portalheap[parent]))
+            break;
+        PortalHeap_Set(slot, portalheap[parent]);
+        slot = parent;
+    }
+    PortalHeap_Set(slot, portalnum);
+}
+
+static void
+PortalHeap_Down(int slot)
+{
+    const int portalnum = portalheap[slot];
+    const int size = static_cast<int>(portalheap.size());
+
+    for (;;) {
+        int child = slot * 2 + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && PortalHeap_Less(portalheap[child + 1], portalheap[child]))
+            child++;
+        if (!PortalHeap_Less(portalheap[child], portalnum))
+            break;
+        PortalHeap_Set(slot, portalheap[child]);
+        slot = child;
+    }
+    PortalHeap_Set(slot, portalnum);
+}
+
+/*
+  =============
+  InitPortalHeap
+
+  Queues every portal that hasn't been flowed yet
+  =============
+*/
+static void
+InitPortalHeap(void)
+{
+    int i;
+
+    portalheap.clear();
+    heapslot.assign(numportals * 2, -1);
+    for (i = 0; i < numportals * 2; i++) {
+        if (portals[i].status == pstat_none) {
+            heapslot[i] = static_cast<int>(portalheap.size());
+            portalheap.push_back(i);
+        }
+    }
+    for (i = static_cast<int>(portalheap.size()) / 2 - 1; i >= 0; i--)
+        PortalHeap_Down(i);
+}
+
 /*
   =============
   GetNextPortal
@@ -358,28 +450,24 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 portal_t *
 GetNextPortal(void)
 {
-    int i;
-    portal_t *p, *ret;
-    unsigned min;
+    portal_t *ret;
 
-    ThreadLock();
+    std::lock_guard<std::mutex> lock(portal_lock);
 
-    min = INT_MAX;
-    ret = NULL;
-
-    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
-        if (p->nummightsee < min && p->status == pstat_none) {
-            min = p->nummightsee;
-            ret = p;
-        }
-    }
+    if (portalheap.empty())
+        return NULL;
 
-    if (ret) {
-        ret->status = pstat_working;
-        GetThreadWork_Locked__();
+    ret = &portals[portalheap[0]];
+    heapslot[portalheap[0]] = -1;
+    if (portalheap.size() > 1) {
+        PortalHeap_Set(0, portalheap.back());
+        portalheap.pop_back();
+        PortalHeap_Down(0);
+    } else {
+        portalheap.pop_back();
     }
 
-    ThreadUnlock();
+    ret->status = pstat_working;
 
     return ret;
 }
@@ -394,7 +482,7 @@ GetNextPortal(void)
   must also be true. Update mightsee for any portals on the source leaf which
   haven't yet started processing.
 
-  Called with the lock held.
+  Called with portal_lock held.
   =============
 */
 static void
@@ -411,6 +499,7 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
         if (TestLeafBit(p->mightsee, leafnum)) {
             ClearLeafBit(p->mightsee, leafnum);
             p->nummightsee--;
+            PortalHeap_Up(heapslot[p - portals]);
             c_mightseeupdate++;
         }
     }
@@ -424,7 +513,8 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
   Mark the portal completed and propogate new vis information across
   to the complementry portals.
 
-  Called with the lock held.
+  The whole scan holds portal_lock: it reads the status and mightsee of the
+  leaf's other portals, which other threads change under the lock.
   =============
 */
 static void
@@ -436,8 +526,9 @@ PortalCompleted(portal_t *completed)
     const leaf_t *myleaf;
     const leafblock_t *might, *vis;
     leafblock_t changed;
+    std::vector<int> unseen;
 
-    ThreadLock();
+    std::lock_guard<std::mutex> lock(portal_lock);
 
     completed->status = pstat_done;
 
@@ -454,6 +545,8 @@ PortalCompleted(portal_t *completed)
         might = p->mightsee->bits;
         vis = p->visbits->bits;
         numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
+        if (!Leafbits_AnyAndNot(might, vis, numblocks))
+            continue;
         for (j = 0; j < numblocks; j++) {
             changed = might[j] & ~vis[j];
             if (!changed)
@@ -482,53 +575,50 @@ PortalCompleted(portal_t *completed)
                 bit = ffsl(changed) - 1;
                 changed &= ~(1UL << bit);
                 leafnum = (j << LEAFSHIFT) + bit;
-                UpdateMightsee(leafs + leafnum, myleaf);
+                unseen.push_back(leafnum);
             }
         }
     }
 
-    ThreadUnlock();
+    if (unseen.empty())
+        return;
+
+    for (int unseenleaf : unseen)
+        UpdateMightsee(leafs + unseenleaf, myleaf);
+    JournalUnseen(myleaf, unseen);
 }
 
 double starttime, endtime, statetime;
 static double stateinterval;
+static double journalinterval;
 
 /*
   ==============
   LeafThread
+
+  Each work item flows whichever portal GetNextPortal() hands out, so the
+  least complex portals are still processed first. Progress is saved by
+  the checkpoint thread, see StartVisCheckpoints().
   ==============
 */
-void *
-LeafThread(void *arg)
+static void
+LeafThread(int unused)
 {
-    double now;
     portal_t *p;
 
-    do {
-        ThreadLock();
-        /* Save state if sufficient time has elapsed */
-        now = I_FloatTime();
-        if (now > statetime + stateinterval) {
-            statetime = now;
-            SaveVisState();
-        }
-        ThreadUnlock();
-
-        p = GetNextPortal();
-        if (!p)
-            break;
-
-        PortalFlow(p);
+    p = GetNextPortal();
+    if (!p)
+        return;
 
-        PortalCompleted(p);
+    PortalFlow(p);
 
-        if (verbose > 1) {
-            logprint("portal:%4i  mightsee:%4i  cansee:%4i\n",
-                     (int)(p - portals), p->nummightsee, p->numcansee);
-        }
-    } while (1);
+    PortalCompleted(p);
+    JournalPortal(p);
 
-    return NULL;
+    if (verbose > 1) {
+        logprint("portal:%4i  mightsee:%4i  cansee:%4i\n",
+                 (int)(p - portals), p->nummightsee, p->numcansee);
+    }
 }
 
 /*
@@ -571,75 +661,138 @@ CompressRow(const byte *vis, const int numbytes, byte *out)
 */
 int64_t totalvis;
 
+/* Seconds spent in each phase, for -benchmark */
+static struct {
+    double load, base, coarse, full, rows, ambient;
+} phasetime;
+
+/*
+ * The compressed vis rows of a run of consecutive leafs (or clusters),
+ * built by one thread and then copied into the vismap in order, so the
+ * lump comes out the same however the work was split.
+ */
+#define VISROWS_PER_CHUNK 64
+
+struct visrows_t {
+    std::vector<byte> data;
+    std::vector<int> lengths;
+    int64_t totalvis = 0;
+};
+
 static void
-LeafFlow(int leafnum, mleaf_t *dleaf)
+AppendVisRow(visrows_t *rows, const byte *row, int numbytes)
+{
+    /* Allocate for worst case where RLE might grow the data (unlikely) */
+    std::vector<byte> compressed(numbytes * 2);
+    const int len = CompressRow(row, numbytes, compressed.data());
+
+    rows->data.insert(rows->data.end(), compressed.begin(), compressed.begin() + len);
+    rows->lengths.push_back(len);
+}
+
+/*
+ * Copies the rows into the vismap in order, returning the offset of each.
+ * A row identical to one already written just points at that one.
+ */
+static std::vector<int>
+PackVisRows(const std::vector<visrows_t> &chunks)
+{
+    std::vector<int> visofs;
+    std::unordered_multimap<uint64_t, int> written;     /* row hash -> offset */
+    int duplicates = 0, saved = 0;
+
+    for (const visrows_t &rows : chunks) {
+        const byte *row = rows.data.data();
+
+        for (int len : rows.lengths) {
+            uint64_t hash = 14695981039346656037ULL;   // FNV-1a
+            for (int i = 0; i < len; i++) {
+                hash ^= row[i];
+                hash *= 1099511628211ULL;
+            }
+            hash ^= len;
+
+            int ofs = -1;
+            auto range = written.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (!memcmp(vismap + it->second, row, len)) {
+                    ofs = it->second;
+                    break;
+                }
+            }
+
+            if (ofs >= 0) {
+                duplicates++;
+                saved += len;
+            } else {
+                if (len > vismap_end - vismap_p)
+                    Error("Vismap expansion overflow");
+                memcpy(vismap_p, row, len);
+                ofs = vismap_p - vismap;
+                vismap_p += len;
+                written.emplace(hash, ofs);
+            }
+            visofs.push_back(ofs);
+            row += len;
+        }
+    }
+
+    logprint("%d duplicate vis rows shared, %d bytes saved\n", duplicates, saved);
+    return visofs;
+}
+
+static void
+LeafFlow(int leafnum, leafbits_t *buffer, visrows_t *rows)
 {
     leaf_t *leaf;
     byte *outbuffer;
-    byte *compressed;
-    int i, j, shift, len;
-    int numvis;
-    byte *dest;
+    int i, j, shift;
+    int numvis, numblocks;
     const portal_t *p;
 
     /*
      * flow through all portals, collecting visible bits
      */
-    outbuffer = uncompressed + leafnum * leafbytes;
     leaf = &leafs[leafnum];
+    numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
     for (i = 0; i < leaf->numportals; i++) {
         p = leaf->portals[i];
         if (p->status != pstat_done)
             Error("portal not done");
-        for (j = 0; j < leafbytes; j++) {
-            shift = (j << 3) & LEAFMASK;
-            outbuffer[j] |= (p->visbits->bits[j >> (LEAFSHIFT - 3)] >> shift) & 0xff;
-        }
+        Leafbits_Or(buffer->bits, p->visbits->bits, numblocks);
     }
 
-    if (outbuffer[leafnum >> 3] & (1 << (leafnum & 7)))
+    if (TestLeafBit(buffer, leafnum))
         logprint("WARNING: Leaf portals saw into leaf (%i)\n", leafnum);
-    outbuffer[leafnum >> 3] |= (1 << (leafnum & 7));
+    SetLeafBit(buffer, leafnum);
 
-    numvis = 0;
-    for (i = 0; i < portalleafs; i++)
-        if (outbuffer[i >> 3] & (1 << (i & 3)))
-            numvis++;
+    numvis = Leafbits_Count(buffer->bits, numblocks);
+
+    outbuffer = uncompressed + leafnum * leafbytes;
+    for (j = 0; j < leafbytes; j++) {
+        shift = (j << 3) & LEAFMASK;
+        outbuffer[j] = (buffer->bits[j >> (LEAFSHIFT - 3)] >> shift) & 0xff;
+    }
 
     /*
      * compress the bit string
      */
     if (verbose > 1)
         logprint("leaf %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
-
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    compressed = static_cast<byte *>(malloc(portalleafs * 2 / 8));
-    len = CompressRow(outbuffer, (portalleafs + 7) >> 3, compressed);
-
-    dest = vismap_p;
-    vismap_p += len;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
-
-    /* leaf 0 is a common solid */
-    dleaf->visofs = dest - vismap;
+    rows->totalvis += numvis;
 
-    memcpy(dest, compressed, len);
-    free(compressed);
+    AppendVisRow(rows, outbuffer, (portalleafs + 7) >> 3);
 }
 
 
-void
-ClusterFlow(int clusternum, leafbits_t *buffer)
+static void
+ClusterFlow(int clusternum, leafbits_t *buffer, visrows_t *rows,
+            const std::vector<int> &clusterleafs)
 {
     leaf_t *leaf;
     byte *outbuffer;
-    byte *compressed;
-    int i, j, len;
+    int i;
     int numvis, numblocks;
-    byte *dest;
     const portal_t *p;
 
     /*
@@ -651,8 +804,7 @@ ClusterFlow(int clusternum, leafbits_t *buffer)
         p = leaf->portals[i];
         if (p->status != pstat_done)
             Error("portal not done");
-        for (j = 0; j < numblocks; j++)
-            buffer->bits[j] |= p->visbits->bits[j];
+        Leafbits_Or(buffer->bits, p->visbits->bits, numblocks);
     }
     if (TestLeafBit(buffer, clusternum))
         logprint("WARNING: Leaf portals saw into cluster (%i)\n", clusternum);
@@ -680,27 +832,23 @@ ClusterFlow(int clusternum, leafbits_t *buffer)
      * increment totalvis by 
      * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
      */
-    for (i = 0; i < portalleafs_real; i++) {
-        if (clustermap[i] == clusternum) {
-            totalvis += numvis;
-        }
-    }
-
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    compressed = static_cast<byte *>(malloc(portalleafs_real * 2 / 8));
-    len = CompressRow(outbuffer, (portalleafs_real + 7) >> 3, compressed);
+    rows->totalvis += (int64_t)clusterleafs[clusternum] * numvis;
 
-    dest = vismap_p;
-    vismap_p += len;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
+    AppendVisRow(rows, outbuffer, (portalleafs_real + 7) >> 3);
+}
 
-    /* leaf 0 is a common solid */
-    leaf->visofs = dest - vismap;
+/*
+  ==================
+  FlowPortals
 
-    memcpy(dest, compressed, len);
-    free(compressed);
+  Flows every portal not yet done, least complex first
+  ==================
+*/
+void
+FlowPortals(int startcount)
+{
+    InitPortalHeap();
+    ParallelFor(startcount, numportals * 2, LeafThread);
 }
 
 /*
@@ -731,13 +879,17 @@ CalcPortalVis(const mbsp_t *bsp)
         if (p->status == pstat_done)
             startcount++;
     }
-    RunThreadsOn(startcount, numportals * 2, LeafThread, NULL);
+    StartVisCheckpoints(stateinterval, journalinterval);
+    FlowPortals(startcount);
+    StopVisCheckpoints();
 
     if (verbose) {
         logprint("portalcheck: %i  portaltest: %i  portalpass: %i\n",
                  c_portalcheck, c_portaltest, c_portalpass);
         logprint("c_vistest: %i  c_mighttest: %i  c_mightseeupdate %i\n",
                  c_vistest, c_mighttest, c_mightseeupdate);
+        logprint("leafbits mallocs: %i  peak recursion depth: %i\n",
+                 c_leafstackmallocs, c_leafstackdepth);
     }
 }
 
@@ -751,46 +903,159 @@ void
 CalcVis(const mbsp_t *bsp)
 {
     int i;
+    double start;
 
     if (LoadVisState()) {
         logprint("Loaded previous state. Resuming progress...\n");
     } else {
+        if (incremental && !fastvis) {
+            int reused = ReuseVisState();
+            logprint("Reusing vis for %d of %d portals from %s\n",
+                     reused, numportals * 2, statefile);
+        }
         logprint("Calculating Base Vis:\n");
+        start = I_FloatTime();
         BasePortalVis();
+        phasetime.base = I_FloatTime() - start;
+        if (coarsevis && !fastvis) {
+            start = I_FloatTime();
+            CoarsePortalVis();
+            phasetime.coarse = I_FloatTime() - start;
+        }
     }
 
     logprint("Calculating Full Vis:\n");
+    start = I_FloatTime();
     CalcPortalVis(bsp);
+    phasetime.full = I_FloatTime() - start;
+
+    /* Keep the finished state for the next -incremental run */
+    if (incremental && !fastvis) {
+        statetime = I_FloatTime();
+        SaveVisState();
+    }
 
 //
 // assemble the leaf vis lists by oring and compressing the portal lists
 //
-    if (portalleafs == portalleafs_real) {
-        for (i = 0; i < portalleafs; i++)
-            LeafFlow(i, &bsp->dleafs[i + 1]);
-    } else {
-        leafbits_t *buffer;
+    start = I_FloatTime();
+    std::vector<visrows_t> chunks((portalleafs + VISROWS_PER_CHUNK - 1) / VISROWS_PER_CHUNK);
+    std::vector<int> clusterleafs;
+    std::vector<int> visofs;
 
+    if (portalleafs != portalleafs_real) {
         logprint("Expanding clusters...\n");
-        buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
-        for (i = 0; i < portalleafs; i++) {
+        clusterleafs.assign(portalleafs, 0);
+        for (i = 0; i < portalleafs_real; i++)
+            clusterleafs[clustermap[i]]++;
+    }
+
+    ParallelFor(0, chunks.size(), [&](int chunk) {
+        leafbits_t *buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        const int first = chunk * VISROWS_PER_CHUNK;
+        const int last = qmin(first + VISROWS_PER_CHUNK, portalleafs);
+
+        for (int j = first; j < last; j++) {
             memset(buffer, 0, LeafbitsSize(portalleafs));
-            ClusterFlow(i, buffer);
+            if (portalleafs == portalleafs_real)
+                LeafFlow(j, buffer, &chunks[chunk]);
+            else
+                ClusterFlow(j, buffer, &chunks[chunk], clusterleafs);
         }
         free(buffer);
-        
+    });
+
+    /* leaf 0 is a common solid */
+    visofs = PackVisRows(chunks);
+    if (portalleafs == portalleafs_real) {
+        for (i = 0; i < portalleafs; i++)
+            bsp->dleafs[i + 1].visofs = visofs[i];
+    } else {
+        for (i = 0; i < portalleafs; i++)
+            leafs[i].visofs = visofs[i];
+
         // Set pointers
         for (i = 0; i < portalleafs_real; i++) {
             bsp->dleafs[i + 1].visofs = leafs[clustermap[i]].visofs;
         }
     }
 
+    for (const visrows_t &rows : chunks)
+        totalvis += rows.totalvis;
+    phasetime.rows = I_FloatTime() - start;
+
     int64_t avg = totalvis;
     avg /= static_cast<int64_t>(portalleafs_real);
     
     logprint("average leafs visible: %i\n", static_cast<int>(avg));
 }
 
+/*
+  ==================
+  WriteBenchmark
+
+  Writes the phase times, flow counters, peak memory and a hash of the
+  uncompressed PVS as JSON. The hash doesn't depend on how the rows were
+  compressed or shared, only on what each leaf can see.
+  ==================
+*/
+static void
+WriteBenchmark(const char *filename)
+{
+    FILE *f;
+    uint64_t hash = 14695981039346656037ULL;
+    const size_t pvsbytes = (size_t)portalleafs * leafbytes_real;
+    const char *c;
+
+    for (size_t i = 0; i < pvsbytes; i++) {
+        hash ^= uncompressed[i];
+        hash *= 1099511628211ULL;
+    }
+
+    f = fopen(filename, "w");
+    if (!f)
+        Error("%s: couldn't open %s", __func__, filename);
+
+    fprintf(f, "{\n    \"map\": \"");
+    for (c = sourcefile; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', f);
+        fputc(*c, f);
+    }
+    fprintf(f, "\",\n");
+    fprintf(f, "    \"threads\": %d,\n", numthreads);
+    fprintf(f, "    \"testlevel\": %d,\n", testlevel);
+    fprintf(f, "    \"leafs\": %d,\n", portalleafs_real);
+    fprintf(f, "    \"clusters\": %d,\n", portalleafs);
+    fprintf(f, "    \"portals\": %d,\n", numportals);
+    fprintf(f, "    \"seconds\": {\n");
+    fprintf(f, "        \"load\": %.3f,\n", phasetime.load);
+    fprintf(f, "        \"base\": %.3f,\n", phasetime.base);
+    fprintf(f, "        \"coarse\": %.3f,\n", phasetime.coarse);
+    fprintf(f, "        \"full\": %.3f,\n", phasetime.full);
+    fprintf(f, "        \"rows\": %.3f,\n", phasetime.rows);
+    fprintf(f, "        \"ambient\": %.3f,\n", phasetime.ambient);
+    fprintf(f, "        \"total\": %.3f\n", endtime - starttime);
+    fprintf(f, "    },\n");
+    fprintf(f, "    \"chains\": %lu,\n", c_chains);
+    fprintf(f, "    \"chains_per_second\": %.0f,\n",
+            phasetime.full > 0 ? c_chains / phasetime.full : 0.0);
+    fprintf(f, "    \"portalcheck\": %d,\n", c_portalcheck);
+    fprintf(f, "    \"portaltest\": %d,\n", c_portaltest);
+    fprintf(f, "    \"portalpass\": %d,\n", c_portalpass);
+    fprintf(f, "    \"vistest\": %d,\n", c_vistest);
+    fprintf(f, "    \"mighttest\": %d,\n", c_mighttest);
+    fprintf(f, "    \"mightseeupdate\": %d,\n", c_mightseeupdate);
+    fprintf(f, "    \"peak_memory_kb\": %ld,\n", I_PeakMemory());
+    fprintf(f, "    \"visdatasize\": %d,\n", static_cast<int>(vismap_p - vismap));
+    fprintf(f, "    \"average_leafs_visible\": %d,\n",
+            static_cast<int>(totalvis / portalleafs_real));
+    fprintf(f, "    \"pvs_hash\": \"%016llx\"\n", (unsigned long long)hash);
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
+
 /*
   ============================================================================
   PASSAGE CALCULATION (not used yet...)
@@ -1205,6 +1470,7 @@ char sourcefile[1024];
 char portalfile[1024];
 char statefile[1024];
 char statetmpfile[1024];
+char journalfile[1024];
 
 /*
   ===========
@@ -1235,6 +1501,24 @@ main(int argc, char **argv)
         } else if (!strcmp(argv[i], "-level")) {
             testlevel = atoi(argv[i + 1]);
             i++;
+        } else if (!strcmp(argv[i], "-farplane")) {
+            farplane = atof(argv[i + 1]);
+            if (farplane < 0) {
+                logprint("WARNING: -farplane %g is negative, ignoring it\n", farplane);
+                farplane = 0;
+            }
+            logprint("farplane = %g\n", farplane);
+            i++;
+        } else if (!strcmp(argv[i], "-incremental")) {
+            logprint("incremental = true\n");
+            incremental = true;
+        } else if (!strcmp(argv[i], "-coarse")) {
+            logprint("coarsevis = true\n");
+            coarsevis = true;
+        } else if (!strcmp(argv[i], "-benchmark")) {
+            benchmarkfile = argv[i + 1];
+            logprint("benchmark report = %s\n", benchmarkfile);
+            i++;
         } else if (!strcmp(argv[i], "-v")) {
             logprint("verbose = true\n");
             verbose = 1;
@@ -1266,8 +1550,8 @@ main(int argc, char **argv)
     }
 
     if (i != argc - 1) {
-        printf("usage: vis [-threads #] [-level 0-4] [-fast] [-v|-vv] "
-               "[-credits] bspfile\n");
+        printf("usage: vis [-threads #] [-level 0-4] [-fast] [-farplane n] [-incremental] [-coarse] [-v|-vv] "
+               "[-benchmark file] [-credits] bspfile\n");
         exit(1);
     }
 
@@ -1275,6 +1559,7 @@ main(int argc, char **argv)
     logprint("testlevel = %i\n", testlevel);
 
     stateinterval = 300; /* 5 minutes */
+    journalinterval = 10;
     starttime = statetime = I_FloatTime();
 
     strcpy(sourcefile, argv[i]);
@@ -1291,6 +1576,7 @@ main(int argc, char **argv)
     strcat(portalfile, ".prt");
 
     LoadPortals(portalfile, bsp);
+    phasetime.load = I_FloatTime() - starttime;
 
     strcpy(statefile, sourcefile);
     StripExtension(statefile);
@@ -1300,6 +1586,10 @@ main(int argc, char **argv)
     StripExtension(statetmpfile);
     DefaultExtension(statetmpfile, ".vi0");
 
+    strcpy(journalfile, sourcefile);
+    StripExtension(journalfile);
+    DefaultExtension(journalfile, ".vij");
+
     uncompressed = static_cast<byte *>(calloc(portalleafs, leafbytes_real));
 
 //    CalcPassages ();
@@ -1313,7 +1603,9 @@ main(int argc, char **argv)
     logprint("visdatasize:%i  compressed from %i\n",
              bsp->visdatasize, originalvismapsize);
 
+    double ambientstart = I_FloatTime();
     CalcAmbientSounds(bsp);
+    phasetime.ambient = I_FloatTime() - ambientstart;
 
     /* Convert data format back if necessary */
     ConvertBSPFormat(loadversion, &bspdata);
@@ -1325,6 +1617,9 @@ main(int argc, char **argv)
     endtime = I_FloatTime();
     logprint("%5.1f seconds elapsed\n", endtime - starttime);
 
+    if (benchmarkfile)
+        WriteBenchmark(benchmarkfile);
+
     close_log();
 
     return 0;